@@ -0,0 +1,399 @@
+/******************************************************************************
+ * event engine benchmark on a rack of simulated targets
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "port.h"
+#include "stm32.h"
+#include "stm32_sim.h"
+#include "stats.h"
+#include "flash.h"
+#include "engine.h"
+
+/*
+ * Flash the same image into a rack of simulated bootloaders, each behind
+ * its own pseudo-terminal, once with the event engine on one thread and
+ * once with one blocking thread per target, as flash_gang() does. All
+ * simulators run in a single child process on the master sides.
+ *
+ * usage: bench_engine [-n targets] [-p pid] [-s KiB] [-b baud] [-m] [-o sim options] [-e|-t]
+ *	-m	apply the simulator timing model, see bench_pty.c
+ *	-e	event engine only
+ *	-t	thread per target only
+ */
+
+typedef struct rack
+{
+	int				n;
+	int				*hold;		/* slave sides kept open, so masters never hang up */
+	char			**device;
+	pid_t			child;
+} rack_t;
+
+typedef struct worker
+{
+	port_opt_t			opts;
+	const flash_image_t	*image;
+	int					ok;
+} worker_t;
+
+static void emulator(int *fds, int n, uint16_t pid, const sim_timing_t *timing)
+{
+	struct pollfd *pfd;
+	stm32_sim_t **sim;
+	uint8_t buf[1024];
+	uint64_t t, now, next;
+	ssize_t r;
+	size_t len;
+	int i, timeout;
+
+	pfd = calloc(n, sizeof(struct pollfd));
+	sim = calloc(n, sizeof(stm32_sim_t *));
+	for (i = 0; i < n; i++)
+	{
+		if ((sim[i] = sim_create(pid, timing)) == NULL)
+			_exit(1);
+		pfd[i].fd = fds[i];
+		pfd[i].events = POLLIN;
+	}
+
+	while (1)
+	{
+		now = stats_now_us();
+		next = 0;
+		for (i = 0; i < n; i++)
+			if (sim_next_ready(sim[i], &t) && (next == 0 || t < next))
+				next = t;
+		timeout = -1;
+		if (next)
+			timeout = next > now ? (next - now + 999) / 1000 : 0;
+
+		if (poll(pfd, n, timeout) < 0)
+			break;
+		for (i = 0; i < n; i++)
+		{
+			if (pfd[i].revents & POLLIN)
+			{
+				if ((r = read(pfd[i].fd, buf, sizeof(buf))) > 0)
+					sim_feed(sim[i], buf, r, stats_now_us());
+			}
+			else if (pfd[i].revents & (POLLHUP | POLLERR))
+				pfd[i].fd = -1;
+		}
+
+		now = stats_now_us();
+		for (i = 0; i < n; i++)
+		{
+			len = sim_fetch(sim[i], buf, sizeof(buf), now);
+			if (len && write(fds[i], buf, len) != (ssize_t)len)
+				pfd[i].fd = -1;
+		}
+	}
+	_exit(0);
+}
+
+static int rack_open(rack_t *rack, int n, uint16_t pid, const sim_timing_t *timing)
+{
+	int i, *master;
+
+	master = calloc(n, sizeof(int));
+	rack->hold = calloc(n, sizeof(int));
+	rack->device = calloc(n, sizeof(char *));
+	rack->n = n;
+	for (i = 0; i < n; i++)
+	{
+		if ((master[i] = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+		    || grantpt(master[i]) || unlockpt(master[i]))
+		{
+			perror("posix_openpt");
+			return -1;
+		}
+		rack->device[i] = strdup(ptsname(master[i]));
+		rack->hold[i] = open(rack->device[i], O_RDWR | O_NOCTTY);
+	}
+
+	if ((rack->child = fork()) == 0)
+		emulator(master, n, pid, timing);
+	for (i = 0; i < n; i++)
+		close(master[i]);
+	free(master);
+	return 0;
+}
+
+static void rack_close(rack_t *rack)
+{
+	int i;
+
+	kill(rack->child, SIGTERM);
+	waitpid(rack->child, NULL, 0);
+	for (i = 0; i < rack->n; i++)
+	{
+		close(rack->hold[i]);
+		free(rack->device[i]);
+	}
+	free(rack->hold);
+	free(rack->device);
+}
+
+/* the blocking flow of one target, as flash_run() does it without journal */
+static void *worker(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+	port_interface_t *port;
+	stm32_struct_t *stm;
+	uint32_t addr, start;
+	unsigned int len;
+
+	if (port_open(&w->opts, &port) != PORT_OK)
+		return NULL;
+	if ((stm = stm32_init(port, STM32_INIT_PIPELINE)) == NULL)
+		goto out;
+	if (stm32_erase_memory(stm, 0, 0xFF) != STM32_OK)
+		goto out;
+
+	start = stm->dev->fl_start;
+	for (addr = start; addr < start + w->image->size; addr += len)
+	{
+		len = start + w->image->size - addr > 256 ? 256 : start + w->image->size - addr;
+		if (stm32_write_memory(stm, addr, w->image->data + addr - start, len) != STM32_OK)
+			goto out;
+	}
+	w->ok = stm32_verify_crc(stm, start, w->image->data, w->image->size) == STM32_OK;
+
+out:
+	if (stm)
+		stm32_close(stm);
+	port_close(port);
+	return NULL;
+}
+
+static double cpu_ms(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec * 1e3 + ru.ru_utime.tv_usec / 1e3
+		+ ru.ru_stime.tv_sec * 1e3 + ru.ru_stime.tv_usec / 1e3;
+}
+
+static long csw(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+static void report(const char *mode, int n, int ok, const flash_image_t *img,
+				   uint64_t t_us, double cpu, long cs)
+{
+	printf("%-8s: %d/%d ok, %.3f s, %.1f KiB/s total, cpu %.1f ms, %ld ctx switches\n",
+		   mode, ok, n, t_us / 1e6, ok * (img->size / 1024.0) * 1e6 / t_us, cpu, cs);
+}
+
+static int run_threads(const rack_t *rack, port_opt_t *opts, const flash_image_t *img)
+{
+	pthread_t *th;
+	worker_t *w;
+	uint64_t t0;
+	double cpu0;
+	long cs0;
+	int i, started, ok = 0;
+
+	th = calloc(rack->n, sizeof(pthread_t));
+	w = calloc(rack->n, sizeof(worker_t));
+	t0 = stats_now_us();
+	cpu0 = cpu_ms();
+	cs0 = csw();
+	for (started = 0; started < rack->n; started++)
+	{
+		i = started;
+		w[i].opts = *opts;
+		w[i].opts.device = rack->device[i];
+		w[i].image = img;
+		if (pthread_create(&th[i], NULL, worker, &w[i]) != 0)
+		{
+			fprintf(stderr, "Failed to start thread %d\n", i);
+			break;
+		}
+	}
+	for (i = 0; i < started; i++)
+	{
+		pthread_join(th[i], NULL);
+		ok += w[i].ok;
+	}
+	report("threads", rack->n, ok, img, stats_now_us() - t0, cpu_ms() - cpu0, csw() - cs0);
+	free(th);
+	free(w);
+	return ok == rack->n ? 0 : 1;
+}
+
+static int run_engine(const rack_t *rack, port_opt_t *opts, const flash_image_t *img)
+{
+	port_interface_t **port;
+	engine_target_t *t;
+	engine_t *e;
+	uint64_t t0;
+	double cpu0;
+	long cs0;
+	int i, ok = 0;
+
+	port = calloc(rack->n, sizeof(port_interface_t *));
+	t = calloc(rack->n, sizeof(engine_target_t));
+	if ((e = engine_create(rack->n)) == NULL)
+		return 1;
+
+	t0 = stats_now_us();
+	cpu0 = cpu_ms();
+	cs0 = csw();
+	for (i = 0; i < rack->n; i++)
+	{
+		opts->device = rack->device[i];
+		if (port_open(opts, &port[i]) != PORT_OK)
+			continue;
+		engine_target_init(&t[i], port[i], img);
+		t[i].verify = 1;
+		t[i].init_flags = STM32_INIT_PIPELINE;	/* as worker() */
+		engine_add(e, &t[i]);
+	}
+	engine_run(e);
+
+	for (i = 0; i < rack->n; i++)
+	{
+		if (t[i].phase == FLASH_DONE)
+			ok++;
+		else if (t[i].phase == FLASH_FAILED)
+			fprintf(stderr, "%s: %s\n", rack->device[i], t[i].error);
+	}
+	report("engine", rack->n, ok, img, stats_now_us() - t0, cpu_ms() - cpu0, csw() - cs0);
+	printf("          %llu wakeups, %llu read, %llu write, %llu timeouts\n",
+		   (unsigned long long)e->wakeups, (unsigned long long)e->reads,
+		   (unsigned long long)e->writes, (unsigned long long)e->timeouts);
+
+	for (i = 0; i < rack->n; i++)
+		if (port[i])
+			port_close(port[i]);
+	engine_destroy(e);
+	free(port);
+	free(t);
+	return ok == rack->n ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+	sim_timing_t timing;
+	port_opt_t opts = {
+		.device			= NULL,
+		.baudrate		= SERIAL_BAUD_115200,
+		.serial_mode	= "8e1",
+		.rx_frame_max	= STM32_MAX_RX_FRAME,
+		.tx_frame_max	= STM32_MAX_TX_FRAME,
+	};
+	flash_image_t img;
+	struct rlimit rl;
+	rack_t rack;
+	unsigned int kib = 16, pid = 0x410, i;
+	const char *sim_opts = NULL;
+	int n = 128, model = 0, engine = 1, threads = 1, c, ret = 0;
+
+	while ((c = getopt(argc, argv, "n:p:s:b:mo:et")) != -1)
+	{
+		switch (c)
+		{
+			case 'n': n = strtoul(optarg, NULL, 0); break;
+			case 'p': pid = strtoul(optarg, NULL, 16); break;
+			case 's': kib = strtoul(optarg, NULL, 0); break;
+			case 'b':
+				opts.baudrate = serial_get_baud(strtoul(optarg, NULL, 0));
+				if (opts.baudrate == SERIAL_BAUD_INVALID)
+				{
+					fprintf(stderr, "Invalid baud rate %s\n", optarg);
+					return 2;
+				}
+				break;
+			case 'm': model = 1; break;
+			case 'o': sim_opts = optarg; break;
+			case 'e': threads = 0; break;
+			case 't': engine = 0; break;
+			default:
+				fprintf(stderr, "usage: %s [-n targets] [-p pid] [-s KiB] [-b baud] [-m] [-o sim options] [-e|-t]\n", argv[0]);
+				return 2;
+		}
+	}
+	if (n < 1)
+		return 2;
+
+	sim_timing_default(&timing);
+	timing.baud = serial_get_baud_int(opts.baudrate);
+	if (!model)
+	{
+		timing.baud = 0;
+		timing.latency_us = 0;
+		timing.page_erase_us = 0;
+		timing.mass_erase_us = 0;
+		timing.word_prog_us = 0;
+	}
+	if (sim_parse_options(sim_opts, &timing, NULL) != 0)
+	{
+		fprintf(stderr, "Invalid simulator options \"%s\"\n", sim_opts);
+		return 2;
+	}
+
+	/* two descriptors per target on this side */
+	getrlimit(RLIMIT_NOFILE, &rl);
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	img.size = kib * 1024;
+	img.data = malloc(img.size);
+	for (i = 0; i < img.size; i++)
+		img.data[i] = i * 7 + (i >> 8);
+
+	printf("rack       : %d x sim 0x%03x, %u KiB each, %u baud%s\n", n, pid, kib,
+		   serial_get_baud_int(opts.baudrate), model ? ", timing model" : "");
+
+	if (engine)
+	{
+		if (rack_open(&rack, n, pid, &timing) != 0)
+			return 1;
+		ret |= run_engine(&rack, &opts, &img);
+		rack_close(&rack);
+	}
+	if (threads)
+	{
+		if (rack_open(&rack, n, pid, &timing) != 0)
+			return 1;
+		ret |= run_threads(&rack, &opts, &img);
+		rack_close(&rack);
+	}
+	free(img.data);
+	return ret;
+}
@@ -0,0 +1,307 @@
+/******************************************************************************
+ * end-to-end flashing benchmark over a pseudo-terminal
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "port.h"
+#include "stm32.h"
+#include "stm32_sim.h"
+#include "stats.h"
+
+/*
+ * Drive the unmodified POSIX serial backend through a full init, erase
+ * and write cycle against a simulated bootloader that runs in a child
+ * process on the master side of a pseudo-terminal pair. Every byte goes
+ * through termios, the tty line discipline and one syscall per
+ * port->read()/write(), as it does with a real adapter.
+ *
+ * usage: bench_pty [-p pid] [-s KiB] [-b baud] [-m] [-r] [-t] [-o sim options] [-f fault spec]
+ *	-t	serve the bootloader on a loopback TCP socket instead and
+ *		open it as tcp://127.0.0.1:<port>, a stand-in for a
+ *		serial-to-Ethernet server
+ *	-r	read the written range back afterwards and count its syscalls
+ *	-m	apply the simulator timing model (wire time, latency, erase
+ *		and program times); by default replies are sent as soon as
+ *		they are complete, which measures the host path alone.
+ */
+
+static void emulator(int fd, uint16_t pid, const sim_timing_t *timing)
+{
+	struct pollfd pfd;
+	stm32_sim_t *sim;
+	uint8_t buf[1024];
+	uint64_t t, now;
+	ssize_t r;
+	size_t n;
+	int timeout;
+
+	if ((sim = sim_create(pid, timing)) == NULL)
+		_exit(1);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (1)
+	{
+		timeout = -1;
+		now = stats_now_us();
+		if (sim_next_ready(sim, &t))
+			timeout = t > now ? (t - now + 999) / 1000 : 0;
+
+		if (poll(&pfd, 1, timeout) < 0)
+			break;
+		if (pfd.revents & POLLIN)
+		{
+			r = read(fd, buf, sizeof(buf));
+			if (r <= 0)
+				break;
+			sim_feed(sim, buf, r, stats_now_us());
+		}
+		else if (pfd.revents & (POLLHUP | POLLERR))
+			break;
+
+		n = sim_fetch(sim, buf, sizeof(buf), stats_now_us());
+		if (n && write(fd, buf, n) != (ssize_t)n)
+			break;
+	}
+	_exit(0);
+}
+
+/* read(2) and write(2) calls of this process so far */
+static void syscalls(unsigned long long *rd, unsigned long long *wr)
+{
+	char line[64];
+	FILE *f;
+
+	*rd = *wr = 0;
+	if ((f = fopen("/proc/self/io", "r")) == NULL)
+		return;
+	while (fgets(line, sizeof(line), f))
+	{
+		sscanf(line, "syscr: %llu", rd);
+		sscanf(line, "syscw: %llu", wr);
+	}
+	fclose(f);
+}
+
+static long csw(void)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_nvcsw + ru.ru_nivcsw;
+}
+
+int main(int argc, char **argv)
+{
+	sim_timing_t timing;
+	port_opt_t opts = {
+		.device			= NULL,
+		.baudrate		= SERIAL_BAUD_115200,
+		.serial_mode	= "8e1",
+		.rx_frame_max	= STM32_MAX_RX_FRAME,
+		.tx_frame_max	= STM32_MAX_TX_FRAME,
+	};
+	port_interface_t *port = NULL;
+	stm32_struct_t *stm = NULL;
+	stats_hist_t block = { 0 };
+	unsigned long long rd0, wr0, rd1, wr1, rd2, wr2;
+	uint64_t t0, t_init, t_erase, t_write, t;
+	unsigned int kib = 64, pid = 0x410, baud, len;
+	const char *sim_opts = NULL;
+	uint8_t data[256], back[256];
+	uint32_t addr, end;
+	pid_t child;
+	long csw0;
+	struct sockaddr_in sin = { .sin_family = AF_INET };
+	socklen_t slen = sizeof(sin);
+	char device[32];
+	int model = 0, readback = 0, tcp = 0, master, c, ret = 1;
+
+	while ((c = getopt(argc, argv, "p:s:b:mrto:f:")) != -1)
+	{
+		switch (c)
+		{
+			case 'p': pid = strtoul(optarg, NULL, 16); break;
+			case 's': kib = strtoul(optarg, NULL, 0); break;
+			case 'b':
+				opts.baudrate = serial_get_baud(strtoul(optarg, NULL, 0));
+				if (opts.baudrate == SERIAL_BAUD_INVALID)
+				{
+					fprintf(stderr, "Invalid baud rate %s\n", optarg);
+					return 2;
+				}
+				break;
+			case 'm': model = 1; break;
+			case 'r': readback = 1; break;
+			case 't': tcp = 1; break;
+			case 'o': sim_opts = optarg; break;
+			case 'f': opts.fault = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-p pid] [-s KiB] [-b baud] [-m] [-r] [-t] [-o sim options] [-f fault spec]\n", argv[0]);
+				return 2;
+		}
+	}
+
+	sim_timing_default(&timing);
+	baud = serial_get_baud_int(opts.baudrate);
+	timing.baud = baud;
+	if (!model)
+	{
+		timing.baud = 0;
+		timing.latency_us = 0;
+		timing.page_erase_us = 0;
+		timing.mass_erase_us = 0;
+		timing.word_prog_us = 0;
+	}
+	if (sim_parse_options(sim_opts, &timing, NULL) != 0)
+	{
+		fprintf(stderr, "Invalid simulator options \"%s\"\n", sim_opts);
+		return 2;
+	}
+
+	if (tcp)
+	{
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		if ((master = socket(AF_INET, SOCK_STREAM, 0)) < 0
+		    || bind(master, (struct sockaddr *)&sin, sizeof(sin))
+		    || listen(master, 1)
+		    || getsockname(master, (struct sockaddr *)&sin, &slen))
+		{
+			perror("socket");
+			return 1;
+		}
+		snprintf(device, sizeof(device), "tcp://127.0.0.1:%u", ntohs(sin.sin_port));
+		opts.device = device;
+	}
+	else
+	{
+		if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0
+		    || grantpt(master) || unlockpt(master))
+		{
+			perror("posix_openpt");
+			return 1;
+		}
+		opts.device = ptsname(master);
+	}
+
+	if ((child = fork()) == 0)
+		emulator(tcp ? accept(master, NULL, NULL) : master, pid, &timing);
+
+	t0 = stats_now_us();
+	if (port_open(&opts, &port) != PORT_OK)
+	{
+		fprintf(stderr, "Failed to open %s\n", opts.device);
+		goto out;
+	}
+	syscalls(&rd0, &wr0);
+	csw0 = csw();
+
+	if ((stm = stm32_init(port, 0)) == NULL)
+	{
+		fprintf(stderr, "Failed to initialize the simulated device\n");
+		goto out;
+	}
+	t_init = stats_now_us();
+
+	if (stm32_erase_memory(stm, 0, 0xFF) != STM32_OK)
+		goto out;
+	t_erase = stats_now_us();
+
+	addr = stm->dev->fl_start;
+	end = addr + kib * 1024;
+	if (end > stm->dev->fl_end)
+		end = stm->dev->fl_end;
+	for (len = 0; len < sizeof(data); len++)
+		data[len] = len * 7;
+
+	while (addr < end)
+	{
+		len = end - addr > sizeof(data) ? sizeof(data) : end - addr;
+		t = stats_now_us();
+		if (stm32_write_memory(stm, addr, data, len) != STM32_OK)
+		{
+			fprintf(stderr, "Write failed at 0x%08x\n", addr);
+			goto out;
+		}
+		stats_hist_add(&block, stats_now_us() - t);
+		addr += len;
+	}
+	t_write = stats_now_us();
+	syscalls(&rd1, &wr1);
+
+	kib = (end - stm->dev->fl_start) / 1024;
+	printf("device     : %s (0x%03x) on %s, %u baud%s\n", stm->dev->name, stm->pid,
+		   opts.device, baud, model ? ", timing model" : "");
+	printf("wall time  : init %.3f ms, erase %.3f ms, write %.3f ms (%u KiB)\n",
+		   (t_init - t0) / 1000.0, (t_erase - t_init) / 1000.0, (t_write - t_erase) / 1000.0, kib);
+	printf("throughput : %.1f KiB/s\n", kib * 1e6 / (t_write - t_erase));
+	/* /proc/self/io does not count send(2) and recv(2) */
+	if (!tcp)
+		printf("syscalls   : %llu read, %llu write, %.1f per KiB\n", rd1 - rd0, wr1 - wr0,
+			   kib ? (double)(rd1 - rd0 + wr1 - wr0) / kib : 0.0);
+	if (readback)
+	{
+		for (addr = stm->dev->fl_start; addr < end; addr += len)
+		{
+			len = end - addr > sizeof(back) ? sizeof(back) : end - addr;
+			if (stm32_read_memory(stm, addr, back, len) != STM32_OK
+			    || memcmp(back, data, len))
+			{
+				fprintf(stderr, "Read back failed at 0x%08x\n", addr);
+				goto out;
+			}
+		}
+		syscalls(&rd2, &wr2);
+		if (!tcp)
+			printf("read back  : %llu read, %llu write, %.1f per KiB\n", rd2 - rd1, wr2 - wr1,
+				   kib ? (double)(rd2 - rd1 + wr2 - wr1) / kib : 0.0);
+	}
+	printf("ctx switch : %ld, %.1f per KiB\n", csw() - csw0, kib ? (double)(csw() - csw0) / kib : 0.0);
+	printf("block (us) : mean %llu p50 %llu p90 %llu p99 %llu max %u\n",
+		   (unsigned long long)(block.count ? block.total_us / block.count : 0),
+		   (unsigned long long)stats_hist_percentile(&block, 50),
+		   (unsigned long long)stats_hist_percentile(&block, 90),
+		   (unsigned long long)stats_hist_percentile(&block, 99),
+		   block.max_us);
+	ret = 0;
+
+out:
+	if (stm)
+		stm32_close(stm);
+	if (port)
+		port_close(port);
+	kill(child, SIGTERM);
+	waitpid(child, NULL, 0);
+	close(master);
+	return ret;
+}
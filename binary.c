@@ -0,0 +1,117 @@
+/******************************************************************************
+ * raw binary image
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include "binary.h"
+
+void* binary_init() 
+{
+	return calloc(1, sizeof(binary_t));
+}
+
+/* the whole file is the image, "-" reads it from the standard input */
+parser_t binary_open(void *storage, const char *filename)
+{
+	binary_t *st = (binary_t *)storage;
+	size_t alloc = 0;
+	uint8_t *p;
+	ssize_t r;
+	int fd;
+
+	if (strcmp(filename, "-") == 0)
+		fd = dup(STDIN_FILENO);
+	else
+		fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		return PARSER_ERR_SYSTEM;
+
+	do 
+	{
+		if (st->data_len == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 64 * 1024;
+			if ((p = realloc(st->data, alloc)) == NULL)
+			{
+				close(fd);
+				return PARSER_ERR_SYSTEM;
+			}
+			st->data = p;
+		}
+		r = read(fd, st->data + st->data_len, alloc - st->data_len);
+		if (r > 0)
+			st->data_len += r;
+	} while (r > 0);
+	close(fd);
+
+	return r < 0 ? PARSER_ERR_SYSTEM : PARSER_OK;
+}
+
+parser_t binary_close(void *storage) 
+{
+	binary_t *st = storage;
+	assert (st != NULL);
+	free(st->data);
+	free(st);
+	return PARSER_OK;
+}
+
+unsigned int binary_size(void *storage) 
+{
+	binary_t *st = storage;
+	
+	return st->data_len;
+}
+
+parser_t binary_read(void *storage, void *data, unsigned int *len) 
+{
+	binary_t *st = storage;
+	unsigned int left = st->data_len - st->offset;
+	unsigned int get  = left > *len ? *len : left;
+
+	memcpy(data, &st->data[st->offset], get);
+	st->offset += get;
+
+	*len = get;
+	return PARSER_OK;
+}
+
+parser_t binary_write(void *storage, void *data, unsigned int len) 
+{
+	return PARSER_ERR_RDONLY;
+}
+
+parser_ops_t PARSER_BINARY = {
+	"Raw Binary",
+	binary_init,
+	binary_open,
+	binary_close,
+	binary_size,
+	binary_read,
+	binary_write
+};
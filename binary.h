@@ -0,0 +1,44 @@
+/******************************************************************************
+ * raw binary image
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _BINARY_H
+#define _BINARY_H
+#include <stddef.h>
+#include <stdint.h>
+#include "parser.h"
+
+extern parser_ops_t PARSER_BINARY;
+
+typedef struct 
+{
+	size_t		data_len, offset;
+	uint8_t		*data;
+}binary_t;
+
+void*			binary_init();
+parser_t		binary_open(void *storage, const char *filename);
+parser_t		binary_close(void *storage);
+unsigned int	binary_size(void *storage);
+parser_t		binary_read(void *storage, void *data, unsigned int *len);
+parser_t		binary_write(void *storage, void *data, unsigned int len);
+
+#endif
@@ -0,0 +1,568 @@
+/******************************************************************************
+ * headless command line flashing
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "parser.h"
+#include "hex.h"
+#include "binary.h"
+#include "port.h"
+#include "stm32.h"
+#include "flash.h"
+#include "journal.h"
+#include "daemon.h"
+#include "log.h"
+
+/*
+ * The flashing flow of the GUI without GTK, for production lines and
+ * CI. Several -d options flash the same image into several boards at
+ * once, as "Download All" does. With -D the jobs are handed to
+ * stm-daemon instead, see daemon.h.
+ */
+
+typedef enum
+{
+	CLI_OK = 0,
+	CLI_ERR_USAGE,
+	CLI_ERR_IMAGE,		/* cannot read or parse the image */
+	CLI_ERR_CONNECT,	/* no port or no bootloader answering */
+	CLI_ERR_ERASE,
+	CLI_ERR_WRITE,
+	CLI_ERR_VERIFY,
+	CLI_ERR_CANCEL,		/* interrupted, the next run resumes */
+} cli_t;
+
+static int quiet;
+static int gang;
+static flash_job_t *running;
+static int nrunning;
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] -d device [-d device ...] image\n"
+		"	image		Intel HEX or raw binary, \"-\" for the standard input\n"
+		"	-d device	serial port, tcp://host:port, rfc2217://host:port\n"
+		"			or sim:<pid>[,options], once per board\n"
+		"	-b baud		baud rate (default 115200), any rate the adapter takes,\n"
+		"			\"auto\" to tune the link\n"
+		"	-m mode		serial mode (default 8e1)\n"
+		"	-f hex|bin	image format (default: hex for *.hex, *.ihx and stdin)\n"
+		"	-S addr[:len]	write at addr, at most len bytes of the image\n"
+		"	-e auto|mass|pages|none\n"
+		"			erase strategy (default auto: mass, or pages when\n"
+		"			resuming or writing at an offset)\n"
+		"	-v		verify the image after writing\n"
+		"	-u r|w|rw	remove the readout (erases the flash) and/or write\n"
+		"			protection first\n"
+		"	-R		reset into the bootloader through RTS (BOOT0) and DTR (NRST)\n"
+		"	-p		pipelined handshake\n"
+		"	-L		low latency profile for USB serial adapters\n"
+		"	-q		no progress, log or report lines\n"
+		"	-j file		JSON summary of the run, \"-\" for the standard output (not with -D)\n"
+		"	-D socket	queue the jobs on stm-daemon instead (it listens on %s)\n"
+		"exit status: 0 done, 1 usage, 2 image, 3 connect, 4 erase, 5 write, 6 verify,\n"
+		"	7 interrupted (the first ^C stops between two frames, the second at once)\n",
+		name, DAEMON_SOCKET);
+}
+
+static void cli_log(flash_job_t *job, const char *msg)
+{
+	if (quiet)
+		return;
+	if (gang)
+		log_msg(LOG_LVL_INFO, NULL, "%s: %s", job->device, msg);
+	else
+		log_msg(LOG_LVL_INFO, NULL, "%s", msg);
+}
+
+static void cli_progress(flash_job_t *job, flash_phase_t phase, double fraction)
+{
+	char rate[64];
+
+	if (quiet || gang || !isatty(STDERR_FILENO) || (phase != FLASH_WRITE && phase != FLASH_VERIFY))
+		return;
+	flash_rate_str(job, rate, sizeof(rate));
+	fprintf(stderr, "\r%-6s %3d%%  %-32s", flash_phase_name(phase), (int)(fraction * 100), rate);
+	if (fraction >= 1)
+		fprintf(stderr, "\n");
+}
+
+static int cli_summary(const char *filename, const flash_job_t *jobs, int n)
+{
+	FILE *f = strcmp(filename, "-") ? fopen(filename, "w") : stdout;
+
+	if (f == NULL)
+	{
+		fprintf(stderr, "Can't write %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+	flash_summary_json(jobs, n, f);
+	if (f != stdout)
+		fclose(f);
+	return 0;
+}
+
+/* leave the bootloaders waiting for a command, then the next ^C kills */
+static void cli_interrupt(int sig)
+{
+	int i;
+
+	for (i = 0; i < nrunning; i++)
+		flash_cancel(&running[i]);
+}
+
+static parser_ops_t *cli_parser(const char *format, const char *filename)
+{
+	const char *ext = strrchr(filename, '.');
+
+	if (format == NULL)
+	{
+		if (strcmp(filename, "-") == 0 || (ext && (!strcmp(ext, ".hex") || !strcmp(ext, ".ihx"))))
+			return &PARSER_HEX;
+		return &PARSER_BINARY;
+	}
+	if (strcmp(format, "hex") == 0)
+		return &PARSER_HEX;
+	if (strcmp(format, "bin") == 0)
+		return &PARSER_BINARY;
+	return NULL;
+}
+
+static cli_t cli_status(const flash_job_t *job)
+{
+	if (job->phase == FLASH_DONE)
+		return CLI_OK;
+	if (job->cancelled)
+		return CLI_ERR_CANCEL;
+	switch (job->failed_in)
+	{
+		case FLASH_ERASE:	return CLI_ERR_ERASE;
+		case FLASH_WRITE:	return CLI_ERR_WRITE;
+		case FLASH_VERIFY:	return CLI_ERR_VERIFY;
+		default:			return CLI_ERR_CONNECT;
+	}
+}
+
+/* client of stm-daemon */
+
+typedef struct
+{
+	FILE			*f;
+	flash_job_t		*jobs;
+	int				n;
+	unsigned int	ids[FLASH_GANG_MAX];		/* 0 until queued */
+	char			reports[FLASH_GANG_MAX][256];
+	int				running;
+	char			line[DAEMON_LINE_MAX];
+} remote_t;
+
+static flash_job_t *remote_job(remote_t *r, unsigned int id)
+{
+	int i;
+
+	for (i = 0; i < r->n; i++)
+		if (r->ids[i] == id)
+			return &r->jobs[i];
+	return NULL;
+}
+
+static flash_phase_t remote_phase(const char *name)
+{
+	flash_phase_t phase;
+
+	for (phase = FLASH_IDLE; phase < FLASH_PHASES; phase++)
+		if (strcmp(flash_phase_name(phase), name) == 0)
+			break;
+	return phase;
+}
+
+/* next line from the daemon, 0 once it is gone */
+static int remote_line(remote_t *r)
+{
+	if (fgets(r->line, sizeof(r->line), r->f) == NULL)
+		return 0;
+	r->line[strcspn(r->line, "\n")] = 0;
+	return 1;
+}
+
+/* handle r->line if it is an event of one of our jobs */
+static int remote_event(remote_t *r)
+{
+	char phase[16], failed[16];
+	flash_job_t *job;
+	unsigned long eta_ms;
+	unsigned int id;
+	int off, percent;
+	double rate;
+
+	if (sscanf(r->line, "LOG %u %n", &id, &off) == 1 && (job = remote_job(r, id)))
+		cli_log(job, r->line + off);
+	else if (sscanf(r->line, "PROGRESS %u %15s %d %n", &id, phase, &percent, &off) == 3
+			 && (job = remote_job(r, id)))
+	{
+		/* rate and time left, when the daemon knows them */
+		if (sscanf(r->line + off, "%lf %lu", &rate, &eta_ms) != 2)
+			rate = eta_ms = 0;
+		job->rate_bps = rate;
+		job->eta_us = (uint64_t)eta_ms * 1000;
+		cli_progress(job, remote_phase(phase), percent / 100.0);
+	}
+	else if (sscanf(r->line, "DONE %u %15s %15s %n", &id, phase, failed, &off) == 3
+			 && (job = remote_job(r, id)))
+	{
+		job->phase = remote_phase(phase);
+		job->failed_in = remote_phase(failed);
+		snprintf(r->reports[job - r->jobs], sizeof(r->reports[0]), "%s", r->line + off);
+		r->running--;
+	}
+	else
+		return 0;
+	return 1;
+}
+
+/* reply to the last command; events of queued jobs may come first */
+static const char *remote_reply(remote_t *r)
+{
+	while (remote_line(r))
+		if (!remote_event(r))
+			return r->line;
+	return "";
+}
+
+static int remote_send(int fd, const char *fmt, ...)
+{
+	char buf[DAEMON_LINE_MAX];
+	va_list ap;
+	size_t len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= sizeof(buf))
+		return -1;
+	return write(fd, buf, len) == (ssize_t)len ? 0 : -1;
+}
+
+static cli_t cli_remote(const char *path, flash_job_t *jobs, int n)
+{
+	const flash_job_t *j = &jobs[0];
+	const flash_image_t *img = j->image;
+	unsigned long long hash = journal_hash(img->data, img->size);
+	static remote_t r;
+	struct sockaddr_un addr;
+	const char *reply;
+	char options[192];
+	int fd, i, upload;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	    || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || (r.f = fdopen(dup(fd), "r")) == NULL)
+	{
+		perror(path);
+		return CLI_ERR_CONNECT;
+	}
+	r.jobs = jobs;
+	r.n = n;
+
+	snprintf(options, sizeof(options), "%s%s%s%s mode=%s address=0x%x erase=%s",
+			 j->verify ? " verify" : "",
+			 (j->init_flags & STM32_INIT_RESET) ? " reset" : "",
+			 (j->init_flags & STM32_INIT_PIPELINE) ? " pipeline" : "",
+			 j->opts.low_latency ? " lowlatency" : "",
+			 j->opts.serial_mode, j->address,
+			 j->erase == FLASH_ERASE_MASS ? "mass" : j->erase == FLASH_ERASE_PAGES ? "pages"
+			 : j->erase == FLASH_ERASE_NONE ? "none" : "auto");
+	if (j->unprotect & FLASH_UNPROTECT_READ)
+		strcat(options, " unprotect=read");
+	if (j->unprotect & FLASH_UNPROTECT_WRITE)
+		strcat(options, " unprotect=write");
+	if (j->autotune)
+		strcat(options, " baud=auto");
+	else
+		snprintf(options + strlen(options), sizeof(options) - strlen(options), " baud=%u",
+				 serial_get_baud_int(j->opts.baudrate));
+
+	upload = remote_send(fd, "HAVE %016llx\n", hash) != 0 || strcmp(remote_reply(&r), "YES") != 0;
+	for (i = 0; i < n; )
+	{
+		/* the image is sent once, and again if the daemon dropped it meanwhile */
+		if (upload)
+		{
+			if (remote_send(fd, "IMAGE %u\n", img->size) != 0
+			    || write(fd, img->data, img->size) != (ssize_t)img->size
+			    || strncmp(reply = remote_reply(&r), "IMAGE ", 6) != 0
+			    || strtoull(reply + 6, NULL, 16) != hash)
+			{
+				fprintf(stderr, "Image upload failed\n");
+				break;
+			}
+			upload = 0;
+		}
+
+		if (remote_send(fd, "FLASH %s %016llx%s\n", jobs[i].device, hash, options) != 0)
+			break;
+		reply = remote_reply(&r);
+		if (sscanf(reply, "QUEUED %u", &r.ids[i]) == 1)
+		{
+			r.running++;
+			i++;
+		}
+		else if (strcmp(reply, "NO") == 0)
+			upload = 1;
+		else if (strncmp(reply, "BUSY ", 5) == 0)
+			usleep(200000);		/* back-pressure: the port queue is full */
+		else if (*reply == 0)
+			break;
+		else
+		{
+			fprintf(stderr, "%s: %s\n", jobs[i].device, reply);
+			i++;
+		}
+	}
+
+	while (r.running && remote_line(&r))
+		remote_event(&r);
+	if (r.running)
+		fprintf(stderr, "Lost the connection to the daemon\n");
+
+	for (i = 0; i < n; i++)
+	{
+		/* jobs the daemon did not take, or did not finish */
+		if (r.ids[i] == 0 || (jobs[i].phase != FLASH_DONE && jobs[i].phase != FLASH_FAILED))
+		{
+			jobs[i].phase = FLASH_FAILED;
+			jobs[i].failed_in = FLASH_CONNECT;
+		}
+		if (!quiet && r.ids[i])
+			printf("%s\n", r.reports[i]);
+	}
+	fclose(r.f);
+	close(fd);
+	return CLI_OK;
+}
+
+int main(int argc, char **argv)
+{
+	port_opt_t opts = {
+		.device			= NULL,
+		.baudrate		= SERIAL_BAUD_115200,
+		.serial_mode	= "8e1",
+		.bus_addr		= 0,
+		.rx_frame_max	= STM32_MAX_RX_FRAME,
+		.tx_frame_max	= STM32_MAX_TX_FRAME,
+		.record			= NULL,
+		.fault			= NULL,
+	};
+	const char *devices[FLASH_GANG_MAX];
+	flash_job_t jobs[FLASH_GANG_MAX];
+	const char *format = NULL, *remote = NULL, *summary = NULL;
+	flash_erase_t erase = FLASH_ERASE_AUTO;
+	unsigned long address = 0, length = 0;
+	unsigned int init_flags = 0, unprotect = 0;
+	parser_ops_t *parser;
+	parser_t parser_err;
+	flash_image_t image;
+	struct sigaction sa;
+	char *end;
+	int n = 0, autotune = 0, verify = 0, i, c;
+	cli_t ret = CLI_OK;
+
+	while ((c = getopt(argc, argv, "d:b:m:f:S:e:u:vRpLqj:D:h")) != -1)
+	{
+		switch (c)
+		{
+			case 'd':
+				if (n == FLASH_GANG_MAX)
+				{
+					fprintf(stderr, "At most %d devices\n", FLASH_GANG_MAX);
+					return CLI_ERR_USAGE;
+				}
+				devices[n++] = optarg;
+				break;
+			case 'b':
+				if (strcmp(optarg, "auto") == 0)
+				{
+					autotune = 1;
+					break;
+				}
+				opts.baudrate = serial_get_baud(strtoul(optarg, NULL, 0));
+				if (opts.baudrate == SERIAL_BAUD_INVALID)
+				{
+					fprintf(stderr, "Baud rate %s not supported\n", optarg);
+					return CLI_ERR_USAGE;
+				}
+				break;
+			case 'm':
+				if (serial_get_bits(optarg) == SERIAL_BITS_INVALID
+				    || serial_get_parity(optarg) == SERIAL_PARITY_INVALID
+				    || serial_get_stopbit(optarg) == SERIAL_STOPBIT_INVALID)
+				{
+					fprintf(stderr, "Invalid serial mode %s\n", optarg);
+					return CLI_ERR_USAGE;
+				}
+				opts.serial_mode = optarg;
+				break;
+			case 'f':
+				format = optarg;
+				break;
+			case 'S':
+				address = strtoul(optarg, &end, 0);
+				if (*end == ':')
+					length = strtoul(end + 1, &end, 0);
+				if (*end != 0 || address == 0)
+				{
+					fprintf(stderr, "Invalid address range %s\n", optarg);
+					return CLI_ERR_USAGE;
+				}
+				break;
+			case 'e':
+				if (strcmp(optarg, "auto") == 0)
+					erase = FLASH_ERASE_AUTO;
+				else if (strcmp(optarg, "mass") == 0)
+					erase = FLASH_ERASE_MASS;
+				else if (strcmp(optarg, "pages") == 0)
+					erase = FLASH_ERASE_PAGES;
+				else if (strcmp(optarg, "none") == 0)
+					erase = FLASH_ERASE_NONE;
+				else
+				{
+					fprintf(stderr, "Invalid erase strategy %s\n", optarg);
+					return CLI_ERR_USAGE;
+				}
+				break;
+			case 'u':
+				if (strcmp(optarg, "r") == 0)
+					unprotect = FLASH_UNPROTECT_READ;
+				else if (strcmp(optarg, "w") == 0)
+					unprotect = FLASH_UNPROTECT_WRITE;
+				else if (strcmp(optarg, "rw") == 0)
+					unprotect = FLASH_UNPROTECT_READ | FLASH_UNPROTECT_WRITE;
+				else
+				{
+					fprintf(stderr, "Invalid protection %s\n", optarg);
+					return CLI_ERR_USAGE;
+				}
+				break;
+			case 'v': verify = 1; break;
+			case 'R': init_flags |= STM32_INIT_RESET; break;
+			case 'p': init_flags |= STM32_INIT_PIPELINE; break;
+			case 'L': opts.low_latency = 1; break;
+			case 'q': quiet = 1; break;
+			case 'j': summary = optarg; break;
+			case 'D': remote = optarg; break;
+			case 'h':
+				usage(argv[0]);
+				return CLI_OK;
+			default:
+				usage(argv[0]);
+				return CLI_ERR_USAGE;
+		}
+	}
+	if (n == 0 || optind != argc - 1)
+	{
+		usage(argv[0]);
+		return CLI_ERR_USAGE;
+	}
+	if ((parser = cli_parser(format, argv[optind])) == NULL)
+	{
+		fprintf(stderr, "Unknown image format %s\n", format);
+		return CLI_ERR_USAGE;
+	}
+	opts.record = getenv("GSTM32FLASH_RECORD");
+	opts.fault = getenv("GSTM32FLASH_FAULT");
+	if (quiet)
+		log_set_level(LOG_LVL_WARN);
+	if (getenv(LOG_FILE_ENV))
+		log_mirror(getenv(LOG_FILE_ENV));
+
+	if ((parser_err = flash_image_load(parser, argv[optind], &image)) != PARSER_OK)
+	{
+		fprintf(stderr, "Failed to read %s: %s\n", argv[optind], parser_error_to_str(parser_err));
+		return CLI_ERR_IMAGE;
+	}
+	if (length && length < image.size)
+		image.size = length;
+	if (!quiet)
+		fprintf(stderr, "Using Parser : %s, %u bytes\n", parser->name, image.size);
+
+	gang = n > 1;
+	for (i = 0; i < n; i++)
+	{
+		flash_job_init(&jobs[i], &opts, devices[i], &image);
+		jobs[i].init_flags = init_flags;
+		jobs[i].autotune = autotune;
+		jobs[i].verify = verify;
+		jobs[i].address = address;
+		jobs[i].erase = erase;
+		jobs[i].unprotect = unprotect;
+		jobs[i].log = cli_log;
+		jobs[i].progress = cli_progress;
+	}
+
+	if (remote)
+	{
+		if ((ret = cli_remote(remote, jobs, n)) == CLI_OK)
+			for (i = 0; i < n && ret == CLI_OK; i++)
+				ret = cli_status(&jobs[i]);
+		flash_image_free(&image);
+		return ret;
+	}
+
+	/* reads in flight are restarted, the handler is good for one signal */
+	running = jobs;
+	nrunning = n;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = cli_interrupt;
+	sa.sa_flags = SA_RESTART | SA_RESETHAND;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	if (gang)
+		flash_gang(jobs, n);
+	else
+		flash_run(&jobs[0]);
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+
+	for (i = 0; i < n; i++)
+	{
+		session_close(jobs[i].session);
+		if (ret == CLI_OK)
+			ret = cli_status(&jobs[i]);
+	}
+	if (!quiet)
+		flash_report(jobs, n, stdout);
+	if (summary && cli_summary(summary, jobs, n) != 0 && ret == CLI_OK)
+		ret = CLI_ERR_USAGE;
+	flash_image_free(&image);
+	return ret;
+}
@@ -0,0 +1,651 @@
+/******************************************************************************
+ * flashing daemon
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include "daemon.h"
+#include "flash.h"
+#include "session.h"
+#include "journal.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * A long running process that owns the ports. Images are uploaded once
+ * and kept by content hash; each port has a queue and a worker thread
+ * that runs flash_run() and keeps the session, so the port stays
+ * configured and the bootloader connected between jobs. The main
+ * thread only accepts connections and parses commands.
+ *
+ * usage: stm-daemon [-s socket]
+ */
+
+typedef struct cache_entry
+{
+	uint64_t			hash;
+	flash_image_t		image;
+	int					refs;		/* queued or running jobs */
+	uint64_t			used;		/* when last referenced */
+	struct cache_entry	*next;
+} cache_entry_t;
+
+typedef struct client
+{
+	int					fd;
+	int					refs;		/* the connection and each of its jobs */
+	int					closed;
+	pthread_mutex_t		lock;		/* one message at a time on fd */
+	char				line[DAEMON_LINE_MAX];
+	size_t				len;
+	uint8_t				*upload;	/* IMAGE data being received */
+	uint32_t			upload_size, upload_len;
+} client_t;
+
+typedef struct job
+{
+	unsigned int		id;
+	flash_job_t			flash;
+	client_t			*client;
+	cache_entry_t		*entry;
+	char				mode[8];	/* serial mode, opts points here */
+	flash_phase_t		phase;		/* last progress event sent */
+	int					percent;
+	struct job			*next;
+} job_t;
+
+typedef struct port_queue
+{
+	char				device[256];
+	pthread_t			thread;
+	pthread_cond_t		cond;
+	job_t				*head, *tail;
+	int					waiting;
+	unsigned int		done, failed;
+	session_t			*session;	/* only touched by the worker */
+} port_queue_t;
+
+/* protects everything below and the reference counts */
+static pthread_mutex_t daemon_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t *cache;
+static size_t cache_bytes;
+static port_queue_t *ports[DAEMON_PORTS_MAX];
+static int nports;
+static unsigned int next_id = 1;
+
+static volatile sig_atomic_t stop;
+
+static void client_send(client_t *c, const char *fmt, ...)
+{
+	char buf[DAEMON_LINE_MAX + 64];
+	va_list ap;
+	size_t len, off;
+	ssize_t r;
+
+	va_start(ap, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	if (len >= sizeof(buf))
+	{
+		len = sizeof(buf) - 1;
+		buf[len - 1] = '\n';
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for (off = 0; !c->closed && off < len; off += r)
+	{
+		r = send(c->fd, buf + off, len - off, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			r = 0;
+		else if (r < 0)
+			c->closed = 1;	/* gone or not reading, its jobs still run */
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+static void client_put(client_t *c)
+{
+	int refs;
+
+	pthread_mutex_lock(&daemon_lock);
+	refs = --c->refs;
+	pthread_mutex_unlock(&daemon_lock);
+	if (refs)
+		return;
+	close(c->fd);
+	pthread_mutex_destroy(&c->lock);
+	free(c->upload);
+	free(c);
+}
+
+/* image cache, called with daemon_lock held */
+
+static cache_entry_t *cache_find(uint64_t hash)
+{
+	cache_entry_t *e;
+
+	for (e = cache; e; e = e->next)
+		if (e->hash == hash)
+			return e;
+	return NULL;
+}
+
+static void cache_trim(void)
+{
+	cache_entry_t **pe, **lru, *e;
+
+	while (cache_bytes > DAEMON_CACHE_BYTES)
+	{
+		lru = NULL;
+		for (pe = &cache; *pe; pe = &(*pe)->next)
+			if ((*pe)->refs == 0 && (lru == NULL || (*pe)->used < (*lru)->used))
+				lru = pe;
+		if (lru == NULL)
+			return;		/* everything is in use */
+
+		e = *lru;
+		*lru = e->next;
+		cache_bytes -= e->image.size;
+		flash_image_free(&e->image);
+		free(e);
+	}
+}
+
+/* takes over data */
+static cache_entry_t *cache_insert(uint8_t *data, uint32_t size)
+{
+	uint64_t hash = journal_hash(data, size);
+	cache_entry_t *e;
+
+	if ((e = cache_find(hash)) != NULL)
+	{
+		free(data);
+		e->used = stats_now_us();
+		return e;
+	}
+
+	e = calloc(1, sizeof(cache_entry_t));
+	if (e == NULL)
+	{
+		free(data);
+		return NULL;
+	}
+	e->hash = hash;
+	e->image.data = data;
+	e->image.size = size;
+	e->used = stats_now_us();
+	e->next = cache;
+	cache = e;
+	cache_bytes += size;
+	cache_trim();
+	return e;
+}
+
+/* job events, from the port workers */
+
+static void job_log(flash_job_t *fj, const char *msg)
+{
+	job_t *job = (job_t *)fj->user;
+
+	client_send(job->client, "LOG %u %s\n", job->id, msg);
+}
+
+static void job_progress(flash_job_t *fj, flash_phase_t phase, double fraction)
+{
+	job_t *job = (job_t *)fj->user;
+	int percent = (int)(fraction * 100);
+
+	/* one event per phase and percent, not per block */
+	if (phase == job->phase && percent == job->percent)
+		return;
+	job->phase = phase;
+	job->percent = percent;
+	client_send(job->client, "PROGRESS %u %s %d %.0f %llu\n", job->id, flash_phase_name(phase), percent,
+				fj->rate_bps, (unsigned long long)(fj->eta_us / 1000));
+}
+
+static void *port_worker(void *arg)
+{
+	port_queue_t *p = (port_queue_t *)arg;
+	char report[256];
+	job_t *job;
+
+	while (1)
+	{
+		pthread_mutex_lock(&daemon_lock);
+		while (p->head == NULL)
+			pthread_cond_wait(&p->cond, &daemon_lock);
+		job = p->head;
+		p->head = job->next;
+		if (p->head == NULL)
+			p->tail = NULL;
+		pthread_mutex_unlock(&daemon_lock);
+
+		/* the session stays open from one job to the next */
+		job->flash.session = p->session;
+		flash_run(&job->flash);
+		p->session = job->flash.session;
+
+		flash_report_line(&job->flash, report, sizeof(report));
+		client_send(job->client, "DONE %u %s %s %s\n", job->id,
+					flash_phase_name(job->flash.phase), flash_phase_name(job->flash.failed_in), report);
+		log_msg(LOG_LVL_INFO, "daemon", "job %u: %s", job->id, report);
+
+		pthread_mutex_lock(&daemon_lock);
+		p->waiting--;
+		if (job->flash.phase == FLASH_DONE)
+			p->done++;
+		else
+			p->failed++;
+		job->entry->refs--;
+		job->entry->used = stats_now_us();
+		pthread_mutex_unlock(&daemon_lock);
+
+		client_put(job->client);
+		free(job);
+	}
+	return NULL;
+}
+
+/* called with daemon_lock held */
+static port_queue_t *port_get(const char *device)
+{
+	port_queue_t *p;
+	int i;
+
+	for (i = 0; i < nports; i++)
+		if (strcmp(ports[i]->device, device) == 0)
+			return ports[i];
+	if (nports == DAEMON_PORTS_MAX)
+		return NULL;
+
+	p = calloc(1, sizeof(port_queue_t));
+	if (p == NULL)
+		return NULL;
+	snprintf(p->device, sizeof(p->device), "%s", device);
+	pthread_cond_init(&p->cond, NULL);
+	if (pthread_create(&p->thread, NULL, port_worker, p) != 0)
+	{
+		pthread_cond_destroy(&p->cond);
+		free(p);
+		return NULL;
+	}
+	pthread_detach(p->thread);
+	ports[nports++] = p;
+	return p;
+}
+
+/* commands */
+
+static int job_option(job_t *job, char *opt)
+{
+	flash_job_t *fj = &job->flash;
+	char *val = strchr(opt, '=');
+
+	if (val)
+		*val++ = 0;
+	if (strcmp(opt, "verify") == 0)
+		fj->verify = 1;
+	else if (strcmp(opt, "reset") == 0)
+		fj->init_flags |= STM32_INIT_RESET;
+	else if (strcmp(opt, "pipeline") == 0)
+		fj->init_flags |= STM32_INIT_PIPELINE;
+	else if (strcmp(opt, "lowlatency") == 0)
+		fj->opts.low_latency = 1;
+	else if (val == NULL)
+		return -1;
+	else if (strcmp(opt, "baud") == 0 && strcmp(val, "auto") == 0)
+		fj->autotune = 1;
+	else if (strcmp(opt, "baud") == 0)
+		return (fj->opts.baudrate = serial_get_baud(strtoul(val, NULL, 0))) == SERIAL_BAUD_INVALID ? -1 : 0;
+	else if (strcmp(opt, "mode") == 0)
+	{
+		if (serial_get_bits(val) == SERIAL_BITS_INVALID
+		    || serial_get_parity(val) == SERIAL_PARITY_INVALID
+		    || serial_get_stopbit(val) == SERIAL_STOPBIT_INVALID)
+			return -1;
+		/* the job outlives the command line */
+		snprintf(job->mode, sizeof(job->mode), "%s", val);
+		fj->opts.serial_mode = job->mode;
+	}
+	else if (strcmp(opt, "address") == 0)
+		fj->address = strtoul(val, NULL, 0);
+	else if (strcmp(opt, "unprotect") == 0 && strcmp(val, "read") == 0)
+		fj->unprotect |= FLASH_UNPROTECT_READ;
+	else if (strcmp(opt, "unprotect") == 0 && strcmp(val, "write") == 0)
+		fj->unprotect |= FLASH_UNPROTECT_WRITE;
+	else if (strcmp(opt, "erase") == 0)
+	{
+		if (strcmp(val, "auto") == 0)
+			fj->erase = FLASH_ERASE_AUTO;
+		else if (strcmp(val, "mass") == 0)
+			fj->erase = FLASH_ERASE_MASS;
+		else if (strcmp(val, "pages") == 0)
+			fj->erase = FLASH_ERASE_PAGES;
+		else if (strcmp(val, "none") == 0)
+			fj->erase = FLASH_ERASE_NONE;
+		else
+			return -1;
+	}
+	else
+		return -1;
+	return 0;
+}
+
+static void daemon_flash(client_t *c, char *args)
+{
+	static const port_opt_t defaults = {
+		.device			= NULL,
+		.baudrate		= SERIAL_BAUD_115200,
+		.serial_mode	= "8e1",
+		.rx_frame_max	= STM32_MAX_RX_FRAME,
+		.tx_frame_max	= STM32_MAX_TX_FRAME,
+	};
+	char *device, *hash, *opt, *save;
+	cache_entry_t *entry;
+	port_queue_t *p;
+	job_t *job;
+	int ahead;
+
+	device = strtok_r(args, " ", &save);
+	hash = strtok_r(NULL, " ", &save);
+	if (device == NULL || hash == NULL)
+	{
+		client_send(c, "ERROR usage: FLASH <device> <hash> [option...]\n");
+		return;
+	}
+
+	job = calloc(1, sizeof(job_t));
+	if (job == NULL)
+	{
+		client_send(c, "ERROR out of memory\n");
+		return;
+	}
+	flash_job_init(&job->flash, &defaults, device, NULL);
+	while ((opt = strtok_r(NULL, " ", &save)) != NULL)
+		if (job_option(job, opt) != 0)
+		{
+			client_send(c, "ERROR invalid option %s\n", opt);
+			free(job);
+			return;
+		}
+	job->flash.log = job_log;
+	job->flash.progress = job_progress;
+	job->flash.user = job;
+	job->client = c;
+	job->phase = FLASH_PHASES;
+
+	pthread_mutex_lock(&daemon_lock);
+	if ((entry = cache_find(strtoull(hash, NULL, 16))) == NULL)
+	{
+		pthread_mutex_unlock(&daemon_lock);
+		client_send(c, "NO\n");
+		free(job);
+		return;
+	}
+	if ((p = port_get(device)) == NULL)
+	{
+		pthread_mutex_unlock(&daemon_lock);
+		client_send(c, "ERROR too many ports\n");
+		free(job);
+		return;
+	}
+	if (p->waiting >= DAEMON_QUEUE_MAX)
+	{
+		ahead = p->waiting;
+		pthread_mutex_unlock(&daemon_lock);
+		client_send(c, "BUSY %d\n", ahead);
+		free(job);
+		return;
+	}
+	job->id = next_id++;
+	job->entry = entry;
+	job->flash.image = &entry->image;
+	entry->refs++;
+	c->refs++;
+	ahead = p->waiting++;
+	pthread_mutex_unlock(&daemon_lock);
+
+	/* announce the id before the worker can send events for it */
+	client_send(c, "QUEUED %u %d\n", job->id, ahead);
+
+	pthread_mutex_lock(&daemon_lock);
+	if (p->tail)
+		p->tail->next = job;
+	else
+		p->head = job;
+	p->tail = job;
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&daemon_lock);
+}
+
+static void daemon_status(client_t *c)
+{
+	char buf[DAEMON_PORTS_MAX][DAEMON_LINE_MAX];
+	int i, n;
+
+	pthread_mutex_lock(&daemon_lock);
+	for (n = 0; n < nports; n++)
+		snprintf(buf[n], sizeof(buf[n]), "PORT %s %d %u %u\n",
+				 ports[n]->device, ports[n]->waiting, ports[n]->done, ports[n]->failed);
+	pthread_mutex_unlock(&daemon_lock);
+
+	for (i = 0; i < n; i++)
+		client_send(c, "%s", buf[i]);
+	client_send(c, "END\n");
+}
+
+static void daemon_command(client_t *c, char *line)
+{
+	unsigned long size;
+	cache_entry_t *e;
+
+	if (strncmp(line, "HAVE ", 5) == 0)
+	{
+		pthread_mutex_lock(&daemon_lock);
+		e = cache_find(strtoull(line + 5, NULL, 16));
+		pthread_mutex_unlock(&daemon_lock);
+		client_send(c, e ? "YES\n" : "NO\n");
+	}
+	else if (strncmp(line, "IMAGE ", 6) == 0)
+	{
+		size = strtoul(line + 6, NULL, 0);
+		if (size == 0 || size > DAEMON_IMAGE_MAX || (c->upload = malloc(size)) == NULL)
+		{
+			client_send(c, "ERROR image size %lu not accepted\n", size);
+			/* the data that follows cannot be skipped */
+			pthread_mutex_lock(&c->lock);
+			c->closed = 1;
+			pthread_mutex_unlock(&c->lock);
+			return;
+		}
+		c->upload_size = size;
+		c->upload_len = 0;
+	}
+	else if (strncmp(line, "FLASH ", 6) == 0)
+		daemon_flash(c, line + 6);
+	else if (strcmp(line, "STATUS") == 0)
+		daemon_status(c);
+	else
+		client_send(c, "ERROR unknown command\n");
+}
+
+/* returns -1 once the connection is to be dropped */
+static int daemon_input(client_t *c)
+{
+	uint8_t buf[16384];
+	cache_entry_t *e;
+	uint64_t hash;
+	size_t i, n;
+	ssize_t r;
+
+	if ((r = read(c->fd, buf, sizeof(buf))) <= 0)
+		return -1;
+
+	for (i = 0; i < (size_t)r && !c->closed; )
+	{
+		if (c->upload)
+		{
+			n = c->upload_size - c->upload_len;
+			if (n > r - i)
+				n = r - i;
+			memcpy(c->upload + c->upload_len, buf + i, n);
+			c->upload_len += n;
+			i += n;
+			if (c->upload_len < c->upload_size)
+				continue;
+
+			pthread_mutex_lock(&daemon_lock);
+			e = cache_insert(c->upload, c->upload_size);
+			hash = e ? e->hash : 0;
+			pthread_mutex_unlock(&daemon_lock);
+			c->upload = NULL;
+			if (e)
+				client_send(c, "IMAGE %016llx\n", (unsigned long long)hash);
+			else
+				client_send(c, "ERROR out of memory\n");
+			continue;
+		}
+
+		if (buf[i] == '\n')
+		{
+			c->line[c->len] = 0;
+			c->len = 0;
+			daemon_command(c, c->line);
+		}
+		else if (c->len < sizeof(c->line) - 1)
+			c->line[c->len++] = buf[i];
+		else
+		{
+			client_send(c, "ERROR line too long\n");
+			return -1;
+		}
+		i++;
+	}
+	return c->closed ? -1 : 0;
+}
+
+static void daemon_signal(int sig)
+{
+	stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd pfd[1 + DAEMON_CLIENTS_MAX];
+	client_t *clients[DAEMON_CLIENTS_MAX];
+	struct sockaddr_un addr;
+	struct timeval tv = { DAEMON_SEND_TIMEOUT, 0 };
+	const char *path = DAEMON_SOCKET;
+	int listen_fd, fd, n = 0, i, c;
+
+	while ((c = getopt(argc, argv, "s:")) != -1)
+	{
+		switch (c)
+		{
+			case 's': path = optarg; break;
+			default:
+				fprintf(stderr, "usage: %s [-s socket]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path too long\n");
+		return 1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+	    || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+	    || listen(listen_fd, 64) != 0)
+	{
+		perror(path);
+		return 1;
+	}
+	signal(SIGINT, daemon_signal);
+	signal(SIGTERM, daemon_signal);
+	signal(SIGPIPE, SIG_IGN);
+	if (getenv(LOG_FILE_ENV))
+		log_mirror(getenv(LOG_FILE_ENV));
+	fprintf(stderr, "Listening on %s\n", path);
+
+	while (!stop)
+	{
+		pfd[0].fd = listen_fd;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < n; i++)
+		{
+			pfd[1 + i].fd = clients[i]->fd;
+			pfd[1 + i].events = POLLIN;
+		}
+		if (poll(pfd, 1 + n, -1) < 0)
+			continue;	/* EINTR, stop is checked */
+
+		for (i = n - 1; i >= 0; i--)
+		{
+			if (!(pfd[1 + i].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+			if (daemon_input(clients[i]) == 0)
+				continue;
+
+			/* queued jobs keep their reference and still run */
+			pthread_mutex_lock(&clients[i]->lock);
+			clients[i]->closed = 1;
+			pthread_mutex_unlock(&clients[i]->lock);
+			client_put(clients[i]);
+			clients[i] = clients[--n];
+		}
+
+		if ((pfd[0].revents & POLLIN) && (fd = accept(listen_fd, NULL, NULL)) >= 0)
+		{
+			if (n == DAEMON_CLIENTS_MAX)
+			{
+				close(fd);
+				continue;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+			clients[n] = calloc(1, sizeof(client_t));
+			clients[n]->fd = fd;
+			clients[n]->refs = 1;
+			pthread_mutex_init(&clients[n]->lock, NULL);
+			n++;
+		}
+	}
+
+	/* jobs in progress are abandoned, the journal resumes them */
+	close(listen_fd);
+	unlink(path);
+	return 0;
+}
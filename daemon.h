@@ -0,0 +1,59 @@
+/******************************************************************************
+ * flashing daemon protocol
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _DAEMON_H
+#define _DAEMON_H
+
+#define DAEMON_SOCKET		"/tmp/gstm32flash.sock"
+#define DAEMON_LINE_MAX		512
+#define DAEMON_QUEUE_MAX	16				/* jobs waiting per port, then BUSY */
+#define DAEMON_PORTS_MAX	64
+#define DAEMON_CLIENTS_MAX	256
+#define DAEMON_IMAGE_MAX	(16 << 20)		/* largest upload */
+#define DAEMON_CACHE_BYTES	(64 << 20)		/* unused images are dropped above */
+#define DAEMON_SEND_TIMEOUT	2				/* seconds, then the client is dropped */
+
+/*
+ * stm-daemon listens on a Unix stream socket. Every message is one line
+ * of space separated fields, except the image data following IMAGE.
+ * Images are identified by journal_hash() of their bytes, as hex.
+ *
+ *	client							daemon
+ *	HAVE <hash>						YES | NO
+ *	IMAGE <size>, then the data		IMAGE <hash> | ERROR <message>
+ *	FLASH <device> <hash> [option...]
+ *									QUEUED <id> <jobs ahead>
+ *									BUSY <jobs waiting>		queue full, retry later
+ *									NO						image not cached
+ *									ERROR <message>
+ *	then for each queued job:		PROGRESS <id> <phase> <percent> <bytes/s> <ms left>
+ *									LOG <id> <message>
+ *									DONE <id> <phase> <failed in> <report>
+ *	STATUS							PORT <device> <waiting> <done> <failed>
+ *									... END
+ *
+ * FLASH options: verify, reset, pipeline, lowlatency, baud=<rate|auto>,
+ * mode=<serial mode>, address=<addr>, erase=<auto|mass|pages|none>,
+ * unprotect=<read|write> (may be given twice)
+ */
+
+#endif
@@ -0,0 +1,719 @@
+/******************************************************************************
+ * event driven protocol engine
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/epoll.h>
+#include "engine.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * stm32.c talks to one device with blocking reads, so every port needs
+ * its own thread. Here the same AN3155 sequence is a state machine per
+ * target, resumed whenever its descriptor is readable or writable or
+ * its deadline expires. One thread waiting in epoll_wait() drives a
+ * whole rack, the deadlines are kept in a binary heap.
+ *
+ * Each exchange sends t->tx and then consumes the reply according to a
+ * script, one character per token:
+ *	'A'	ACK; BUSY is skipped, NACK or anything else fails the target
+ *	'B'	t->nbytes bytes, appended to t->rx
+ *	'V'	a length byte n and n + 1 more bytes, all appended to t->rx
+ *	'D'	any bytes until the deadline, dropped
+ */
+#define ENGINE_ACK		0x79
+#define ENGINE_NACK		0x1F
+#define ENGINE_BUSY		0x76
+#define ENGINE_INIT		0x7F
+
+#define ENGINE_REPLY_MS		500		/* same as VTIME = 5 on a tty */
+#define ENGINE_WRITE_MS		1000	/* one block, STM32_BLKWRITE_TIMEOUT */
+#define ENGINE_CRC_MS		5000	/* STM32_CRC_TIMEOUT */
+
+enum
+{
+	STEP_INIT,
+	STEP_INIT_AGAIN,
+	STEP_HANDSHAKE,
+	STEP_DRAIN,
+	STEP_RESYNC,
+	STEP_GVR,
+	STEP_GET,
+	STEP_GID,
+	STEP_ERASE_CMD,
+	STEP_ERASE,
+	STEP_WRITE_CMD,
+	STEP_WRITE_ADDR,
+	STEP_WRITE_DATA,
+	STEP_CRC_CMD,
+	STEP_CRC_ADDR,
+	STEP_CRC_LEN,
+	STEP_READ_CMD,
+	STEP_READ_ADDR,
+	STEP_READ_LEN,
+};
+
+static const char *step_names[] = {
+	"init", "init", "handshake", "drain", "resync", "get version", "get",
+	"get id", "erase command", "erase", "write command",
+	"write address", "write data", "crc command", "crc address", "crc",
+	"read command", "read address", "read",
+};
+
+/* deadline heap */
+
+static void heap_swap(engine_t *e, int a, int b)
+{
+	engine_target_t *t = e->heap[a];
+
+	e->heap[a] = e->heap[b];
+	e->heap[b] = t;
+	e->heap[a]->heap_pos = a;
+	e->heap[b]->heap_pos = b;
+}
+
+static void heap_fix(engine_t *e, int i)
+{
+	int child;
+
+	while (i > 0 && e->heap[i]->deadline < e->heap[(i - 1) / 2]->deadline)
+	{
+		heap_swap(e, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+	while ((child = 2 * i + 1) < e->active)
+	{
+		if (child + 1 < e->active && e->heap[child + 1]->deadline < e->heap[child]->deadline)
+			child++;
+		if (e->heap[i]->deadline <= e->heap[child]->deadline)
+			break;
+		heap_swap(e, i, child);
+		i = child;
+	}
+}
+
+static void heap_remove(engine_t *e, engine_target_t *t)
+{
+	int i = t->heap_pos;
+
+	e->active--;
+	if (i != e->active)
+	{
+		heap_swap(e, i, e->active);
+		heap_fix(e, i);
+	}
+	t->heap_pos = -1;
+}
+
+/* target bookkeeping */
+
+static void engine_enter(engine_target_t *t, flash_phase_t phase)
+{
+	uint64_t now = stats_now_us();
+
+	t->t_us[t->phase] += now - t->t_mark;
+	t->t_mark = now;
+	t->phase = phase;
+}
+
+static void engine_finish(engine_t *e, engine_target_t *t, flash_phase_t phase)
+{
+	epoll_ctl(e->epfd, EPOLL_CTL_DEL, t->fd, NULL);
+	fcntl(t->fd, F_SETFL, t->fd_flags);
+	heap_remove(e, t);
+	if (t->stm)
+		stm32_close(t->stm);
+	t->stm = NULL;
+	engine_enter(t, phase);
+}
+
+static void engine_fail(engine_t *e, engine_target_t *t, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(t->error, sizeof(t->error), fmt, ap);
+	va_end(ap);
+
+	t->failed_in = t->phase;
+	e->failed++;
+	engine_finish(e, t, FLASH_FAILED);
+}
+
+static void engine_flush(engine_t *e, engine_target_t *t)
+{
+	struct epoll_event ev;
+	ssize_t r;
+
+	while (t->tx_off < t->tx_len)
+	{
+		r = write(t->fd, t->tx + t->tx_off, t->tx_len - t->tx_off);
+		e->writes++;
+		if (r < 0 && errno == EAGAIN)
+		{
+			/* the tty buffer is full, wait until it drains */
+			if (!t->polling_out)
+			{
+				ev.events = EPOLLIN | EPOLLOUT;
+				ev.data.ptr = t;
+				epoll_ctl(e->epfd, EPOLL_CTL_MOD, t->fd, &ev);
+				t->polling_out = 1;
+			}
+			return;
+		}
+		if (r < 0)
+		{
+			engine_fail(e, t, "write failed: %s", strerror(errno));
+			return;
+		}
+		t->tx_off += r;
+	}
+
+	if (t->polling_out)
+	{
+		ev.events = EPOLLIN;
+		ev.data.ptr = t;
+		epoll_ctl(e->epfd, EPOLL_CTL_MOD, t->fd, &ev);
+		t->polling_out = 0;
+	}
+}
+
+/* send len bytes of t->tx, then expect a reply as described by the script */
+static void engine_send(engine_t *e, engine_target_t *t, int step, unsigned int len,
+						const char *expect, unsigned int nbytes, unsigned int timeout_ms)
+{
+	assert(len <= sizeof(t->tx));
+	t->step = step;
+	t->tx_len = len;
+	t->tx_off = 0;
+	t->expect = expect;
+	t->nbytes = nbytes;
+	t->need = 0;
+	t->rx_len = 0;
+	t->deadline = stats_now_us() + timeout_ms * 1000ULL;
+	heap_fix(e, t->heap_pos);
+	engine_flush(e, t);
+}
+
+static void engine_command(engine_t *e, engine_target_t *t, int step, uint8_t cmd)
+{
+	t->tx[0] = cmd;
+	t->tx[1] = cmd ^ 0xFF;
+	engine_send(e, t, step, 2, "A", 0, ENGINE_REPLY_MS);
+}
+
+static void engine_u32(engine_t *e, engine_target_t *t, int step, uint32_t value,
+					   const char *expect, unsigned int nbytes, unsigned int timeout_ms)
+{
+	stm32_frame_u32(value, t->tx);
+	engine_send(e, t, step, 5, expect, nbytes, timeout_ms);
+}
+
+/* one command of the step by step handshake, the replies add up in t->rx */
+static void engine_query(engine_t *e, engine_target_t *t, int step, uint8_t cmd,
+						 const char *expect, unsigned int nbytes)
+{
+	unsigned int kept = step == STEP_GVR ? 0 : t->rx_len;
+
+	engine_command(e, t, step, cmd);
+	t->expect = expect;
+	t->nbytes = nbytes;
+	t->rx_len = kept;
+}
+
+/*
+ * Some bootloaders drop bytes that come in while they are answering, so
+ * the pipelined handshake can stall or go out of step. Let the line go
+ * quiet, resync and ask again one command at a time, as stm32_init()
+ * falls back to.
+ */
+static void engine_step_by_step(engine_t *e, engine_target_t *t)
+{
+	engine_send(e, t, STEP_DRAIN, 0, "D", 0, ENGINE_REPLY_MS);
+}
+
+/* protocol steps */
+
+static void engine_write_next(engine_t *e, engine_target_t *t);
+static void engine_verify_next(engine_t *e, engine_target_t *t);
+
+static void engine_handshake(engine_t *e, engine_target_t *t)
+{
+	stm32_struct_t *stm = t->stm;
+	const flash_image_t *img = t->image;
+	const uint8_t *get = t->rx + 3;
+	const uint8_t *gid = get + get[0] + 2;
+	unsigned int i;
+
+	stm->version = t->rx[0];
+	stm->option1 = t->rx[1];
+	stm->option2 = t->rx[2];
+	/* GID may have been queued before GET could confirm it */
+	if (stm32_parse_get(stm, get) != STM32_OK
+	    || stm->cmd->gid != 0x02
+	    || stm32_parse_pid(stm, gid) != STM32_OK
+	    || stm32_find_dev(stm) != STM32_OK)
+	{
+		engine_fail(e, t, "Unknown bootloader or device");
+		return;
+	}
+	t->pid = stm->pid;
+
+	if (img->size > stm->dev->fl_end - stm->dev->fl_start)
+	{
+		engine_fail(e, t, "Image of %u bytes does not fit the flash", img->size);
+		return;
+	}
+	/* 0xFF marks a command the bootloader does not have */
+	if (stm->cmd->er == 0xFF || stm->cmd->wm == 0xFF)
+	{
+		engine_fail(e, t, "Bootloader cannot erase or write");
+		return;
+	}
+
+	/* the CRC of the padded image, for the verify step */
+	t->crc = stm32_sw_crc(0xFFFFFFFF, (uint8_t *)img->data, img->size & ~3);
+	if (img->size & 3)
+	{
+		uint8_t tail[4];
+
+		memset(tail, 0xFF, sizeof(tail));
+		for (i = 0; i < (img->size & 3); i++)
+			tail[i] = img->data[(img->size & ~3) + i];
+		t->crc = stm32_sw_crc(t->crc, tail, sizeof(tail));
+	}
+
+	engine_enter(t, FLASH_ERASE);
+	engine_command(e, t, STEP_ERASE_CMD, stm->cmd->er);
+}
+
+static void engine_write_next(engine_t *e, engine_target_t *t)
+{
+	const stm32_struct_t *stm = t->stm;
+	uint32_t end = stm->dev->fl_start + t->image->size;
+
+	if (t->addr >= end)
+	{
+		if (!t->verify)
+		{
+			engine_finish(e, t, FLASH_DONE);
+			return;
+		}
+		engine_enter(t, FLASH_VERIFY);
+		t->addr = stm->dev->fl_start;
+		if (stm->cmd->crc != 0xFF)
+			engine_command(e, t, STEP_CRC_CMD, stm->cmd->crc);
+		else
+			engine_verify_next(e, t);
+		return;
+	}
+
+	t->len = end - t->addr > 256 ? 256 : end - t->addr;
+	engine_command(e, t, STEP_WRITE_CMD, stm->cmd->wm);
+}
+
+/* read back verification, when the bootloader has no CRC command */
+static void engine_verify_next(engine_t *e, engine_target_t *t)
+{
+	const stm32_struct_t *stm = t->stm;
+	uint32_t end = stm->dev->fl_start + t->image->size;
+
+	if (t->addr >= end)
+	{
+		engine_finish(e, t, FLASH_DONE);
+		return;
+	}
+	if (stm->cmd->rm == 0xFF)
+	{
+		engine_fail(e, t, "Bootloader cannot read back the flash");
+		return;
+	}
+	t->len = end - t->addr > 256 ? 256 : end - t->addr;
+	engine_command(e, t, STEP_READ_CMD, stm->cmd->rm);
+}
+
+/* the reply script of the current step is complete */
+static void engine_step(engine_t *e, engine_target_t *t)
+{
+	const stm32_struct_t *stm = t->stm;
+	const uint8_t *img = t->image->data;
+	uint32_t start = stm->dev ? stm->dev->fl_start : 0;
+	unsigned int len;
+	time_t timeout;
+	uint32_t crc;
+
+	switch (t->step)
+	{
+		case STEP_INIT:
+			/* a NACK means the interface was not closed properly, carry on */
+		case STEP_INIT_AGAIN:
+			if (t->rx[0] != ENGINE_ACK && t->rx[0] != ENGINE_NACK)
+			{
+				engine_fail(e, t, "Failed to init device, got 0x%02x", t->rx[0]);
+				return;
+			}
+			if (!(t->init_flags & STM32_INIT_PIPELINE))
+			{
+				engine_query(e, t, STEP_GVR, 0x01, "ABA", 3);
+				return;
+			}
+			/* queue GVR, GET and GID back-to-back, see STM32_INIT_PIPELINE */
+			t->tx[0] = 0x01; t->tx[1] = 0xFE;
+			t->tx[2] = 0x00; t->tx[3] = 0xFF;
+			t->tx[4] = 0x02; t->tx[5] = 0xFD;
+			engine_send(e, t, STEP_HANDSHAKE, 6, "ABAAVAAVA", 3, ENGINE_REPLY_MS);
+			return;
+
+		case STEP_RESYNC:
+			if (t->rx[0] != ENGINE_NACK)
+			{
+				engine_fail(e, t, "Failed to resync, got 0x%02x", t->rx[0]);
+				return;
+			}
+			engine_query(e, t, STEP_GVR, 0x01, "ABA", 3);
+			return;
+
+		case STEP_GVR:
+			engine_query(e, t, STEP_GET, 0x00, "AVA", 0);
+			return;
+
+		case STEP_GET:
+			engine_query(e, t, STEP_GID, 0x02, "AVA", 0);
+			return;
+
+		case STEP_HANDSHAKE:
+		case STEP_GID:
+			engine_handshake(e, t);
+			return;
+
+		case STEP_ERASE_CMD:
+			len = stm32_frame_erase(stm, 0, 0xFF, t->tx, &timeout);
+			engine_send(e, t, STEP_ERASE, len, "A", 0, timeout * 1000);
+			return;
+
+		case STEP_ERASE:
+			engine_enter(t, FLASH_WRITE);
+			t->addr = start;
+			engine_write_next(e, t);
+			return;
+
+		case STEP_WRITE_CMD:
+			engine_u32(e, t, STEP_WRITE_ADDR, t->addr, "A", 0, ENGINE_REPLY_MS);
+			return;
+
+		case STEP_WRITE_ADDR:
+			engine_send(e, t, STEP_WRITE_DATA,
+						stm32_frame_data(img + t->addr - start, t->len, t->tx),
+						"A", 0, ENGINE_WRITE_MS);
+			return;
+
+		case STEP_WRITE_DATA:
+			t->addr += t->len;
+			t->written += t->len;
+			engine_write_next(e, t);
+			return;
+
+		case STEP_CRC_CMD:
+			engine_u32(e, t, STEP_CRC_ADDR, start, "A", 0, ENGINE_REPLY_MS);
+			return;
+
+		case STEP_CRC_ADDR:
+			/* ACK of the length, ACK once computed, then CRC and checksum */
+			engine_u32(e, t, STEP_CRC_LEN, (t->image->size + 3) & ~3, "AAB", 5, ENGINE_CRC_MS);
+			return;
+
+		case STEP_CRC_LEN:
+			crc = (t->rx[0] << 24) | (t->rx[1] << 16) | (t->rx[2] << 8) | t->rx[3];
+			if (t->rx[4] != (t->rx[0] ^ t->rx[1] ^ t->rx[2] ^ t->rx[3]))
+				engine_fail(e, t, "CRC checksum mismatch");
+			else if (crc != t->crc)
+				engine_fail(e, t, "Flash memory does not match the image");
+			else
+				engine_finish(e, t, FLASH_DONE);
+			return;
+
+		case STEP_READ_CMD:
+			engine_u32(e, t, STEP_READ_ADDR, t->addr, "A", 0, ENGINE_REPLY_MS);
+			return;
+
+		case STEP_READ_ADDR:
+			t->tx[0] = t->len - 1;
+			t->tx[1] = t->tx[0] ^ 0xFF;
+			engine_send(e, t, STEP_READ_LEN, 2, "AB", t->len, ENGINE_REPLY_MS);
+			return;
+
+		case STEP_READ_LEN:
+			if (memcmp(t->rx, img + t->addr - start, t->len))
+			{
+				engine_fail(e, t, "Flash memory does not match the image at 0x%08x", t->addr);
+				return;
+			}
+			t->addr += t->len;
+			engine_verify_next(e, t);
+			return;
+	}
+}
+
+/* run received bytes through the reply script */
+static void engine_feed(engine_t *e, engine_target_t *t, const uint8_t *buf, size_t n)
+{
+	uint8_t byte;
+	size_t i;
+
+	for (i = 0; i < n && t->heap_pos >= 0; i++)
+	{
+		byte = buf[i];
+		switch (*t->expect)
+		{
+			case 'A':
+				if (byte == ENGINE_BUSY)
+					continue;
+				if (byte != ENGINE_ACK && t->step == STEP_HANDSHAKE)
+				{
+					engine_step_by_step(e, t);
+					return;
+				}
+				if (byte == ENGINE_NACK)
+				{
+					engine_fail(e, t, "Got NACK in %s", step_names[t->step]);
+					return;
+				}
+				if (byte != ENGINE_ACK)
+				{
+					engine_fail(e, t, "Got byte 0x%02x instead of ACK in %s", byte, step_names[t->step]);
+					return;
+				}
+				t->expect++;
+				break;
+
+			case 'D':
+				continue;
+
+			case 'B':
+			case 'V':
+				if (t->rx_len == sizeof(t->rx))
+				{
+					engine_fail(e, t, "Reply too long in %s", step_names[t->step]);
+					return;
+				}
+				if (t->need == 0)
+					t->need = *t->expect == 'B' ? t->nbytes : byte + 2u;
+				t->rx[t->rx_len++] = byte;
+				if (--t->need == 0)
+					t->expect++;
+				break;
+
+			default:
+				engine_fail(e, t, "Unexpected byte 0x%02x after %s", byte, step_names[t->step]);
+				return;
+		}
+
+		if (*t->expect == 0)
+			engine_step(e, t);
+	}
+}
+
+static void engine_input(engine_t *e, engine_target_t *t)
+{
+	uint8_t buf[512];
+	ssize_t r;
+
+	do
+	{
+		r = read(t->fd, buf, sizeof(buf));
+		e->reads++;
+		if (r < 0 && errno == EAGAIN)
+			return;
+		if (r < 0)
+		{
+			engine_fail(e, t, "read failed: %s", strerror(errno));
+			return;
+		}
+		engine_feed(e, t, buf, r);
+	} while (r == sizeof(buf) && t->heap_pos >= 0);
+}
+
+static void engine_expired(engine_t *e, engine_target_t *t)
+{
+	e->timeouts++;
+
+	/*
+	 * The first INIT may have been taken as the first byte of a
+	 * command, a second one then gets a NACK; see stm32_send_init_seq().
+	 */
+	if (t->step == STEP_INIT && t->rx_len == 0)
+	{
+		t->tx[0] = ENGINE_INIT;
+		engine_send(e, t, STEP_INIT_AGAIN, 1, "B", 1, ENGINE_REPLY_MS);
+		return;
+	}
+	if (t->step == STEP_HANDSHAKE)
+	{
+		engine_step_by_step(e, t);
+		return;
+	}
+	if (t->step == STEP_DRAIN)
+	{
+		t->tx[0] = 0xFF;
+		t->tx[1] = 0x00;
+		engine_send(e, t, STEP_RESYNC, 2, "B", 1, ENGINE_REPLY_MS);
+		return;
+	}
+	engine_fail(e, t, "Timed out in %s at 0x%08x", step_names[t->step], t->addr);
+}
+
+engine_t *engine_create(int max_targets)
+{
+	engine_t *e;
+
+	e = calloc(1, sizeof(engine_t));
+	assert(e != NULL);
+	e->heap = calloc(max_targets, sizeof(engine_target_t *));
+	assert(e->heap != NULL);
+	e->max = max_targets;
+	if ((e->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	{
+		log_msg(LOG_LVL_ERROR, "engine", "epoll_create1: %s", strerror(errno));
+		free(e->heap);
+		free(e);
+		return NULL;
+	}
+	return e;
+}
+
+void engine_destroy(engine_t *e)
+{
+	close(e->epfd);
+	free(e->heap);
+	free(e);
+}
+
+void engine_target_init(engine_target_t *t, port_interface_t *port, const flash_image_t *image)
+{
+	memset(t, 0, sizeof(engine_target_t));
+	t->port = port;
+	t->image = image;
+	t->fd = -1;
+	t->heap_pos = -1;
+}
+
+/* start a target, engine_run() takes it from there */
+int engine_add(engine_t *e, engine_target_t *t)
+{
+	struct epoll_event ev;
+
+	if (e->active == e->max)
+	{
+		log_msg(LOG_LVL_ERROR, "engine", "Too many targets for the engine");
+		return -1;
+	}
+	if ((t->fd = port_fd(t->port)) < 0)
+	{
+		log_msg(LOG_LVL_ERROR, "engine", "Port %s cannot be driven by the engine", t->port->name);
+		return -1;
+	}
+	t->fd_flags = fcntl(t->fd, F_GETFL);
+	fcntl(t->fd, F_SETFL, t->fd_flags | O_NONBLOCK);
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = t;
+	if (epoll_ctl(e->epfd, EPOLL_CTL_ADD, t->fd, &ev) != 0)
+	{
+		log_msg(LOG_LVL_ERROR, "engine", "epoll_ctl: %s", strerror(errno));
+		fcntl(t->fd, F_SETFL, t->fd_flags);
+		return -1;
+	}
+
+	t->stm = stm32_alloc(t->port);
+	t->phase = FLASH_IDLE;
+	t->t_mark = stats_now_us();
+	memset(t->t_us, 0, sizeof(t->t_us));
+	t->error[0] = 0;
+	t->written = 0;
+	t->polling_out = 0;
+
+	t->heap_pos = e->active;
+	e->heap[e->active++] = t;
+	engine_enter(t, FLASH_CONNECT);
+
+	t->tx[0] = ENGINE_INIT;
+	engine_send(e, t, STEP_INIT, 1, "B", 1, ENGINE_REPLY_MS);
+	return 0;
+}
+
+/*
+ * Drive all targets to FLASH_DONE or FLASH_FAILED, returns the number
+ * of targets that failed.
+ */
+int engine_run(engine_t *e)
+{
+	struct epoll_event ev[ENGINE_EVENTS];
+	engine_target_t *t;
+	uint64_t now;
+	int i, n, timeout;
+
+	while (e->active)
+	{
+		now = stats_now_us();
+		timeout = 0;
+		if (e->heap[0]->deadline > now)
+			timeout = (e->heap[0]->deadline - now + 999) / 1000;
+
+		n = epoll_wait(e->epfd, ev, ENGINE_EVENTS, timeout);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+		{
+			log_msg(LOG_LVL_ERROR, "engine", "epoll_wait: %s", strerror(errno));
+			break;
+		}
+		e->wakeups++;
+
+		for (i = 0; i < n; i++)
+		{
+			t = (engine_target_t *)ev[i].data.ptr;
+			if (t->heap_pos < 0)
+				continue;	/* finished earlier in this batch */
+			if (ev[i].events & EPOLLOUT)
+				engine_flush(e, t);
+			if (t->heap_pos >= 0 && (ev[i].events & EPOLLIN))
+				engine_input(e, t);
+			else if (t->heap_pos >= 0 && (ev[i].events & (EPOLLERR | EPOLLHUP)))
+				engine_fail(e, t, "Port hung up in %s", step_names[t->step]);
+		}
+
+		now = stats_now_us();
+		while (e->active && e->heap[0]->deadline <= now)
+			engine_expired(e, e->heap[0]);
+	}
+
+	while (e->active)
+		engine_fail(e, e->heap[0], "Engine stopped");
+	return e->failed;
+}
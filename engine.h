@@ -0,0 +1,98 @@
+/******************************************************************************
+ * event driven protocol engine
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _ENGINE_H
+#define _ENGINE_H
+
+#include <stdint.h>
+#include "port.h"
+#include "stm32.h"
+#include "flash.h"
+
+#define ENGINE_TX_MAX		STM32_MAX_ERASE_FRAME
+#define ENGINE_RX_MAX		(3 + 257 + 257)		/* GVR, GET and GID replies */
+#define ENGINE_EVENTS		64					/* per epoll_wait() */
+
+typedef struct engine_target engine_target_t;
+
+/*
+ * One download driven by engine_run(): connect, mass erase, write and
+ * optionally verify, like flash_run() but without blocking. The port is
+ * opened and closed by the caller; it must be a plain serial port, see
+ * port_fd().
+ */
+struct engine_target
+{
+	port_interface_t	*port;
+	const flash_image_t	*image;
+	int					verify;
+	unsigned int		init_flags;		/* STM32_INIT_PIPELINE or 0, no reset here */
+	void				*user;
+
+	/* results */
+	flash_phase_t		phase;			/* FLASH_DONE or FLASH_FAILED at the end */
+	flash_phase_t		failed_in;
+	char				error[96];
+	uint16_t			pid;
+	uint32_t			written;		/* bytes acknowledged by the device */
+	uint64_t			t_us[FLASH_PHASES];	/* time spent in each phase */
+
+	/* protocol state, private to engine.c */
+	int					fd;
+	int					fd_flags;		/* restored when done */
+	int					step;
+	int					tries;
+	stm32_struct_t		*stm;
+	uint32_t			addr, len;
+	uint32_t			crc;
+	uint8_t				tx[ENGINE_TX_MAX];
+	unsigned int		tx_len, tx_off;
+	const char			*expect;		/* reply script, see engine_send() */
+	unsigned int		nbytes, need;
+	uint8_t				rx[ENGINE_RX_MAX];
+	unsigned int		rx_len;
+	uint64_t			deadline;
+	uint64_t			t_mark;
+	int					heap_pos;
+	int					polling_out;
+};
+
+typedef struct engine
+{
+	int					epfd;
+	engine_target_t		**heap;			/* active targets, earliest deadline first */
+	int					active, max;
+	int					failed;
+
+	/* counters */
+	uint64_t			wakeups;
+	uint64_t			reads, writes;
+	uint64_t			timeouts;
+} engine_t;
+
+engine_t*	engine_create(int max_targets);
+void		engine_destroy(engine_t *e);
+void		engine_target_init(engine_target_t *t, port_interface_t *port, const flash_image_t *image);
+int			engine_add(engine_t *e, engine_target_t *t);
+int			engine_run(engine_t *e);
+
+#endif
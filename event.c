@@ -0,0 +1,50 @@
+/******************************************************************************
+ * Worker to GUI event ring
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+#include <string.h>
+#include "event.h"
+
+/* producer side; -1 when full */
+int event_put(event_ring_t *r, const event_t *ev)
+{
+	unsigned int head = r->head;	/* only written by this thread */
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == EVENT_RING_SIZE)
+		return -1;
+	/* the text is copied up to its end only, it is short */
+	r->ev[head & (EVENT_RING_SIZE - 1)].type = ev->type;
+	r->ev[head & (EVENT_RING_SIZE - 1)].fraction = ev->fraction;
+	strcpy(r->ev[head & (EVENT_RING_SIZE - 1)].text, ev->text);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/* consumer side; 0 when empty */
+int event_get(event_ring_t *r, event_t *ev)
+{
+	unsigned int tail = r->tail;	/* only written by this thread */
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+		return 0;
+	*ev = r->ev[tail & (EVENT_RING_SIZE - 1)];
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return 1;
+}
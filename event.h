@@ -0,0 +1,57 @@
+/******************************************************************************
+ * Worker to GUI event ring header file
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#define EVENT_RING_SIZE		128		/* events, power of two */
+#define EVENT_TEXT_MAX		64
+
+typedef enum
+{
+	EVENT_PROGRESS = 1,	/* only the last one before a redraw counts */
+	EVENT_DONE,			/* the job is over, the producer is gone */
+} event_type_t;
+
+typedef struct event
+{
+	event_type_t	type;
+	double			fraction;
+	char			text[EVENT_TEXT_MAX];
+} event_t;
+
+/*
+ * Single producer, single consumer, no locks: head is only written by
+ * the worker, tail only by the GTK main loop. Neither side ever waits
+ * for the other; a full ring drops the event.
+ */
+typedef struct event_ring
+{
+	unsigned int	head __attribute__ ((aligned(64)));
+	unsigned int	tail __attribute__ ((aligned(64)));
+	event_t			ev[EVENT_RING_SIZE];
+} event_ring_t;
+
+int				event_put(event_ring_t *r, const event_t *ev);
+int				event_get(event_ring_t *r, event_t *ev);
+
+#endif
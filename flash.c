@@ -0,0 +1,668 @@
+/******************************************************************************
+ * flashing flow, shared by the GUI and gang programming
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include "flash.h"
+#include "linktune.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
+#include "log.h"
+
+static const char *flash_phase_names[FLASH_PHASES] = {
+	"idle", "connect", "erase", "write", "verify", "done", "failed"
+};
+
+const char* flash_phase_name(flash_phase_t phase)
+{
+	return phase < FLASH_PHASES ? flash_phase_names[phase] : "unknown";
+}
+
+/* read the whole image once; the jobs only ever read it */
+parser_t flash_image_load(parser_ops_t *parser, const char *filename, flash_image_t *img)
+{
+	parser_t parser_err;
+	unsigned int len, get;
+	void *storage;
+
+	memset(img, 0, sizeof(flash_image_t));
+	if ((storage = parser->init()) == NULL)
+		return PARSER_ERR_SYSTEM;
+	if ((parser_err = parser->open(storage, filename)) != PARSER_OK)
+	{
+		parser->close(storage);
+		return parser_err;
+	}
+
+	img->size = parser->size(storage);
+	img->data = malloc(img->size ? img->size : 1);
+	if (img->data == NULL)
+	{
+		parser->close(storage);
+		return PARSER_ERR_SYSTEM;
+	}
+	for (len = 0; len < img->size; len += get)
+	{
+		get = img->size - len;
+		if ((parser_err = parser->read(storage, img->data + len, &get)) != PARSER_OK || get == 0)
+		{
+			parser->close(storage);
+			flash_image_free(img);
+			return parser_err != PARSER_OK ? parser_err : PARSER_ERR_INVALID_FILE;
+		}
+	}
+	parser->close(storage);
+	return PARSER_OK;
+}
+
+void flash_image_free(flash_image_t *img)
+{
+	free(img->data);
+	img->data = NULL;
+	img->size = 0;
+}
+
+void flash_job_init(flash_job_t *job, const port_opt_t *opts, const char *device,
+					const flash_image_t *image)
+{
+	memset(job, 0, sizeof(flash_job_t));
+	job->opts = *opts;
+	snprintf(job->device, sizeof(job->device), "%s", device);
+	job->opts.device = job->device;
+	job->image = image;
+}
+
+static void flash_log(flash_job_t *job, const char *fmt, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	if (job->log == NULL)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+	job->log(job, buf);
+}
+
+static void flash_progress(flash_job_t *job, double fraction)
+{
+	if (job->progress)
+		job->progress(job, job->phase, fraction);
+}
+
+/*
+ * Time the link needs for bytes of the phase: 11 bits a character at
+ * the line rate plus the frames around each block, and for writes the
+ * programming time. 0 before connecting or on a link without a rate.
+ */
+static uint64_t flash_model_us(const flash_job_t *job, flash_phase_t phase, uint32_t bytes)
+{
+	double block = job->opts.tx_frame_max > 6 ? job->opts.tx_frame_max - 2 : 256;
+	double us;
+
+	if (job->baud == 0)
+		return 0;
+	if (phase == FLASH_VERIFY && job->session && job->session->stm->cmd->crc != STM32_CMD_ERR)
+		return 0;		/* the device computes a CRC, nothing is read back */
+	us = bytes * 11e6 / job->baud * (block + 12) / block;	/* command, address, acks */
+	if (phase == FLASH_WRITE)
+		us += bytes * (double)FLASH_PROGRAM_US_KIB / 1024;
+	return (uint64_t)us;
+}
+
+/* the phases still to come: erasing pages, writing and verifying bytes */
+static uint64_t flash_plan(const flash_job_t *job, uint32_t pages, uint32_t bytes)
+{
+	uint64_t us = (uint64_t)pages * FLASH_ERASE_US_PAGE + flash_model_us(job, FLASH_WRITE, bytes);
+
+	if (job->verify)
+		us += flash_model_us(job, FLASH_VERIFY, job->image->size);
+	return us;
+}
+
+/*
+ * done of total bytes of the phase are through: update the rolling
+ * rate, measured over samples of FLASH_RATE_WINDOW_US so that one
+ * slow block does not make it jump, and the time left.
+ */
+static void flash_advance(flash_job_t *job, uint32_t done, uint32_t total)
+{
+	uint64_t now = stats_now_us();
+	double sample;
+
+	if (job->bytes_total != total || done < job->rate_bytes)
+	{
+		job->rate_bytes = done;		/* a resumed part was not transferred */
+		job->rate_mark = now;
+	}
+	job->bytes_done = done;
+	job->bytes_total = total;
+	if (now - job->rate_mark >= FLASH_RATE_WINDOW_US)
+	{
+		sample = (done - job->rate_bytes) * 1e6 / (now - job->rate_mark);
+		job->rate_bps = job->rate_bps > 0 ? 0.7 * job->rate_bps + 0.3 * sample : sample;
+		job->rate_bytes = done;
+		job->rate_mark = now;
+	}
+
+	if (job->rate_bps > 0)
+		job->eta_us = (uint64_t)((total - done) * 1e6 / job->rate_bps);
+	else
+		job->eta_us = flash_model_us(job, job->phase, total - done);
+	if (job->phase == FLASH_WRITE && job->verify)
+		job->eta_us += flash_model_us(job, FLASH_VERIFY, job->image->size);
+	flash_progress(job, total ? (double)done / total : 1);
+}
+
+/*
+ * Ask a running flash_run() to stop. It does between two frames, so
+ * within the timeout of the command in flight, and leaves the
+ * bootloader waiting for the next command: the session stays usable
+ * and the journal resumes the download.
+ */
+void flash_cancel(flash_job_t *job)
+{
+	__atomic_store_n(&job->cancel, 1, __ATOMIC_RELEASE);
+}
+
+int flash_cancelled(const flash_job_t *job)
+{
+	return __atomic_load_n(&job->cancel, __ATOMIC_ACQUIRE);
+}
+
+/* account the time of the phase left and announce the new one */
+static void flash_enter(flash_job_t *job, flash_phase_t phase)
+{
+	uint64_t now = stats_now_us();
+	port_interface_t *port = job->session ? job->session->port : NULL;
+
+	if (port && (job->phase == FLASH_ERASE || job->phase == FLASH_WRITE))
+		trace_phase(trace_chan(port), flash_phase_name(job->phase), 0);
+	job->t_us[job->phase] += now - job->t_mark;
+	job->t_mark = now;
+	job->phase = phase;
+	job->bytes_done = job->bytes_total = 0;
+	job->rate_bps = 0;
+	if (phase == FLASH_DONE || phase == FLASH_FAILED)
+		job->eta_us = 0;
+	if (port && (phase == FLASH_ERASE || phase == FLASH_WRITE))
+		trace_phase(trace_chan(port), flash_phase_name(phase), 1);
+	flash_progress(job, 0);
+}
+
+static stm32_t flash_connect(flash_job_t *job)
+{
+	const stm32_struct_t *stm;
+	port_interface_t *port;
+
+	if (job->autotune && (job->session == NULL || strcmp(job->session->device, job->device)))
+	{
+		link_profile_t profile;
+
+		/* the fastest rate this adapter handles reliably */
+		session_close(job->session);
+		if ((job->session = link_tune(&job->opts, job->init_flags, 0, &profile)) == NULL)
+		{
+			flash_log(job, "No reliable baud rate found on %s.", job->device);
+			return STM32_ERR_UNKNOWN;
+		}
+		flash_log(job, "Link tuned for %s: %u baud, %u us round trip",
+				  profile.adapter, profile.baud, profile.rtt_us);
+	}
+	else if (job->autotune)
+		job->opts.baudrate = job->session->opts.baudrate;	/* tuned before */
+	if ((job->session = session_reuse(job->session, &job->opts, job->init_flags)) == NULL)
+	{
+		flash_log(job, "Failed to initialize stm32 device on %s.", job->device);
+		return STM32_ERR_UNKNOWN;
+	}
+
+	port = job->session->port;
+	stm = job->session->stm;
+	job->baud = serial_get_baud_int(job->session->opts.baudrate);
+	flash_log(job, "Interface %s: %s%s", port->name, port->get_cfg_str(port),
+			  job->session->reused ? " (session reused)" : "");
+	flash_log(job, "Version		: 0x%02x", stm->bl_version);
+	if (port->flags & PORT_GVR_ETX)
+	{
+		flash_log(job, "Option 1	: 0x%02x", stm->option1);
+		flash_log(job, "Option 2	: 0x%02x", stm->option2);
+	}
+	flash_log(job, "Device ID	: 0x%04x (%s)", stm->pid, stm->dev->name);
+	flash_log(job, "- RAM		: %dKiB (%db reserved by bootloader)",
+			  (stm->dev->ram_end - 0x20000000) / 1024, stm->dev->ram_start - 0x20000000);
+	flash_log(job, "- Flash		: %dKiB (sector size: %dx%d)",
+			  (stm->dev->fl_end - stm->dev->fl_start) / 1024, stm->dev->fl_pps, stm->dev->fl_ps);
+	flash_log(job, "- Option RAM	: %db", stm->dev->opt_end - stm->dev->opt_start + 1);
+	flash_log(job, "- System RAM	: %dKiB", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
+	return STM32_OK;
+}
+
+/*
+ * Readout first: it mass erases the flash, which may leave the write
+ * protection in place. The device resets after each command, so the
+ * session reconnects before the next one.
+ */
+static stm32_t flash_unprotect(flash_job_t *job)
+{
+	stm32_t stm_err;
+
+	if (job->unprotect & FLASH_UNPROTECT_READ)
+	{
+		flash_log(job, "Removing the readout protection, this erases the flash.");
+		if ((stm_err = stm32_runprot_memory(job->session->stm)) != STM32_OK)
+			return stm_err;
+		if (session_reconnect(job->session) != STM32_OK)
+		{
+			flash_log(job, "No answer after the readout unprotect reset.");
+			return STM32_ERR_UNKNOWN;
+		}
+	}
+	if (job->unprotect & FLASH_UNPROTECT_WRITE)
+	{
+		flash_log(job, "Removing the write protection.");
+		if ((stm_err = stm32_wunprot_memory(job->session->stm)) != STM32_OK)
+			return stm_err;
+		if (session_reconnect(job->session) != STM32_OK)
+		{
+			flash_log(job, "No answer after the write unprotect reset.");
+			return STM32_ERR_UNKNOWN;
+		}
+	}
+	return STM32_OK;
+}
+
+static stm32_t flash_verify(flash_job_t *job, uint32_t start)
+{
+	const stm32_struct_t *stm = job->session->stm;
+	const flash_image_t *img = job->image;
+	uint32_t off, n;
+	stm32_t stm_err;
+
+	stm_err = stm32_verify_crc(stm, start, img->data, img->size);
+	if (stm_err != STM32_ERR_NO_CMD)
+		return stm_err;
+
+	/* no CRC command, read everything back */
+	for (off = 0; off < img->size; off += n)
+	{
+		if (flash_cancelled(job))
+			return STM32_ERR_UNKNOWN;
+		n = img->size - off > JOURNAL_BATCH ? JOURNAL_BATCH : img->size - off;
+		if ((stm_err = stm32_verify_read(stm, start + off, img->data + off, n)) != STM32_OK)
+			return stm_err;
+		flash_advance(job, off + n, img->size);
+	}
+	return STM32_OK;
+}
+
+/* ACK waits for op so far, over all connections of the session */
+static void flash_ack_hist(const session_t *s, uint8_t op, stats_hist_t *h)
+{
+	memset(h, 0, sizeof(stats_hist_t));
+	if (s->stats)
+		stats_hist_merge(h, &s->stats->ack[op]);
+	if (s->stm->stats)
+		stats_hist_merge(h, &s->stm->stats->ack[op]);
+}
+
+/*
+ * Connect, erase, write and optionally verify job->image. On failure
+ * the session is closed, as the bootloader state is unknown; on
+ * success or cancel it is kept in job->session for the next run.
+ */
+stm32_t flash_run(flash_job_t *job)
+{
+	const flash_image_t *img = job->image;
+	const stm32_struct_t *stm;
+	journal_t *journal = NULL;
+	uint8_t uid[STM32_UID_LEN];
+	stats_hist_t ack, ack0;
+	uint32_t addr, start, first_page, num_page, last_page, retries;
+	unsigned int len, max_wlen;
+	int paged;
+
+	memset(job->t_us, 0, sizeof(job->t_us));
+	job->resumed_at = 0;
+	job->retries = 0;
+	job->cancelled = 0;
+	job->written = 0;
+	job->baud = 0;
+	job->eta_us = 0;
+	job->phase = FLASH_IDLE;
+	job->t_mark = stats_now_us();
+
+	flash_enter(job, FLASH_CONNECT);
+	if (flash_cancelled(job))
+		goto cancelled;
+	if (flash_connect(job) != STM32_OK)
+		goto failed;
+	if (job->unprotect && flash_unprotect(job) != STM32_OK)
+		goto failed;
+	stm = job->session->stm;
+
+	start = job->address ? job->address : stm->dev->fl_start;
+	if (start < stm->dev->fl_start || start >= stm->dev->fl_end || (start & 3))
+	{
+		flash_log(job, "Address 0x%08x is not a word in the flash.", start);
+		goto failed;
+	}
+	if (img->size == 0 || img->size > stm->dev->fl_end - start)
+	{
+		flash_log(job, "Image of %u bytes does not fit the flash.", img->size);
+		goto failed;
+	}
+
+	max_wlen = job->opts.tx_frame_max - 2;	/* skip len and crc */
+	max_wlen &= ~3;		/* 32 bit aligned*/
+
+	/* pick up where an interrupted download of this image stopped */
+	if (stm32_read_uid(stm, uid) == STM32_OK)
+		journal = journal_open(uid, img->data, img->size, start);
+	addr = journal ? journal_resume(journal, stm) : start;
+	if (addr > start && job->erase == FLASH_ERASE_MASS)
+	{
+		journal_reset(journal);
+		addr = start;
+	}
+
+	first_page = (addr - stm->dev->fl_start) / stm->dev->fl_ps;
+	last_page = (start + img->size - 1 - stm->dev->fl_start) / stm->dev->fl_ps;
+	num_page = last_page - first_page + 1;
+	paged = start + img->size <= stm->dev->fl_start + stm32_paged_size(stm->dev);
+	if (job->erase == FLASH_ERASE_MASS
+	    || (job->erase == FLASH_ERASE_AUTO && addr == stm->dev->fl_start))
+	{
+		first_page = 0;
+		num_page = 0xff;	/* mass erase */
+	}
+	else if (job->erase == FLASH_ERASE_NONE)
+		num_page = 0;
+	else if ((last_page >= 0xff || num_page >= 0xff || !paged) && addr > start
+			 && start == stm->dev->fl_start && job->erase == FLASH_ERASE_AUTO)
+	{
+		/* page numbers do not fit the erase command or the sectors, start
+		 * over; only when the image starts the flash, as a fresh run would */
+		journal_reset(journal);
+		addr = start;
+		first_page = 0;
+		num_page = 0xff;
+	}
+	else if (last_page >= 0xff)
+	{
+		flash_log(job, "Pages above 254 can only be mass erased.");
+		goto failed;
+	}
+	else if (num_page >= 0xff)
+	{
+		/* 0xff pages is the mass erase code of the ERASE command */
+		flash_log(job, "At most 254 pages can be erased at once, %u would be a mass erase.", num_page);
+		goto failed;
+	}
+	else if (!paged)
+	{
+		flash_log(job, "Sectors of %s above 0x%08x can only be mass erased.", stm->dev->name,
+				  stm->dev->fl_start + stm32_paged_size(stm->dev));
+		goto failed;
+	}
+
+	if (addr > start)
+	{
+		job->resumed_at = addr;
+		flash_log(job, "Resuming at 0x%08x.", addr);
+	}
+
+	if (flash_cancelled(job))
+		goto cancelled;
+	job->eta_us = flash_plan(job, num_page ? last_page - first_page + 1 : 0, start + img->size - addr);
+	flash_enter(job, FLASH_ERASE);
+	flash_log(job, "Erasing flash memory.");
+	if (stm32_erase_memory(stm, first_page, num_page) != STM32_OK)
+	{
+		flash_log(job, "Failed to erase flash memory.");
+		goto failed;
+	}
+
+	job->eta_us = flash_plan(job, 0, start + img->size - addr);
+	flash_enter(job, FLASH_WRITE);
+	flash_log(job, "Write data to flash memory.");
+	retries = job->session->block_retries;
+	flash_ack_hist(job->session, stm->cmd->wm, &ack0);
+	flash_advance(job, addr - start, img->size);
+	while (addr < start + img->size)
+	{
+		if (flash_cancelled(job))
+			goto cancelled;
+		len = max_wlen > start + img->size - addr ? start + img->size - addr : max_wlen;
+
+		/* retries may re-init the bootloader and replace stm */
+		if (session_write_block(job->session, img->data, start, addr, len) != STM32_OK)
+		{
+			flash_log(job, "Failed to write flash memory at address 0x%08x.", addr);
+			goto failed;
+		}
+		stm = job->session->stm;
+
+		addr += len;
+		job->written += len;
+		if (journal && journal_written(journal, stm, addr) != STM32_OK)
+		{
+			flash_log(job, "Failed to verify flash memory below 0x%08x.", addr);
+			goto failed;
+		}
+		flash_advance(job, addr - start, img->size);
+	}
+	if (journal && journal_flush(journal, stm) != STM32_OK)
+	{
+		flash_log(job, "Failed to verify flash memory.");
+		goto failed;
+	}
+	job->retries = job->session->block_retries - retries;
+	if (job->retries)
+		flash_log(job, "Recovered %u failed blocks.", job->retries);
+	/* the adapter latency shows here first, see opts.low_latency */
+	flash_ack_hist(job->session, stm->cmd->wm, &ack);
+	stats_hist_sub(&ack, &ack0);
+	if (ack.count)
+		flash_log(job, "Write ACK latency: p50 %llu us, p99 %llu us over %u ACKs",
+				  (unsigned long long)stats_hist_percentile(&ack, 50),
+				  (unsigned long long)stats_hist_percentile(&ack, 99), ack.count);
+
+	if (job->verify)
+	{
+		job->eta_us = flash_plan(job, 0, 0);
+		flash_enter(job, FLASH_VERIFY);
+		if (flash_verify(job, start) != STM32_OK)
+		{
+			if (flash_cancelled(job))
+				goto cancelled;
+			flash_log(job, "Flash memory does not match the image.");
+			goto failed;
+		}
+	}
+	if (journal)
+		journal_done(journal);
+
+	flash_enter(job, FLASH_DONE);
+	flash_log(job, "Done!");
+	return STM32_OK;
+
+cancelled:
+	/* between two commands: the bootloader is fine, keep the session */
+	job->cancelled = 1;
+	flash_log(job, "Cancelled.");
+failed:
+	job->failed_in = job->phase;
+	flash_enter(job, FLASH_FAILED);
+	if (journal)
+		journal_close(journal);
+	if (!job->cancelled)
+	{
+		session_close(job->session);
+		job->session = NULL;
+	}
+	return STM32_ERR_UNKNOWN;
+}
+
+static void* flash_gang_worker(void *arg)
+{
+	flash_run((flash_job_t *)arg);
+	return NULL;
+}
+
+/*
+ * Run the jobs concurrently, one thread per port. A failing port does
+ * not affect the others. Returns the number of failed jobs.
+ */
+int flash_gang(flash_job_t *jobs, int n)
+{
+	pthread_t tid[FLASH_GANG_MAX];
+	int started[FLASH_GANG_MAX];
+	int i, failed = 0;
+
+	/* ports past the cap are not run, but are counted as failed */
+	for (i = FLASH_GANG_MAX; i < n; i++)
+	{
+		log_msg(LOG_LVL_ERROR, "flash", "At most %d ports at once, %s not started",
+				FLASH_GANG_MAX, jobs[i].device);
+		jobs[i].failed_in = FLASH_IDLE;
+		jobs[i].phase = FLASH_FAILED;
+		failed++;
+	}
+	if (n > FLASH_GANG_MAX)
+		n = FLASH_GANG_MAX;
+	for (i = 0; i < n; i++)
+	{
+		started[i] = pthread_create(&tid[i], NULL, flash_gang_worker, &jobs[i]) == 0;
+		if (!started[i])
+		{
+			log_msg(LOG_LVL_ERROR, "flash", "Can't start the job of %s", jobs[i].device);
+			jobs[i].failed_in = FLASH_IDLE;
+			jobs[i].phase = FLASH_FAILED;
+		}
+	}
+	for (i = 0; i < n; i++)
+	{
+		if (started[i])
+			pthread_join(tid[i], NULL);
+		if (jobs[i].phase != FLASH_DONE)
+			failed++;
+	}
+	return failed;
+}
+
+/* status, phase timings and recovered blocks of one port, no line end */
+void flash_report_line(const flash_job_t *job, char *buf, size_t size)
+{
+	size_t n;
+
+	n = snprintf(buf, size, "%-16s %-6s", job->device,
+				 job->phase == FLASH_DONE ? "ok" : job->cancelled ? "cancelled" : "FAILED");
+	if (n < size && job->phase != FLASH_DONE)
+		n += snprintf(buf + n, size - n, " in %-7s", flash_phase_name(job->failed_in));
+	if (n < size)
+		n += snprintf(buf + n, size - n, " connect %.3f s, erase %.3f s, write %.3f s, verify %.3f s",
+					  job->t_us[FLASH_CONNECT] / 1e6, job->t_us[FLASH_ERASE] / 1e6,
+					  job->t_us[FLASH_WRITE] / 1e6, job->t_us[FLASH_VERIFY] / 1e6);
+	if (n < size && job->retries)
+		n += snprintf(buf + n, size - n, ", %u blocks retried", job->retries);
+	if (n < size && job->resumed_at)
+		snprintf(buf + n, size - n, ", resumed at 0x%08x", job->resumed_at);
+}
+
+void flash_report(const flash_job_t *jobs, int n, FILE *f)
+{
+	char buf[256];
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		flash_report_line(&jobs[i], buf, sizeof(buf));
+		fprintf(f, "%s\n", buf);
+	}
+}
+
+/* "12.5 KiB/s, 3 s left" of a running job, empty while unknown */
+void flash_rate_str(const flash_job_t *job, char *buf, size_t size)
+{
+	size_t n = 0;
+
+	buf[0] = 0;
+	if (job->rate_bps > 0)
+		n = snprintf(buf, size, "%.1f KiB/s", job->rate_bps / 1024);
+	if (n < size && job->eta_us)
+		snprintf(buf + n, size - n, "%s%u s left", n ? ", " : "",
+				 (unsigned int)((job->eta_us + 999999) / 1000000));
+}
+
+static void flash_json_str(const char *s, FILE *f)
+{
+	fputc('"', f);
+	for (; *s; s++)
+	{
+		if (*s == '"' || *s == '\\')
+			fprintf(f, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(f, "\\u%04x", *s);
+		else
+			fputc(*s, f);
+	}
+	fputc('"', f);
+}
+
+/* the report of flash_report() as one JSON object, for scripts */
+void flash_summary_json(const flash_job_t *jobs, int n, FILE *f)
+{
+	const flash_job_t *job;
+	flash_phase_t phase;
+	int i, failed = 0;
+
+	for (i = 0; i < n; i++)
+		failed += jobs[i].phase != FLASH_DONE;
+	fprintf(f, "{\"devices\": %d, \"failed\": %d, \"jobs\": [", n, failed);
+	for (i = 0; i < n; i++)
+	{
+		job = &jobs[i];
+		fprintf(f, "%s\n  {\"device\": ", i ? "," : "");
+		flash_json_str(job->device, f);
+		fprintf(f, ", \"status\": \"%s\", \"failed_in\": ",
+				job->phase == FLASH_DONE ? "ok" : job->cancelled ? "cancelled" : "failed");
+		if (job->phase == FLASH_DONE)
+			fprintf(f, "null");
+		else
+			fprintf(f, "\"%s\"", flash_phase_name(job->failed_in));
+		fprintf(f, ", \"baud\": %u, \"bytes\": %u, \"written\": %u, \"resumed_at\": %u, \"retries\": %u,",
+				job->baud, job->image ? job->image->size : 0, job->written, job->resumed_at, job->retries);
+		fprintf(f, " \"write_bps\": %.0f, \"t_us\": {",
+				job->t_us[FLASH_WRITE] ? job->written * 1e6 / job->t_us[FLASH_WRITE] : 0);
+		for (phase = FLASH_CONNECT; phase <= FLASH_VERIFY; phase++)
+			fprintf(f, "%s\"%s\": %llu", phase == FLASH_CONNECT ? "" : ", ",
+					flash_phase_name(phase), (unsigned long long)job->t_us[phase]);
+		fprintf(f, "}}");
+	}
+	fprintf(f, "\n]}\n");
+}
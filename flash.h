@@ -0,0 +1,130 @@
+/******************************************************************************
+ * flashing flow, shared by the GUI and gang programming
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _FLASH_H
+#define _FLASH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "parser.h"
+#include "port.h"
+#include "stm32.h"
+#include "session.h"
+
+#define FLASH_GANG_MAX	32		/* ports driven at once */
+#define FLASH_RATE_WINDOW_US	250000	/* rate samples are at least this long */
+#define FLASH_PROGRAM_US_KIB	30000	/* programming 1 KiB, typical of F1/F4 parts */
+#define FLASH_ERASE_US_PAGE		20000	/* erasing one page */
+
+typedef enum
+{
+	FLASH_IDLE,
+	FLASH_CONNECT,
+	FLASH_ERASE,
+	FLASH_WRITE,
+	FLASH_VERIFY,
+	FLASH_DONE,
+	FLASH_FAILED,
+	FLASH_PHASES
+} flash_phase_t;
+
+/* how flash_run() clears the flash before writing */
+typedef enum
+{
+	FLASH_ERASE_AUTO,		/* mass erase, pages when resuming or at an offset */
+	FLASH_ERASE_MASS,		/* always the whole flash, never resumes */
+	FLASH_ERASE_PAGES,		/* only the pages under the image */
+	FLASH_ERASE_NONE,		/* the target is known to be blank */
+} flash_erase_t;
+
+/* protections flash_run() removes first, each one resets the device */
+#define FLASH_UNPROTECT_READ	0x01	/* mass erases the flash as well */
+#define FLASH_UNPROTECT_WRITE	0x02
+
+/* an image parsed once, read only while jobs run */
+typedef struct flash_image
+{
+	uint8_t			*data;
+	uint32_t		size;
+} flash_image_t;
+
+typedef struct flash_job flash_job_t;
+
+/*
+ * One download to one port. The callbacks are called from the thread
+ * running flash_run(), messages come without line ending.
+ */
+struct flash_job
+{
+	port_opt_t			opts;			/* opts.device names the port */
+	char				device[256];
+	unsigned int		init_flags;		/* passed to stm32_init() */
+	int					autotune;		/* pick the baud rate with link_tune() */
+	int					verify;			/* check the whole image after writing */
+	uint32_t			address;		/* where the image goes, 0: start of flash */
+	flash_erase_t		erase;
+	unsigned int		unprotect;		/* FLASH_UNPROTECT_* */
+	const flash_image_t	*image;
+
+	void				(*log)(flash_job_t *job, const char *msg);
+	void				(*progress)(flash_job_t *job, flash_phase_t phase, double fraction);
+	void				*user;
+
+	/* kept open after a successful or cancelled run, for the next one */
+	session_t			*session;
+	int					cancel;			/* set by flash_cancel(), from any thread */
+
+	/* results */
+	flash_phase_t		phase;			/* FLASH_DONE or FLASH_FAILED at the end */
+	flash_phase_t		failed_in;
+	int					cancelled;		/* stopped by flash_cancel() */
+	uint64_t			t_us[FLASH_PHASES];	/* time spent in each phase */
+	uint32_t			resumed_at;		/* 0 unless a journal was resumed */
+	uint32_t			retries;		/* recovered blocks */
+	uint32_t			written;		/* bytes written by this run */
+	unsigned int		baud;			/* of the link, 0 before connecting */
+	uint64_t			t_mark;			/* start of the current phase */
+
+	/* live figures, valid in the progress callback */
+	uint32_t			bytes_done;		/* of the current phase */
+	uint32_t			bytes_total;
+	double				rate_bps;		/* rolling rate of the current phase */
+	uint64_t			eta_us;			/* left until done, 0 when unknown */
+	uint32_t			rate_bytes;		/* start of the rate sample */
+	uint64_t			rate_mark;
+};
+
+parser_t	flash_image_load(parser_ops_t *parser, const char *filename, flash_image_t *img);
+void		flash_image_free(flash_image_t *img);
+const char*	flash_phase_name(flash_phase_t phase);
+void		flash_job_init(flash_job_t *job, const port_opt_t *opts, const char *device,
+						   const flash_image_t *image);
+stm32_t		flash_run(flash_job_t *job);
+void		flash_cancel(flash_job_t *job);
+int			flash_cancelled(const flash_job_t *job);
+int			flash_gang(flash_job_t *jobs, int n);
+void		flash_report_line(const flash_job_t *job, char *buf, size_t size);
+void		flash_report(const flash_job_t *jobs, int n, FILE *f);
+void		flash_rate_str(const flash_job_t *job, char *buf, size_t size);
+void		flash_summary_json(const flash_job_t *jobs, int n, FILE *f);
+
+#endif
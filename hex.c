@@ -20,7 +20,6 @@
  * ****************************************************************************
  */
 
-#include <vte/vte.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <unistd.h>
@@ -29,7 +28,6 @@
 #include <stdio.h>
 #include <assert.h>
 #include <string.h>
-#include "window.h"
 #include "hex.h"
 
 void* hex_init() 
@@ -47,7 +45,12 @@ parser_t hex_open(void *storage, const char *filename)
 	uint32_t base = 0;
 	unsigned int last_address = 0x0;
 
-	if ((fd = open (filename, O_RDONLY)) < 0)
+	/* "-" reads the image from the standard input */
+	if (strcmp(filename, "-") == 0)
+		fd = dup(STDIN_FILENO);
+	else
+		fd = open (filename, O_RDONLY);
+	if (fd < 0)
 		return PARSER_ERR_SYSTEM;
 	
 	/** 
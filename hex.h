@@ -22,10 +22,10 @@
 
 #ifndef _HEX_H
 #define _HEX_H
+#include <stddef.h>
 #include <stdint.h>
 #include "parser.h"
 
-extern window_t *data;
 extern parser_ops_t PARSER_HEX;
 
 typedef struct 
@@ -0,0 +1,275 @@
+/******************************************************************************
+ * Serial port discovery and hotplug
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+#define _GNU_SOURCE				/* strverscmp */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include "hotplug.h"
+#include "journal.h"
+#include "log.h"
+
+/*
+ * The ports are listed from /sys/class/tty: every tty backed by a device
+ * is a candidate, except the 8250 placeholders without a UART behind.
+ * Changes are seen through inotify on /dev rather than the kernel uevent
+ * socket, so that the rescan finds the node created with its final
+ * permissions by udev, and no libudev is needed.
+ */
+#define SYSFS_TTY	"/sys/class/tty"
+
+struct hotplug
+{
+	int		fd;
+};
+
+/* first line of a sysfs attribute, without line end */
+static int sysfs_read(const char *dir, const char *name, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(buf, size, f) == NULL)
+		buf[0] = 0;
+	buf[strcspn(buf, "\n")] = 0;
+	fclose(f);
+	return 0;
+}
+
+/* name of the driver bound to dir or, for the serial core ports, above */
+static void sysfs_driver(const char *dir, char *buf, size_t size)
+{
+	char path[PATH_MAX], link[PATH_MAX + 8], target[PATH_MAX], *p;
+	ssize_t len;
+	int depth;
+
+	snprintf(path, sizeof(path), "%s", dir);
+	for (depth = 0; depth < 3; depth++)
+	{
+		snprintf(link, sizeof(link), "%s/driver", path);
+		if ((len = readlink(link, target, sizeof(target) - 1)) > 0)
+		{
+			target[len] = 0;
+			p = strrchr(target, '/');
+			p = p ? p + 1 : target;
+			if (strcmp(p, "port") != 0 && strcmp(p, "ctrl") != 0)
+			{
+				snprintf(buf, size, "%s", p);
+				return;
+			}
+		}
+		if ((p = strrchr(path, '/')) == NULL || p == path)
+			break;
+		*p = 0;
+	}
+	buf[0] = 0;
+}
+
+/* the USB device above a tty: the first directory with an idVendor */
+static void sysfs_usb(const char *dir, hotplug_port_t *port)
+{
+	char path[PATH_MAX], buf[64], *p;
+
+	snprintf(path, sizeof(path), "%s", dir);
+	while (strcmp(path, "/sys/devices") != 0)
+	{
+		if (sysfs_read(path, "idVendor", buf, sizeof(buf)) == 0)
+		{
+			port->vid = strtoul(buf, NULL, 16);
+			if (sysfs_read(path, "idProduct", buf, sizeof(buf)) == 0)
+				port->pid = strtoul(buf, NULL, 16);
+			sysfs_read(path, "serial", port->serial, sizeof(port->serial));
+			snprintf(port->usb_path, sizeof(port->usb_path), "%s", strrchr(path, '/') + 1);
+			return;
+		}
+		if ((p = strrchr(path, '/')) == NULL || p == path)
+			return;
+		*p = 0;
+	}
+}
+
+static int port_compare(const void *a, const void *b)
+{
+	return strverscmp(((const hotplug_port_t *)a)->device, ((const hotplug_port_t *)b)->device);
+}
+
+/* the serial ports present now, sorted by name; returns how many */
+int hotplug_scan(hotplug_port_t *ports, int max)
+{
+	char tty[PATH_MAX], dev[PATH_MAX], buf[16];
+	struct dirent *d;
+	DIR *dir;
+	int n = 0;
+
+	if ((dir = opendir(SYSFS_TTY)) == NULL)
+	{
+		log_msg(LOG_LVL_ERROR, "hotplug", "Cannot list %s: %s", SYSFS_TTY, strerror(errno));
+		return 0;
+	}
+	while ((d = readdir(dir)) != NULL && n < max)
+	{
+		if (d->d_name[0] == '.')
+			continue;
+		snprintf(tty, sizeof(tty), "%s/%s/device", SYSFS_TTY, d->d_name);
+		if (realpath(tty, dev) == NULL)
+			continue;		/* virtual: console, ptys, vts */
+		*strrchr(tty, '/') = 0;
+		if (sysfs_read(tty, "type", buf, sizeof(buf)) == 0 && strtol(buf, NULL, 0) == 0)
+			continue;		/* serial core port without a UART (PORT_UNKNOWN) */
+
+		memset(&ports[n], 0, sizeof(hotplug_port_t));
+		if (snprintf(ports[n].device, sizeof(ports[n].device), "/dev/%s", d->d_name)
+			>= (int)sizeof(ports[n].device) || access(ports[n].device, F_OK) != 0)
+			continue;		/* not created by udev yet */
+		sysfs_driver(dev, ports[n].driver, sizeof(ports[n].driver));
+		sysfs_usb(dev, &ports[n]);
+		n++;
+	}
+	closedir(dir);
+	qsort(ports, n, sizeof(hotplug_port_t), port_compare);
+	return n;
+}
+
+/*
+ * Read $HOME/JOURNAL_DIR/HOTPLUG_SLOTS_FILE; returns the number of bound
+ * slots, -1 without a slots file.
+ */
+int hotplug_slots_load(hotplug_slot_t *slots, int max)
+{
+	const char *home = getenv("HOME");
+	char path[PATH_MAX], line[256], match[64];
+	int slot, n = 0, lineno = 0;
+	FILE *f;
+
+	memset(slots, 0, max * sizeof(hotplug_slot_t));
+	if (home == NULL)
+		return -1;
+	snprintf(path, sizeof(path), "%s/%s/%s", home, JOURNAL_DIR, HOTPLUG_SLOTS_FILE);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	while (fgets(line, sizeof(line), f))
+	{
+		lineno++;
+		line[strcspn(line, "#")] = 0;
+		if (sscanf(line, "%d %63s", &slot, match) != 2)
+		{
+			if (strspn(line, " \t\r\n") != strlen(line))
+				log_msg(LOG_LVL_WARN, "hotplug", "%s:%d: expected <slot> <match>", path, lineno);
+			continue;
+		}
+		if (slot < 0 || slot >= max)
+		{
+			log_msg(LOG_LVL_WARN, "hotplug", "%s:%d: no slot %d", path, lineno, slot);
+			continue;
+		}
+		snprintf(slots[slot].match, sizeof(slots[slot].match), "%s", match);
+		n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* the slot an adapter is bound to, -1 if none */
+int hotplug_slot_of(const hotplug_slot_t *slots, int max, const hotplug_port_t *port)
+{
+	const char *m;
+	int i;
+
+	for (i = 0; i < max; i++)
+	{
+		m = slots[i].match;
+		if (strncmp(m, "serial=", 7) == 0)
+		{
+			if (port->serial[0] && strcmp(m + 7, port->serial) == 0)
+				return i;
+		}
+		else if (strncmp(m, "usb=", 4) == 0)
+		{
+			if (port->usb_path[0] && strcmp(m + 4, port->usb_path) == 0)
+				return i;
+		}
+		else if (m[0] && strcmp(m, port->device) == 0)
+			return i;
+	}
+	return -1;
+}
+
+hotplug_t* hotplug_open(void)
+{
+	hotplug_t *h;
+
+	if ((h = calloc(1, sizeof(hotplug_t))) == NULL)
+		return NULL;
+	h->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (h->fd < 0 || inotify_add_watch(h->fd, "/dev",
+						IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM) < 0)
+	{
+		log_msg(LOG_LVL_ERROR, "hotplug", "Cannot watch /dev: %s", strerror(errno));
+		hotplug_close(h);
+		return NULL;
+	}
+	return h;
+}
+
+/* readable when something changed in /dev, for poll() or the main loop */
+int hotplug_fd(hotplug_t *h)
+{
+	return h->fd;
+}
+
+/* drain the pending events; 1 if a tty came or went and a rescan is due */
+int hotplug_changed(hotplug_t *h)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int changed = 0;
+	ssize_t len;
+	char *p;
+
+	while ((len = read(h->fd, buf, sizeof(buf))) > 0)
+	{
+		for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len)
+		{
+			ev = (const struct inotify_event *)p;
+			if ((ev->mask & IN_Q_OVERFLOW) || (ev->len && strncmp(ev->name, "tty", 3) == 0))
+				changed = 1;
+		}
+	}
+	return changed;
+}
+
+void hotplug_close(hotplug_t *h)
+{
+	if (h == NULL)
+		return;
+	if (h->fd >= 0)
+		close(h->fd);
+	free(h);
+}
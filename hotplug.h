@@ -0,0 +1,61 @@
+/******************************************************************************
+ * Serial port discovery and hotplug header file
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _HOTPLUG_H
+#define _HOTPLUG_H
+
+#define HOTPLUG_PORTS_MAX	64
+#define HOTPLUG_SLOTS_MAX	8			/* one per gang row */
+#define HOTPLUG_SLOTS_FILE	"slots"		/* in $HOME/JOURNAL_DIR */
+
+/* a serial port found in /sys/class/tty */
+typedef struct hotplug_port
+{
+	char	device[64];			/* /dev/ttyUSB0 */
+	char	driver[32];			/* ftdi_sio, cp210x, cdc_acm, serial8250... */
+	char	usb_path[32];		/* physical USB port, e.g. 1-1.2, empty if not USB */
+	char	serial[64];			/* USB serial number, empty if none */
+	unsigned int	vid, pid;
+} hotplug_port_t;
+
+/*
+ * The fixture slots: "<slot> <match>" lines, where match is
+ * serial=<USB serial number>, usb=<physical USB port> or a device path.
+ * A slot follows its adapter from one ttyUSB name to the next.
+ */
+typedef struct hotplug_slot
+{
+	char	match[64];			/* empty: not bound */
+} hotplug_slot_t;
+
+typedef struct hotplug hotplug_t;
+
+int			hotplug_scan(hotplug_port_t *ports, int max);
+int			hotplug_slots_load(hotplug_slot_t *slots, int max);
+int			hotplug_slot_of(const hotplug_slot_t *slots, int max, const hotplug_port_t *port);
+
+hotplug_t*	hotplug_open(void);
+int			hotplug_fd(hotplug_t *h);
+int			hotplug_changed(hotplug_t *h);
+void		hotplug_close(hotplug_t *h);
+
+#endif
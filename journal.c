@@ -0,0 +1,265 @@
+/******************************************************************************
+ * crash-safe flashing journal
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "journal.h"
+#include "log.h"
+
+/*
+ * $HOME/.gstm32flash.d/<uid>.journal holds a header naming the image
+ * and one line per verified range:
+ *
+ *	gstm32flash-journal <hash> <base> <size>
+ *	ok <start> <end> <check>
+ *
+ * Lines are appended and fsync'ed once per JOURNAL_BATCH bytes, so a
+ * crash loses at most the batch in flight; a torn last line fails its
+ * check and is ignored. Ranges are verified with the CRC command where
+ * the bootloader has one; older bootloaders only get a read back of the
+ * last batch when resuming.
+ */
+#define JOURNAL_MAGIC	"gstm32flash-journal"
+
+/* FNV-1a, 64 bit */
+uint64_t journal_hash(const uint8_t *buf, uint32_t len)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+
+	while (len--)
+	{
+		h ^= *buf++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint32_t journal_check(const journal_t *j, uint32_t start, uint32_t end)
+{
+	return start ^ end ^ (uint32_t)j->hash ^ (uint32_t)(j->hash >> 32);
+}
+
+static int journal_sync(journal_t *j)
+{
+	if (fflush(j->f) != 0 || fsync(fileno(j->f)) != 0)
+	{
+		log_msg(LOG_LVL_WARN, "journal", "Cannot sync journal %s", j->path);
+		return -1;
+	}
+	return 0;
+}
+
+/* start over, e.g. for a new image or when the device lost the data */
+void journal_reset(journal_t *j)
+{
+	if (j->f)
+		fclose(j->f);
+	j->done = j->pending = j->base;
+	if ((j->f = fopen(j->path, "w")) == NULL)
+	{
+		log_msg(LOG_LVL_WARN, "journal", "Cannot write journal %s", j->path);
+		return;
+	}
+	fprintf(j->f, "%s %016llx %08x %u\n", JOURNAL_MAGIC,
+			(unsigned long long)j->hash, j->base, j->size);
+	journal_sync(j);
+}
+
+static void journal_load(journal_t *j)
+{
+	char line[128], magic[32];
+	unsigned long long hash;
+	unsigned int base, size, start, end, check;
+	FILE *f;
+
+	if ((f = fopen(j->path, "r")) == NULL)
+		return;
+	if (fgets(line, sizeof(line), f) == NULL
+	    || sscanf(line, "%31s %llx %x %u", magic, &hash, &base, &size) != 4
+	    || strcmp(magic, JOURNAL_MAGIC) || hash != j->hash
+	    || base != j->base || size != j->size)
+	{
+		fclose(f);
+		return;
+	}
+
+	/* the verified prefix grows with each contiguous range */
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		if (sscanf(line, "ok %x %x %x", &start, &end, &check) != 3
+		    || check != journal_check(j, start, end))
+			break;
+		if (start <= j->done && end > j->done && end <= j->base + j->size)
+			j->done = end;
+	}
+	j->pending = j->done;
+	fclose(f);
+}
+
+journal_t* journal_open(const uint8_t *uid, const uint8_t *image, uint32_t size, uint32_t base)
+{
+	const char *home = getenv("HOME");
+	journal_t *j;
+	int i, n;
+
+	if (home == NULL)
+		return NULL;
+
+	j = calloc(1, sizeof(journal_t));
+	if (j == NULL)
+		return NULL;
+	j->hash		= journal_hash(image, size);
+	j->image	= image;
+	j->base		= base;
+	j->size		= size;
+	j->done		= base;
+	j->pending	= base;
+
+	n = snprintf(j->path, sizeof(j->path), "%s/%s", home, JOURNAL_DIR);
+	if (mkdir(j->path, 0700) != 0 && errno != EEXIST)
+	{
+		log_msg(LOG_LVL_WARN, "journal", "Cannot create %s", j->path);
+		free(j);
+		return NULL;
+	}
+	n += snprintf(j->path + n, sizeof(j->path) - n, "/");
+	for (i = 0; i < STM32_UID_LEN; i++)
+		n += snprintf(j->path + n, sizeof(j->path) - n, "%02x", uid[i]);
+	snprintf(j->path + n, sizeof(j->path) - n, ".journal");
+
+	journal_load(j);
+	if (j->done == base)
+		journal_reset(j);
+	else if ((j->f = fopen(j->path, "a")) == NULL)
+	{
+		log_msg(LOG_LVL_WARN, "journal", "Cannot write journal %s", j->path);
+		free(j);
+		return NULL;
+	}
+	return j;
+}
+
+/* compare [from, to) of the image with the device, -1 if it cannot tell */
+static int journal_verify_crc(journal_t *j, const stm32_struct_t *stm, uint32_t from, uint32_t to)
+{
+	stm32_t stm_err;
+
+	stm_err = stm32_verify_crc(stm, from, j->image + (from - j->base), to - from);
+	if (stm_err == STM32_ERR_NO_CMD)
+		return -1;
+	return stm_err == STM32_OK;
+}
+
+static int journal_verify_read(journal_t *j, const stm32_struct_t *stm, uint32_t from, uint32_t to)
+{
+	return stm32_verify_read(stm, from, j->image + (from - j->base), to - from) == STM32_OK;
+}
+
+/*
+ * Check the journaled prefix against the device and return the flash
+ * address to continue writing from, rounded down to a page start so
+ * that the caller can erase the rest page by page. Returns the base of
+ * the image if there is nothing to resume.
+ */
+uint32_t journal_resume(journal_t *j, const stm32_struct_t *stm)
+{
+	uint32_t from, page;
+	int ok;
+
+	if (j->done == j->base)
+		return j->base;
+
+	ok = journal_verify_crc(j, stm, j->base, j->done);
+	if (ok < 0)
+	{
+		from = j->done - j->base > JOURNAL_BATCH ? j->done - JOURNAL_BATCH : j->base;
+		ok = journal_verify_read(j, stm, from, j->done);
+	}
+	if (!ok)
+	{
+		log_msg(LOG_LVL_WARN, "journal", "Journaled data not found on the device, starting over");
+		journal_reset(j);
+		return j->base;
+	}
+
+	page = stm->dev->fl_start + (j->done - stm->dev->fl_start) / stm->dev->fl_ps * stm->dev->fl_ps;
+	if (page < j->base)
+		page = j->base;
+	j->done = j->pending = page;
+	return page;
+}
+
+static stm32_t journal_commit(journal_t *j, const stm32_struct_t *stm)
+{
+	if (j->pending == j->done)
+		return STM32_OK;
+	if (journal_verify_crc(j, stm, j->done, j->pending) == 0)
+	{
+		log_msg(LOG_LVL_ERROR, "journal", "Verify failed at 0x%08x-0x%08x", j->done, j->pending);
+		return STM32_ERR_UNKNOWN;
+	}
+	/* verified even when the journal cannot be written, so that the next
+	 * check starts here and not at the base again */
+	if (j->f != NULL)
+	{
+		fprintf(j->f, "ok %08x %08x %08x\n", j->done, j->pending,
+				journal_check(j, j->done, j->pending));
+		journal_sync(j);
+	}
+	j->done = j->pending;
+	return STM32_OK;
+}
+
+/* the image is written and acknowledged up to end */
+stm32_t journal_written(journal_t *j, const stm32_struct_t *stm, uint32_t end)
+{
+	j->pending = end;
+	if (j->pending - j->done < JOURNAL_BATCH)
+		return STM32_OK;
+	return journal_commit(j, stm);
+}
+
+stm32_t journal_flush(journal_t *j, const stm32_struct_t *stm)
+{
+	return journal_commit(j, stm);
+}
+
+/* the whole image is on the device, nothing left to resume */
+void journal_done(journal_t *j)
+{
+	if (j->f)
+		fclose(j->f);
+	unlink(j->path);
+	free(j);
+}
+
+/* keep the journal for a later resume */
+void journal_close(journal_t *j)
+{
+	if (j->f)
+		fclose(j->f);
+	free(j);
+}
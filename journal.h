@@ -0,0 +1,57 @@
+/******************************************************************************
+ * crash-safe flashing journal
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _JOURNAL_H
+#define _JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "stm32.h"
+
+#define JOURNAL_DIR		".gstm32flash.d"	/* in $HOME */
+#define JOURNAL_BATCH	8192				/* bytes verified and synced together */
+
+/*
+ * Append-only record of the verified prefix of an image on one device,
+ * keyed by the device unique ID and a hash of the image.
+ */
+typedef struct journal
+{
+	char			path[512];
+	FILE			*f;
+	uint64_t		hash;
+	const uint8_t	*image;
+	uint32_t		base, size;		/* flash address and length of the image */
+	uint32_t		done;			/* end of the verified prefix */
+	uint32_t		pending;		/* end of the written, unverified data */
+} journal_t;
+
+uint64_t	journal_hash(const uint8_t *buf, uint32_t len);
+journal_t*	journal_open(const uint8_t *uid, const uint8_t *image, uint32_t size, uint32_t base);
+uint32_t	journal_resume(journal_t *j, const stm32_struct_t *stm);
+void		journal_reset(journal_t *j);
+stm32_t		journal_written(journal_t *j, const stm32_struct_t *stm, uint32_t end);
+stm32_t		journal_flush(journal_t *j, const stm32_struct_t *stm);
+void		journal_done(journal_t *j);
+void		journal_close(journal_t *j);
+
+#endif
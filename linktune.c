@@ -0,0 +1,307 @@
+/******************************************************************************
+ * serial link auto-tuning
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include "linktune.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * The bootloader detects the baud rate from the first 0x7F after a
+ * reset, so each rate of the ladder gets its own reset and handshake,
+ * followed by LINK_PROBES GID round trips. The first rate, highest
+ * first, with no more than LINK_MAX_ERRORS failed probes wins and is
+ * stored per adapter in ~/.gstm32flash as
+ *
+ *	<adapter> <baud> <rtt_us> <errors>
+ *
+ * A board without the reset wiring never sees those resets, and its
+ * bootloader keeps the rate of the first 0x7F it got. So before the
+ * ladder, the first reset goes out at the asked rate; if nothing
+ * answers, that rate is tried without a reset and used untuned.
+ */
+#define LINK_PROFILE_MAX	64
+
+/* gang runs tune several adapters at once */
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const unsigned int link_ladder[] = {
+	4000000, 3000000, 2000000, 1500000, 1000000, 921600, 576000, 500000,
+	460800, 230400, 115200, 57600, 0
+};
+
+static int link_read_attr(const char *dir, const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	FILE *f;
+
+	snprintf(path, sizeof(path), "%s/%s", dir, attr);
+	if ((f = fopen(path, "r")) == NULL)
+		return -1;
+	if (fgets(buf, size, f) == NULL)
+	{
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, " \t\r\n")] = 0;
+	return buf[0] ? 0 : -1;
+}
+
+/*
+ * Identify the adapter behind a tty by its USB vendor, product and
+ * serial number, so that its profile follows it to another port.
+ * Returns 1 for a USB id, 0 if the device path is used instead.
+ */
+int link_adapter_id(const char *device, char *buf, size_t size)
+{
+	char path[PATH_MAX], dir[PATH_MAX], serial[64], vid[8], pid[8];
+	char *slash;
+	int i;
+
+	snprintf(buf, size, "%s", device);
+	if (strncmp(device, "/dev/", 5))
+		return 0;
+
+	snprintf(path, sizeof(path), "/sys/class/tty/%s/device", strrchr(device, '/') + 1);
+	if (realpath(path, dir) == NULL)
+		return 0;
+
+	/* the interface is a child of the USB device that has the serial */
+	for (i = 0; i < 4; i++)
+	{
+		if (link_read_attr(dir, "serial", serial, sizeof(serial)) == 0)
+		{
+			if (link_read_attr(dir, "idVendor", vid, sizeof(vid)) != 0)
+				strcpy(vid, "0000");
+			if (link_read_attr(dir, "idProduct", pid, sizeof(pid)) != 0)
+				strcpy(pid, "0000");
+			snprintf(buf, size, "usb-%s:%s-%s", vid, pid, serial);
+			return 1;
+		}
+		if ((slash = strrchr(dir, '/')) == NULL || slash == dir)
+			break;
+		*slash = 0;
+	}
+	return 0;
+}
+
+static FILE *link_profile_open(const char *mode)
+{
+	char path[PATH_MAX];
+	const char *home = getenv("HOME");
+
+	if (home == NULL)
+		return NULL;
+	snprintf(path, sizeof(path), "%s/%s", home, LINK_PROFILE_FILE);
+	return fopen(path, mode);
+}
+
+static int link_profile_read_all(link_profile_t *all, int max)
+{
+	char line[256];
+	FILE *f;
+	int n = 0;
+
+	if ((f = link_profile_open("r")) == NULL)
+		return 0;
+	while (n < max && fgets(line, sizeof(line), f) != NULL)
+	{
+		link_profile_t *p = &all[n];
+
+		if (line[0] == '#')
+			continue;
+		if (sscanf(line, "%127s %u %u %u", p->adapter, &p->baud, &p->rtt_us, &p->errors) == 4)
+			n++;
+	}
+	fclose(f);
+	return n;
+}
+
+/* look up prof->adapter, 0 if a profile was found */
+int link_profile_load(link_profile_t *prof)
+{
+	link_profile_t all[LINK_PROFILE_MAX];
+	int i, n;
+
+	pthread_mutex_lock(&profile_lock);
+	n = link_profile_read_all(all, LINK_PROFILE_MAX);
+	pthread_mutex_unlock(&profile_lock);
+	for (i = 0; i < n; i++)
+		if (!strcmp(all[i].adapter, prof->adapter))
+		{
+			*prof = all[i];
+			return 0;
+		}
+	return -1;
+}
+
+int link_profile_save(const link_profile_t *prof)
+{
+	link_profile_t all[LINK_PROFILE_MAX];
+	FILE *f;
+	int i, n;
+
+	pthread_mutex_lock(&profile_lock);
+	n = link_profile_read_all(all, LINK_PROFILE_MAX);
+	for (i = 0; i < n; i++)
+		if (!strcmp(all[i].adapter, prof->adapter))
+			break;
+	if (i == LINK_PROFILE_MAX)
+	{
+		/* full, forget the oldest entry */
+		memmove(&all[0], &all[1], (LINK_PROFILE_MAX - 1) * sizeof(link_profile_t));
+		i = LINK_PROFILE_MAX - 1;
+	}
+	all[i] = *prof;
+	if (i == n)
+		n++;
+
+	if ((f = link_profile_open("w")) == NULL)
+	{
+		pthread_mutex_unlock(&profile_lock);
+		log_msg(LOG_LVL_WARN, "link", "Cannot write %s", LINK_PROFILE_FILE);
+		return -1;
+	}
+	fprintf(f, "# adapter baud rtt_us errors\n");
+	for (i = 0; i < n; i++)
+		fprintf(f, "%s %u %u %u\n", all[i].adapter, all[i].baud, all[i].rtt_us, all[i].errors);
+	fclose(f);
+	pthread_mutex_unlock(&profile_lock);
+	return 0;
+}
+
+/* measure the round trip of cheap commands, 0 if the link is reliable */
+static int link_probe(session_t *s, link_profile_t *prof)
+{
+	stats_hist_t rtt = { 0 };
+	uint64_t t;
+	int i;
+
+	prof->errors = 0;
+	for (i = 0; i < LINK_PROBES; i++)
+	{
+		t = stats_now_us();
+		if (stm32_ping(s->stm) != STM32_OK)
+		{
+			if (++prof->errors > LINK_MAX_ERRORS)
+				return -1;
+			continue;
+		}
+		stats_hist_add(&rtt, stats_now_us() - t);
+	}
+	prof->rtt_us = stats_hist_percentile(&rtt, 50);
+	return 0;
+}
+
+/* *answered is cleared when the bootloader did not even handshake */
+static session_t *link_try(port_opt_t *opts, unsigned int init_flags,
+						   unsigned int baud, link_profile_t *prof, int *answered)
+{
+	port_opt_t o = *opts;
+	session_t *s;
+
+	*answered = 0;
+	o.baudrate = serial_get_baud(baud);
+	if (o.baudrate == SERIAL_BAUD_INVALID)
+		return NULL;
+
+	prof->baud = baud;
+	s = session_open(&o, init_flags);
+	if (s == NULL)
+	{
+		log_msg(LOG_LVL_INFO, "link", "Link %u baud%s: no handshake", baud,
+				(init_flags & STM32_INIT_RESET) ? "" : " without reset");
+		return NULL;
+	}
+	*answered = 1;
+	if (link_probe(s, prof) != 0)
+	{
+		log_msg(LOG_LVL_INFO, "link", "Link %u baud: %u probes failed", baud, prof->errors);
+		session_close(s);
+		return NULL;
+	}
+	log_msg(LOG_LVL_INFO, "link", "Link %u baud: rtt %u us, %u/%u probes failed",
+			baud, prof->rtt_us, prof->errors, LINK_PROBES);
+	return s;
+}
+
+/* no reply after a reset at the asked rate, the board may not be wired for it */
+static session_t *link_untuned(port_opt_t *opts, unsigned int init_flags, link_profile_t *prof)
+{
+	session_t *s;
+	int answered;
+
+	if ((s = link_try(opts, init_flags, serial_get_baud_int(opts->baudrate), prof, &answered)) != NULL)
+		log_msg(LOG_LVL_WARN, "link", "%s does not answer after a reset, staying at %u baud",
+				opts->device, prof->baud);
+	return s;
+}
+
+/*
+ * Connect at the fastest reliable baud rate: the stored profile of the
+ * adapter if it still works, otherwise the first good rate of the
+ * ladder, which is then stored. opts->baudrate is updated to the rate
+ * used. With retune set the stored profile is ignored.
+ */
+session_t* link_tune(port_opt_t *opts, unsigned int init_flags, int retune,
+					 link_profile_t *prof)
+{
+	session_t *s;
+	int i, answered;
+
+	memset(prof, 0, sizeof(link_profile_t));
+	link_adapter_id(opts->device, prof->adapter, sizeof(prof->adapter));
+
+	if (!retune && link_profile_load(prof) == 0)
+	{
+		if ((s = link_try(opts, init_flags | STM32_INIT_RESET, prof->baud, prof, &answered)) != NULL)
+			goto found;
+		log_msg(LOG_LVL_WARN, "link", "Profile of %s no longer works, tuning again", prof->adapter);
+	}
+
+	s = link_try(opts, init_flags | STM32_INIT_RESET, serial_get_baud_int(opts->baudrate), prof, &answered);
+	if (s == NULL && !answered && (s = link_untuned(opts, init_flags, prof)) != NULL)
+		goto found;
+	session_close(s);
+
+	for (i = 0; link_ladder[i]; i++)
+	{
+		if ((s = link_try(opts, init_flags | STM32_INIT_RESET, link_ladder[i], prof, &answered)) != NULL)
+		{
+			link_profile_save(prof);
+			goto found;
+		}
+	}
+
+	log_msg(LOG_LVL_ERROR, "link", "No reliable baud rate on %s", opts->device);
+	return NULL;
+
+found:
+	opts->baudrate = s->opts.baudrate;
+	s->init_flags = init_flags;
+	return s;
+}
@@ -0,0 +1,48 @@
+/******************************************************************************
+ * serial link auto-tuning
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _LINKTUNE_H
+#define _LINKTUNE_H
+
+#include "port.h"
+#include "session.h"
+
+#define LINK_PROFILE_FILE	".gstm32flash"	/* in $HOME */
+#define LINK_PROBES			32		/* GID round trips per baud rate */
+#define LINK_MAX_ERRORS		1		/* failed probes accepted per rate */
+
+/* the fastest reliable settings of one adapter */
+typedef struct link_profile
+{
+	char			adapter[128];	/* USB serial number or device path */
+	unsigned int	baud;
+	unsigned int	rtt_us;			/* median probe round trip */
+	unsigned int	errors;			/* failed probes at this rate */
+} link_profile_t;
+
+int			link_adapter_id(const char *device, char *buf, size_t size);
+int			link_profile_load(link_profile_t *prof);
+int			link_profile_save(const link_profile_t *prof);
+session_t*	link_tune(port_opt_t *opts, unsigned int init_flags, int retune,
+					  link_profile_t *prof);
+
+#endif
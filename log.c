@@ -0,0 +1,176 @@
+/******************************************************************************
+ * Log records
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "log.h"
+
+static pthread_mutex_t	log_lock = PTHREAD_MUTEX_INITIALIZER;
+static log_record_t		ring[LOG_RING_SIZE];
+static unsigned int		head, tail;
+static unsigned int		dropped;
+static int				capture;
+static FILE				*mirror;
+static log_level_t		log_max = LOG_LVL_INFO;
+
+/* records in the ring beyond which a level is dropped */
+static const unsigned int log_room[LOG_LEVELS] = {
+	LOG_RING_SIZE, LOG_RING_SIZE, LOG_RING_SIZE * 3 / 4, LOG_RING_SIZE / 2
+};
+
+static const char log_letter[LOG_LEVELS] = { 'E', 'W', 'I', 'D' };
+
+static void log_write_mirror(const log_record_t *rec)
+{
+	char stamp[32];
+	time_t sec = rec->ts_us / 1000000;
+	struct tm tm;
+
+	localtime_r(&sec, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(mirror, "%s.%03u %c %s%s%s\n", stamp, (unsigned int)(rec->ts_us / 1000 % 1000),
+			log_letter[rec->level], rec->source, rec->source[0] ? ": " : "", rec->text);
+}
+
+void log_msg(log_level_t level, const char *source, const char *fmt, ...)
+{
+	log_record_t rec;
+	struct timespec ts;
+	va_list ap;
+	size_t len;
+
+	/* the common case of a disabled debug line costs a compare */
+	if (level > log_max)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(rec.text, sizeof(rec.text), fmt, ap);
+	va_end(ap);
+	len = strlen(rec.text);
+	while (len && (rec.text[len - 1] == '\n' || rec.text[len - 1] == '\r'))
+		rec.text[--len] = 0;
+	snprintf(rec.source, sizeof(rec.source), "%s", source ? source : "");
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec.ts_us = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+	rec.level = level;
+
+	pthread_mutex_lock(&log_lock);
+	if (!capture)
+	{
+		fprintf(stderr, "%s\n", rec.text);
+		if (mirror)
+		{
+			log_write_mirror(&rec);
+			fflush(mirror);
+		}
+	}
+	else if (head - tail >= log_room[level])
+		dropped++;
+	else
+		ring[head++ & (LOG_RING_SIZE - 1)] = rec;
+	pthread_mutex_unlock(&log_lock);
+}
+
+/* lines above level are dropped before they are formatted */
+void log_set_level(log_level_t level)
+{
+	log_max = level;
+}
+
+int log_enabled(log_level_t level)
+{
+	return level <= log_max;
+}
+
+/* append every line to path, with time and level; NULL to stop */
+int log_mirror(const char *path)
+{
+	FILE *f = NULL;
+
+	if (path && (f = fopen(path, "a")) == NULL)
+	{
+		fprintf(stderr, "Cannot open log %s\n", path);
+		return -1;
+	}
+	pthread_mutex_lock(&log_lock);
+	if (mirror)
+		fclose(mirror);
+	mirror = f;
+	pthread_mutex_unlock(&log_lock);
+	return 0;
+}
+
+/* queue the lines for log_drain() instead of printing them */
+void log_capture(int on)
+{
+	pthread_mutex_lock(&log_lock);
+	capture = on;
+	pthread_mutex_unlock(&log_lock);
+}
+
+int log_pending(void)
+{
+	int n;
+
+	pthread_mutex_lock(&log_lock);
+	n = head != tail || dropped;
+	pthread_mutex_unlock(&log_lock);
+	return n;
+}
+
+/*
+ * Move as many queued lines as fit into buf, "source: text" each ended
+ * by eol, and mirror them. Returns the length, 0 once the ring is empty.
+ */
+size_t log_drain(char *buf, size_t size, const char *eol)
+{
+	log_record_t rec;
+	size_t n = 0;
+	int len;
+
+	pthread_mutex_lock(&log_lock);
+	if (dropped)
+	{
+		n = snprintf(buf, size, "(%u log lines dropped)%s", dropped, eol);
+		dropped = 0;
+	}
+	while (head != tail)
+	{
+		rec = ring[tail & (LOG_RING_SIZE - 1)];
+		len = snprintf(buf + n, size - n, "%s%s%s%s", rec.source, rec.source[0] ? ": " : "", rec.text, eol);
+		if (n + len >= size)
+		{
+			buf[n] = 0;
+			break;
+		}
+		n += len;
+		tail++;
+		if (mirror)
+			log_write_mirror(&rec);
+	}
+	if (mirror)
+		fflush(mirror);		/* one write for the whole batch */
+	pthread_mutex_unlock(&log_lock);
+	return n;
+}
@@ -0,0 +1,66 @@
+/******************************************************************************
+ * Log records header file
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOG_RING_SIZE		1024	/* records held for log_drain(), power of two */
+#define LOG_TEXT_MAX		200
+#define LOG_SOURCE_MAX		32
+#define LOG_FILE_ENV		"GSTM32FLASH_LOG"	/* mirror every line to this file */
+
+typedef enum
+{
+	LOG_LVL_ERROR = 0,
+	LOG_LVL_WARN,
+	LOG_LVL_INFO,
+	LOG_LVL_DEBUG,		/* protocol details, off by default */
+	LOG_LEVELS
+} log_level_t;
+
+typedef struct log_record
+{
+	uint64_t	ts_us;		/* wall clock */
+	uint8_t		level;
+	char		source[LOG_SOURCE_MAX];		/* module or device, may be empty */
+	char		text[LOG_TEXT_MAX];			/* one line, no line end */
+} log_record_t;
+
+/*
+ * By default a line goes to stderr when it is logged. Once captured, it
+ * is queued in a ring of LOG_RING_SIZE records for the GUI to fetch with
+ * log_drain(), many lines at a time. A full ring drops the low severity
+ * lines first: debug above half full, info above three quarters.
+ */
+void	log_msg(log_level_t level, const char *source, const char *fmt, ...)
+		__attribute__ ((format(printf, 3, 4)));
+void	log_set_level(log_level_t level);
+int		log_enabled(log_level_t level);
+int		log_mirror(const char *path);
+void	log_capture(int on);
+int		log_pending(void);
+size_t	log_drain(char *buf, size_t size, const char *eol);
+
+#endif
@@ -29,7 +29,11 @@
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <assert.h>
+#ifdef __linux__
+#include <linux/serial.h>
+#endif
 #include "port.h"
+#include "log.h"
 
 static serial_t *serial_open(const char *device)
 {
@@ -42,6 +46,7 @@ static serial_t *serial_open(const char *device)
 		return NULL;
 	}
 	fcntl(h->fd, F_SETFL, 0);
+	h->latency_timer = -1;
 
 	tcgetattr(h->fd, &h->oldtio);
 	tcgetattr(h->fd, &h->newtio);
@@ -49,13 +54,80 @@ static serial_t *serial_open(const char *device)
 	return h;
 }
 
-static void serial_flush(const serial_t *h)
+static void serial_flush(serial_t *h)
 {
 	tcflush(h->fd, TCIFLUSH);
+	h->rx_off = h->rx_len = 0;
+}
+
+/*
+ * USB adapters hold received bytes until their latency timer expires,
+ * 16 ms by default on FTDI parts, which is longer than the ACK itself
+ * at any usual baud rate. Ask the driver for low latency, which most
+ * USB serial drivers map to a short timer, and lower the timer of the
+ * adapter in sysfs when it is writable.
+ */
+static void serial_low_latency(serial_t *h, const char *device)
+{
+#ifdef __linux__
+	struct serial_struct ss;
+	const char *name = strrchr(device, '/') + 1;
+	char buf[16];
+	FILE *f;
+
+	if (ioctl(h->fd, TIOCGSERIAL, &ss) == 0 && !(ss.flags & ASYNC_LOW_LATENCY))
+	{
+		ss.flags |= ASYNC_LOW_LATENCY;
+		h->async_low_latency = ioctl(h->fd, TIOCSSERIAL, &ss) == 0;
+	}
+
+	snprintf(h->latency_path, sizeof(h->latency_path), "/sys/class/tty/%s/device/latency_timer", name);
+	if ((f = fopen(h->latency_path, "r")) == NULL)
+		return;		/* not a USB adapter with a timer */
+	if (fgets(buf, sizeof(buf), f) != NULL)
+		h->latency_timer = atoi(buf);
+	fclose(f);
+	if (h->latency_timer <= SERIAL_LATENCY_TIMER_MS)
+	{
+		h->latency_timer = -1;		/* already fine, nothing to undo */
+		return;
+	}
+	if ((f = fopen(h->latency_path, "w")) == NULL
+	    || fprintf(f, "%d\n", SERIAL_LATENCY_TIMER_MS) < 0 || fclose(f) != 0)
+	{
+		log_msg(LOG_LVL_WARN, "port", "Can't lower the latency timer of %s from %d ms",
+				name, h->latency_timer);
+		h->latency_timer = -1;
+		return;
+	}
+	log_msg(LOG_LVL_DEBUG, "port", "Latency timer of %s: %d -> %d ms",
+			name, h->latency_timer, SERIAL_LATENCY_TIMER_MS);
+#endif /* __linux__ */
+}
+
+/* the adapter is shared with other programs, leave it as it was */
+static void serial_restore_latency(serial_t *h)
+{
+#ifdef __linux__
+	struct serial_struct ss;
+	FILE *f;
+
+	if (h->async_low_latency && ioctl(h->fd, TIOCGSERIAL, &ss) == 0)
+	{
+		ss.flags &= ~ASYNC_LOW_LATENCY;
+		ioctl(h->fd, TIOCSSERIAL, &ss);
+	}
+	if (h->latency_timer >= 0 && (f = fopen(h->latency_path, "w")) != NULL)
+	{
+		fprintf(f, "%d\n", h->latency_timer);
+		fclose(f);
+	}
+#endif /* __linux__ */
 }
 
 static void serial_close(serial_t *h)
 {
+	serial_restore_latency(h);
 	serial_flush(h);
 	tcsetattr(h->fd, TCSANOW, &h->oldtio);
 	close(h->fd);
@@ -72,6 +144,8 @@ static port_t serial_setup(serial_t *h, const serial_baud_t baud,
 	tcflag_t port_parity;
 	tcflag_t port_stop;
 	struct termios settings;
+	int any_rate = 0;		/* no B constant, set through serial_set_baud_any() */
+	unsigned int want;
 
 	switch (baud) 
 	{
@@ -108,8 +182,12 @@ static port_t serial_setup(serial_t *h, const serial_baud_t baud,
 #endif /* B2000000 */
 
 		case SERIAL_BAUD_INVALID:
-		default:
 			return PORT_ERR_UNKNOWN;
+		default:
+			/* 128000, 256000 and custom rates; the placeholder is replaced below */
+			port_baud = B38400;
+			any_rate = 1;
+			break;
 	}
 
 	switch (bits) 
@@ -183,14 +261,33 @@ static port_t serial_setup(serial_t *h, const serial_baud_t baud,
 
 	/* confirm they were set */
 	tcgetattr(h->fd, &settings);
+	if (h->pty)
+	{
+		/* the pty driver forces CS8 without parity */
+		settings.c_cflag &= ~(CSIZE | PARENB | PARODD);
+		settings.c_cflag |= h->newtio.c_cflag & (CSIZE | PARENB | PARODD);
+	}
 	if (settings.c_iflag != h->newtio.c_iflag ||
 	    settings.c_oflag != h->newtio.c_oflag ||
 	    settings.c_cflag != h->newtio.c_cflag ||
 	    settings.c_lflag != h->newtio.c_lflag)
 		return PORT_ERR_UNKNOWN;
 
+	want = h->baud = serial_get_baud_int(baud);
+	if (any_rate)
+	{
+		if (serial_set_baud_any(h->fd, want, &h->baud) != 0)
+			return PORT_ERR_UNKNOWN;
+		/* the divisor of the adapter may not hit the rate */
+		if ((h->baud > want ? h->baud - want : want - h->baud) * 100 > want * SERIAL_BAUD_TOLERANCE)
+		{
+			log_msg(LOG_LVL_WARN, "port", "%u baud asked, the port runs at %u", want, h->baud);
+			return PORT_ERR_UNKNOWN;
+		}
+	}
+
 	snprintf(h->setup_str, sizeof(h->setup_str), "%u %d%c%d",
-		 serial_get_baud_int(baud),
+		 h->baud,
 		 serial_get_bits_int(bits),
 		 serial_get_parity_str(parity),
 		 serial_get_stopbit_int(stopbit));
@@ -201,8 +298,9 @@ static port_t serial_posix_open(port_interface_t *port, port_opt_t *opt)
 {
 	serial_t *h;
 
-	/* 1. check device name match */
-	if (strncmp(opt->device, "/dev/tty", strlen("/dev/tty")))
+	/* 1. check device name match, pseudo-terminals are accepted too */
+	if (strncmp(opt->device, "/dev/tty", strlen("/dev/tty"))
+	    && strncmp(opt->device, "/dev/pts/", strlen("/dev/pts/")))
 		return PORT_ERR_NODEV;
 
 	/* 2. check options */
@@ -219,6 +317,7 @@ static port_t serial_posix_open(port_interface_t *port, port_opt_t *opt)
 	h = serial_open(opt->device);
 	if (h == NULL)
 		return PORT_ERR_UNKNOWN;
+	h->pty = !strncmp(opt->device, "/dev/pts/", strlen("/dev/pts/"));
 
 	/* 4. set options */
 	if (serial_setup (h, opt->baudrate,
@@ -231,6 +330,13 @@ static port_t serial_posix_open(port_interface_t *port, port_opt_t *opt)
 		return PORT_ERR_UNKNOWN;
 	}
 
+	/* 5. short round trips on USB adapters, a pty has no latency */
+	if (opt->low_latency && !h->pty)
+	{
+		serial_low_latency(h, opt->device);
+		strncat(h->setup_str, " low latency", sizeof(h->setup_str) - strlen(h->setup_str) - 1);
+	}
+
 	port->private = h;
 	return PORT_OK;
 }
@@ -256,14 +362,39 @@ static port_t serial_posix_read(port_interface_t *port, void *buf, size_t nbyte)
 	if (h == NULL)
 		return PORT_ERR_UNKNOWN;
 
+	/*
+	 * Whatever the tty has goes into h->rx in one syscall, the ACKs and
+	 * small replies that follow are served from there. Each read() still
+	 * waits at most VTIME for the next bytes, as without the buffer.
+	 */
 	while (nbyte) 
 	{
-		r = read(h->fd, pos, nbyte);
-		if (r == 0)
-			return PORT_ERR_TIMEDOUT;
-		if (r < 0)
-			return PORT_ERR_UNKNOWN;
+		if (h->rx_off == h->rx_len)
+		{
+			if (nbyte >= sizeof(h->rx))
+			{
+				/* large replies go straight to the caller */
+				r = read(h->fd, pos, nbyte);
+				if (r == 0)
+					return PORT_ERR_TIMEDOUT;
+				if (r < 0)
+					return PORT_ERR_UNKNOWN;
+				nbyte -= r;
+				pos += r;
+				continue;
+			}
+			r = read(h->fd, h->rx, sizeof(h->rx));
+			if (r == 0)
+				return PORT_ERR_TIMEDOUT;
+			if (r < 0)
+				return PORT_ERR_UNKNOWN;
+			h->rx_off = 0;
+			h->rx_len = r;
+		}
 
+		r = h->rx_len - h->rx_off < nbyte ? h->rx_len - h->rx_off : nbyte;
+		memcpy(pos, h->rx + h->rx_off, r);
+		h->rx_off += r;
 		nbyte -= r;
 		pos += r;
 	}
@@ -292,6 +423,41 @@ static port_t serial_posix_write(port_interface_t *port, void *buf, size_t nbyte
 	return PORT_OK;
 }
 
+/* one writev(2) for a whole frame, a partial write goes on where it stopped */
+static port_t serial_posix_writev(port_interface_t *port, const struct iovec *iov, int iovcnt)
+{
+	struct iovec v[PORT_IOV_MAX];
+	serial_t *h;
+	ssize_t r;
+	int i = 0;
+
+	h = (serial_t *)port->private;
+	if (h == NULL || iovcnt > PORT_IOV_MAX)
+		return PORT_ERR_UNKNOWN;
+	memcpy(v, iov, iovcnt * sizeof(*iov));
+
+	while (i < iovcnt)
+	{
+		if (v[i].iov_len == 0)
+		{
+			i++;
+			continue;
+		}
+		r = writev(h->fd, v + i, iovcnt - i);
+		if (r < 1)
+			return PORT_ERR_UNKNOWN;
+
+		while (r && (size_t)r >= v[i].iov_len)
+			r -= v[i++].iov_len;
+		if (r)
+		{
+			v[i].iov_base = (uint8_t *)v[i].iov_base + r;
+			v[i].iov_len -= r;
+		}
+	}
+	return PORT_OK;
+}
+
 static port_t serial_posix_gpio(port_interface_t *port, serial_gpio_t n, int level)
 {
 	serial_t *h;
@@ -340,6 +506,17 @@ static const char *posix_serial_get_cfg_str(port_interface_t *port)
 	return h ? h->setup_str : "INVALID";
 }
 
+/* none while bytes read ahead wait in rx, the fd would not show them */
+static int posix_serial_get_fd(port_interface_t *port)
+{
+	serial_t *h;
+
+	h = (serial_t *)port->private;
+	if (h == NULL || h->rx_off != h->rx_len)
+		return -1;
+	return h->fd;
+}
+
 struct port_interface port_serial = {
 	.name	= "POSIX Serial",
 	.flags	= PORT_BYTE | PORT_GVR_ETX | PORT_CMD_INIT | PORT_RETRY,
@@ -347,29 +524,48 @@ struct port_interface port_serial = {
 	.close	= serial_posix_close,
 	.read	= serial_posix_read,
 	.write	= serial_posix_write,
+	.writev	= serial_posix_writev,
 	.gpio	= serial_posix_gpio,
 	.get_cfg_str	= posix_serial_get_cfg_str,
+	.get_fd	= posix_serial_get_fd,
 };
 extern port_interface_t port_i2c;
+extern port_interface_t port_replay;
+extern port_interface_t port_sim;
+extern port_interface_t port_net;
 
 static port_interface_t *ports[] = {
 	&port_serial,
+	&port_replay,
+	&port_sim,
+	&port_net,
 //	&port_i2c,
 	NULL,
 };
 
+/*
+ * Each open port gets its own copy of the interface, so that several
+ * ports (of the same backend) can be open at the same time.
+ * Release it with port_close().
+ */
 port_t port_open(port_opt_t *ops, port_interface_t **outport)
 {
 	int ret;
-	port_interface_t **port;
+	port_interface_t **port, *p = NULL;
 
 	for (port = ports; *port; port++) 
 	{
-		ret = (*port)->open(*port, ops);
-		if (ret == PORT_ERR_NODEV)
-			continue;
+		p = malloc(sizeof(port_interface_t));
+		assert(p != NULL);
+		*p = **port;
+		p->private = NULL;
+
+		ret = p->open(p, ops);
 		if (ret == PORT_OK)
 			break;
+		free(p);
+		if (ret == PORT_ERR_NODEV)
+			continue;
 		fprintf(stderr, "Failed tp probe interface \"%s\"\n", (*port)->name);
 	}
 
@@ -379,10 +575,80 @@ port_t port_open(port_opt_t *ops, port_interface_t **outport)
 		return PORT_ERR_UNKNOWN;
 	}
 
-	*outport = *port;
+	/* faults first, so that a recording shows what the host saw */
+	if (ops->fault)
+	{
+		port_interface_t *fault = port_fault_wrap(p, ops->fault);
+
+		if (fault == NULL)
+		{
+			port_close(p);
+			return PORT_ERR_UNKNOWN;
+		}
+		p = fault;
+	}
+	if (ops->record)
+	{
+		port_interface_t *rec = port_record_wrap(p, ops->record);
+
+		if (rec == NULL)
+		{
+			port_close(p);
+			return PORT_ERR_UNKNOWN;
+		}
+		p = rec;
+	}
+	*outport = p;
 	return PORT_OK;
 }
 
+void port_close(port_interface_t *port)
+{
+	port->close(port);
+	free(port);
+}
+
+/*
+ * Write a frame from several buffers. Backends without writev get it
+ * gathered into one write(), so that a frame stays one write for frame
+ * oriented ports and for the wrappers that log or mangle writes.
+ */
+port_t port_writev(port_interface_t *port, const struct iovec *iov, int iovcnt)
+{
+	uint8_t tmp[PORT_WRITEV_GATHER], *buf, *pos;
+	size_t nbyte = 0;
+	port_t port_err;
+	int i;
+
+	if (port->writev)
+		return port->writev(port, iov, iovcnt);
+
+	for (i = 0; i < iovcnt; i++)
+		nbyte += iov[i].iov_len;
+	buf = nbyte > sizeof(tmp) ? malloc(nbyte) : tmp;
+	assert(buf != NULL);
+	for (i = 0, pos = buf; i < iovcnt; i++)
+	{
+		memcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		pos += iov[i].iov_len;
+	}
+
+	port_err = port->write(port, buf, nbyte);
+	if (buf != tmp)
+		free(buf);
+	return port_err;
+}
+
+/*
+ * The descriptor behind a port, for callers doing their own I/O
+ * multiplexing; -1 if the backend has none, is wrapped by a shim or
+ * still holds bytes it read ahead.
+ */
+int port_fd(port_interface_t *port)
+{
+	return port->get_fd ? port->get_fd(port) : -1;
+}
+
 serial_baud_t serial_get_baud (const unsigned int baud) 
 {
 	switch(baud) 
@@ -407,7 +673,11 @@ serial_baud_t serial_get_baud (const unsigned int baud)
 		case 1500000: return SERIAL_BAUD_1500000;
 		case 2000000: return SERIAL_BAUD_2000000;
 		
-		default:return SERIAL_BAUD_INVALID;
+		default:
+			if (baud < SERIAL_BAUD_CUSTOM_MIN || baud > SERIAL_BAUD_CUSTOM_MAX)
+				return SERIAL_BAUD_INVALID;
+			/* serial_setup() finds out whether the port can do it */
+			return (serial_baud_t)(SERIAL_BAUD_CUSTOM + baud);
 	}
 }
 
@@ -435,8 +705,9 @@ unsigned int serial_get_baud_int (const serial_baud_t baud)
 		case SERIAL_BAUD_1500000: return 1500000;
 		case SERIAL_BAUD_2000000: return 2000000;
 		case SERIAL_BAUD_INVALID:
-		default:
 				return 0;
+		default:
+				return baud > SERIAL_BAUD_CUSTOM ? baud - SERIAL_BAUD_CUSTOM : 0;
 	}
 }
 
@@ -26,13 +26,30 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <termios.h>
+#include <sys/uio.h>
+
+#define SERIAL_LATENCY_TIMER_MS	1	/* USB adapter latency timer of the low latency profile */
+#define SERIAL_RX_AHEAD			1024	/* bytes read ahead of the caller */
+#define PORT_IOV_MAX			8		/* segments of one port_writev() */
+#define PORT_WRITEV_GATHER		512		/* gathered on the stack when emulated */
 
 typedef struct serial 
 {
 	int				fd;
 	struct termios	oldtio;
 	struct termios	newtio;
-	char			setup_str[11];
+	char			setup_str[32];
+	int				pty;		/* pseudo-terminal, has no parity or size */
+	unsigned int	baud;		/* as read back from the driver */
+
+	/* read-ahead: rx[rx_off..rx_len) came in but was not asked for yet */
+	uint8_t			rx[SERIAL_RX_AHEAD];
+	unsigned int	rx_off, rx_len;
+
+	/* low latency profile, undone on close */
+	int				async_low_latency;		/* ASYNC_LOW_LATENCY was set by us */
+	int				latency_timer;			/* ms before, -1 if untouched */
+	char			latency_path[96];		/* sysfs latency_timer of the adapter */
 } serial_t;
 
 typedef enum 
@@ -76,9 +93,14 @@ typedef enum
 	SERIAL_BAUD_1500000,
 	SERIAL_BAUD_2000000,
 
-	SERIAL_BAUD_INVALID
+	SERIAL_BAUD_INVALID,
+	SERIAL_BAUD_CUSTOM			/* plus the rate, any other one, see serial_get_baud() */
 } serial_baud_t;
 
+#define SERIAL_BAUD_CUSTOM_MIN	300
+#define SERIAL_BAUD_CUSTOM_MAX	16000000
+#define SERIAL_BAUD_TOLERANCE	2		/* percent off the asked rate a UART still syncs */
+
 typedef enum 
 {
 	SERIAL_STOPBIT_1,
@@ -97,6 +119,7 @@ typedef enum
 /* common functions */
 serial_baud_t		serial_get_baud(const unsigned int baud);
 unsigned int		serial_get_baud_int(const serial_baud_t baud);
+int					serial_set_baud_any(int fd, unsigned int baud, unsigned int *actual);
 serial_bits_t		serial_get_bits(const char *mode);
 unsigned int		serial_get_bits_int(const serial_bits_t bits);
 serial_parity_t		serial_get_parity(const char *mode);
@@ -129,6 +152,9 @@ typedef struct port_options
 	int				bus_addr;
 	int				rx_frame_max;
 	int				tx_frame_max;
+	const char		*record;		/* capture all port traffic to this file */
+	const char		*fault;			/* fault injection spec, see port_fault.c */
+	int				low_latency;	/* tune USB adapters for short round trips */
 }port_opt_t;
 
 /*
@@ -152,12 +178,19 @@ typedef struct port_interface
 	void		(*close)(struct port_interface *port);
 	port_t		(*read)(struct port_interface *port, void *buf, size_t nbyte);
 	port_t		(*write)(struct port_interface *port, void *buf, size_t nbyte);
+	port_t		(*writev)(struct port_interface *port, const struct iovec *iov, int iovcnt);	/* NULL: see port_writev() */
 	port_t		(*gpio)(struct port_interface *port, serial_gpio_t n, int level);
 	const char*	(*get_cfg_str)(struct port_interface *port);
+	int			(*get_fd)(struct port_interface *port);	/* NULL: no file descriptor */
 	varlen_cmd_t* cmd_get_reply;
 	void		*private;
 }port_interface_t;
 
 port_t port_open(port_opt_t *ops, port_interface_t **outport);
+void port_close(port_interface_t *port);
+int port_fd(port_interface_t *port);
+port_t port_writev(port_interface_t *port, const struct iovec *iov, int iovcnt);
+port_interface_t *port_record_wrap(port_interface_t *inner, const char *filename);
+port_interface_t *port_fault_wrap(port_interface_t *inner, const char *spec);
 
 #endif
@@ -0,0 +1,57 @@
+/******************************************************************************
+ * any baud rate on Linux, through termios2 and BOTHER
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+/*
+ * <asm/termbits.h> clashes with <termios.h>, which port.h includes,
+ * hence a file of its own that does not see port.h. Elsewhere only the
+ * rates with a B constant are available.
+ */
+#ifdef __linux__
+#include <asm/termbits.h>
+#endif
+#include <sys/ioctl.h>
+
+int serial_set_baud_any(int fd, unsigned int baud, unsigned int *actual);
+
+/* set the rate of fd to baud bit/s, *actual is what the driver made of it; -1 on failure */
+int serial_set_baud_any(int fd, unsigned int baud, unsigned int *actual)
+{
+#if defined(__linux__) && defined(BOTHER)
+	struct termios2 tio;
+
+	if (ioctl(fd, TCGETS2, &tio) != 0)
+		return -1;
+	tio.c_cflag &= ~(CBAUD | CIBAUD);	/* the input follows the output rate */
+	tio.c_cflag |= BOTHER;
+	tio.c_ispeed = baud;
+	tio.c_ospeed = baud;
+	if (ioctl(fd, TCSETS2, &tio) != 0 || ioctl(fd, TCGETS2, &tio) != 0)
+		return -1;
+	*actual = tio.c_ospeed;
+	return 0;
+#else
+	(void)fd;
+	(void)baud;
+	(void)actual;
+	return -1;
+#endif
+}
@@ -0,0 +1,330 @@
+/******************************************************************************
+ * fault injection port shim
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include "port.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * Decorator that injects faults into any port, driven by a seeded PRNG
+ * so that a run can be reproduced exactly. The spec is a comma separated
+ * list, probabilities are per byte (drop, corrupt) or per call:
+ *
+ *	seed=<n>			PRNG seed (default 1)
+ *	drop=<p>			lose a byte, on read or write
+ *	corrupt=<p>			flip one bit of a byte, on read or write
+ *	delay=<p>:<us>		delay a read
+ *	nack=<p>			a read returns NACK instead of the real byte
+ *	busy=<p>			a read returns BUSY before the real byte
+ *	stall=<p>:<us>		the link goes silent, reads time out
+ *
+ * A fault counts as recovered at the next ACK the host receives; time
+ * and bytes moved until then are reported when the port is closed.
+ */
+#define FAULT_ACK		0x79
+#define FAULT_NACK		0x1F
+#define FAULT_BUSY		0x76
+
+enum
+{
+	FAULT_DROP,
+	FAULT_CORRUPT,
+	FAULT_DELAY,
+	FAULT_NACK_INJ,
+	FAULT_BUSY_INJ,
+	FAULT_STALL,
+	FAULT_TYPES
+};
+
+static const char *fault_names[FAULT_TYPES] = {
+	"drop", "corrupt", "delay", "nack", "busy", "stall"
+};
+
+typedef struct fault
+{
+	port_interface_t	*inner;
+	uint64_t			rng;
+	double				p[FAULT_TYPES];
+	unsigned int		delay_us, stall_us;
+
+	uint64_t			stall_until;
+	uint32_t			count[FAULT_TYPES];
+
+	/* open recovery window */
+	int					pending;
+	uint64_t			t_fault;
+	uint64_t			bytes_fault;
+	uint64_t			bytes;		/* bytes moved in both directions */
+	stats_hist_t		recovery_us;
+	uint64_t			wasted_bytes;
+} fault_t;
+
+/* xorshift64* */
+static uint64_t fault_rand(fault_t *f)
+{
+	f->rng ^= f->rng >> 12;
+	f->rng ^= f->rng << 25;
+	f->rng ^= f->rng >> 27;
+	return f->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static int fault_hit(fault_t *f, int type)
+{
+	if (f->p[type] <= 0)
+		return 0;
+	if ((fault_rand(f) >> 11) * (1.0 / 9007199254740992.0) >= f->p[type])
+		return 0;
+
+	f->count[type]++;
+	if (!f->pending)
+	{
+		f->pending = 1;
+		f->t_fault = stats_now_us();
+		f->bytes_fault = f->bytes;
+	}
+	return 1;
+}
+
+static void fault_seen_ack(fault_t *f)
+{
+	if (!f->pending)
+		return;
+	f->pending = 0;
+	stats_hist_add(&f->recovery_us, stats_now_us() - f->t_fault);
+	f->wasted_bytes += f->bytes - f->bytes_fault;
+}
+
+static int fault_parse(fault_t *f, const char *spec)
+{
+	const char *p = spec;
+	char *end;
+	int i;
+
+	f->rng = 1;
+	while (p && *p)
+	{
+		if (*p == ',')
+		{
+			p++;
+			continue;
+		}
+		if (!strncmp(p, "seed=", 5))
+		{
+			f->rng = strtoull(p + 5, &end, 0);
+			if (f->rng == 0)
+				f->rng = 1;
+			p = end;
+			continue;
+		}
+		for (i = 0; i < FAULT_TYPES; i++)
+			if (!strncmp(p, fault_names[i], strlen(fault_names[i]))
+			    && p[strlen(fault_names[i])] == '=')
+				break;
+		if (i == FAULT_TYPES)
+			return -1;
+
+		f->p[i] = strtod(p + strlen(fault_names[i]) + 1, &end);
+		if (*end == ':')
+		{
+			unsigned long us = strtoul(end + 1, &end, 0);
+
+			if (i == FAULT_DELAY)
+				f->delay_us = us;
+			else if (i == FAULT_STALL)
+				f->stall_us = us;
+		}
+		p = end;
+	}
+	if (f->delay_us == 0)
+		f->delay_us = 20000;
+	if (f->stall_us == 0)
+		f->stall_us = 1000000;
+	return 0;
+}
+
+static port_t fault_open(port_interface_t *port, port_opt_t *ops)
+{
+	/* the inner port is already open */
+	return PORT_OK;
+}
+
+static void fault_close(port_interface_t *port)
+{
+	fault_t *f = (fault_t *)port->private;
+	char line[LOG_TEXT_MAX];
+	int i, n;
+
+	n = snprintf(line, sizeof(line), "Injected faults:");
+	for (i = 0; i < FAULT_TYPES && n < (int)sizeof(line); i++)
+		n += snprintf(line + n, sizeof(line) - n, " %s %u", fault_names[i], f->count[i]);
+	log_msg(LOG_LVL_INFO, "fault", "%s", line);
+	if (f->recovery_us.count)
+		log_msg(LOG_LVL_INFO, "fault", "Recovery: %u faults, mean %llu us, p90 %llu us, max %u us, "
+				"%.1f bytes wasted per fault",
+				f->recovery_us.count,
+				(unsigned long long)(f->recovery_us.total_us / f->recovery_us.count),
+				(unsigned long long)stats_hist_percentile(&f->recovery_us, 90),
+				f->recovery_us.max_us,
+				(double)f->wasted_bytes / f->recovery_us.count);
+	if (f->pending)
+		log_msg(LOG_LVL_WARN, "fault", "Recovery: last fault not recovered");
+
+	port_close(f->inner);
+	free(f);
+	port->private = NULL;
+}
+
+static port_t fault_read(port_interface_t *port, void *buf, size_t nbyte)
+{
+	fault_t *f = (fault_t *)port->private;
+	uint8_t *pos = (uint8_t *)buf;
+	port_t port_err;
+	size_t i;
+
+	if (f->stall_until)
+	{
+		if (stats_now_us() < f->stall_until)
+		{
+			usleep(500000);
+			return PORT_ERR_TIMEDOUT;
+		}
+		f->stall_until = 0;
+	}
+	if (fault_hit(f, FAULT_STALL))
+	{
+		f->stall_until = stats_now_us() + f->stall_us;
+		usleep(500000);
+		return PORT_ERR_TIMEDOUT;
+	}
+	if (fault_hit(f, FAULT_DELAY))
+		usleep(f->delay_us);
+
+	/* spurious status bytes, the real data is left in the port */
+	if (nbyte == 1 && fault_hit(f, FAULT_NACK_INJ))
+	{
+		*pos = FAULT_NACK;
+		return PORT_OK;
+	}
+	if (nbyte == 1 && fault_hit(f, FAULT_BUSY_INJ))
+	{
+		*pos = FAULT_BUSY;
+		return PORT_OK;
+	}
+
+	for (i = 0; i < nbyte; )
+	{
+		port_err = f->inner->read(f->inner, pos + i, 1);
+		if (port_err != PORT_OK)
+			return port_err;
+		f->bytes++;
+		if (fault_hit(f, FAULT_DROP))
+			continue;
+		if (fault_hit(f, FAULT_CORRUPT))
+			pos[i] ^= 1 << (fault_rand(f) & 7);
+		i++;
+	}
+
+	if (nbyte == 1 && *pos == FAULT_ACK)
+		fault_seen_ack(f);
+	return PORT_OK;
+}
+
+static port_t fault_write(port_interface_t *port, void *buf, size_t nbyte)
+{
+	fault_t *f = (fault_t *)port->private;
+	uint8_t tmp[512], *out;
+	size_t i, n = 0;
+	port_t port_err;
+
+	out = nbyte > sizeof(tmp) ? malloc(nbyte) : tmp;
+	assert(out != NULL);
+
+	for (i = 0; i < nbyte; i++)
+	{
+		if (fault_hit(f, FAULT_DROP))
+			continue;
+		out[n] = ((uint8_t *)buf)[i];
+		if (fault_hit(f, FAULT_CORRUPT))
+			out[n] ^= 1 << (fault_rand(f) & 7);
+		n++;
+	}
+
+	f->bytes += n;
+	port_err = n ? f->inner->write(f->inner, out, n) : PORT_OK;
+	if (out != tmp)
+		free(out);
+	return port_err;
+}
+
+static port_t fault_gpio(port_interface_t *port, serial_gpio_t n, int level)
+{
+	fault_t *f = (fault_t *)port->private;
+
+	return f->inner->gpio(f->inner, n, level);
+}
+
+static const char *fault_get_cfg_str(port_interface_t *port)
+{
+	fault_t *f = (fault_t *)port->private;
+
+	return f->inner->get_cfg_str(f->inner);
+}
+
+/*
+ * Wrap an open port with the faults described by spec.
+ * port_close() on the returned port closes the inner one.
+ * Returns NULL (and leaves inner untouched) on an invalid spec.
+ */
+port_interface_t *port_fault_wrap(port_interface_t *inner, const char *spec)
+{
+	port_interface_t *port;
+	fault_t *f;
+
+	f = calloc(1, sizeof(fault_t));
+	assert(f != NULL);
+	if (fault_parse(f, spec) != 0)
+	{
+		log_msg(LOG_LVL_ERROR, "fault", "Invalid fault spec \"%s\"", spec);
+		free(f);
+		return NULL;
+	}
+	f->inner = inner;
+
+	port = calloc(1, sizeof(port_interface_t));
+	assert(port != NULL);
+	port->name			= "Fault injection";
+	port->flags			= inner->flags;
+	port->open			= fault_open;
+	port->close			= fault_close;
+	port->read			= fault_read;
+	port->write			= fault_write;
+	port->gpio			= fault_gpio;
+	port->get_cfg_str	= fault_get_cfg_str;
+	port->cmd_get_reply	= inner->cmd_get_reply;
+	port->private		= f;
+	return port;
+}
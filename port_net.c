@@ -0,0 +1,624 @@
+/******************************************************************************
+ * TCP and RFC2217 remote serial ports
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <assert.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "port.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * Serial ports behind a serial-to-Ethernet server:
+ *	"tcp://host:port"	raw TCP, the server owns the line settings
+ *	"rfc2217://host:port"	Telnet COM-PORT-OPTION, settings and the
+ *				DTR/RTS/break lines are set from here
+ * A port read waits at most NET_READ_TIMEOUT for the next bytes, like
+ * VTIME = 5 on a tty. Writes are held until the next read, gpio or
+ * close, so that a command and its payload leave in one TCP segment
+ * rather than one per port->write(), and Nagle is off so that segment
+ * leaves at once.
+ */
+#define NET_READ_TIMEOUT	500		/* ms, same as VTIME = 5 on a tty */
+#define NET_CONNECT_TIMEOUT	3000	/* ms */
+#define NET_BREAK_MS		250		/* as tcsendbreak(fd, 0) */
+#define NET_BUF				2048
+
+/* Telnet, RFC 854 */
+#define TN_SE		240
+#define TN_SB		250
+#define TN_WILL		251
+#define TN_WONT		252
+#define TN_DO		253
+#define TN_DONT		254
+#define TN_IAC		255
+
+#define TN_BINARY	0
+#define TN_SGA		3
+#define TN_COM_PORT	44
+
+/* COM-PORT-OPTION commands, RFC 2217; the server answers with cmd + 100 */
+#define CPO_SET_BAUDRATE		1
+#define CPO_SET_DATASIZE		2
+#define CPO_SET_PARITY			3
+#define CPO_SET_STOPSIZE		4
+#define CPO_SET_CONTROL			5
+#define CPO_PURGE_DATA			12
+#define CPO_SERVER				100
+
+#define CPO_PARITY_NONE			1
+#define CPO_PARITY_ODD			2
+#define CPO_PARITY_EVEN			3
+#define CPO_CONTROL_NONE		1	/* no flow control */
+#define CPO_CONTROL_BREAK_ON	5
+#define CPO_CONTROL_BREAK_OFF	6
+#define CPO_CONTROL_DTR_ON		8
+#define CPO_CONTROL_DTR_OFF		9
+#define CPO_CONTROL_RTS_ON		11
+#define CPO_CONTROL_RTS_OFF		12
+#define CPO_PURGE_BOTH			3
+
+typedef enum
+{
+	TN_STATE_DATA,
+	TN_STATE_IAC,
+	TN_STATE_OPT,		/* option byte of WILL/WONT/DO/DONT */
+	TN_STATE_SB,
+	TN_STATE_SB_IAC,
+} tn_state_t;
+
+typedef struct net_port
+{
+	int			fd;
+	int			rfc2217;
+	char		cfg[64];
+
+	/* rx[rx_off..rx_len) is data already received, Telnet removed */
+	uint8_t		rx[NET_BUF];
+	unsigned int	rx_off, rx_len;
+	uint8_t		tx[NET_BUF];
+	unsigned int	tx_len;
+
+	/* Telnet receive state, kept across reads */
+	tn_state_t	state;
+	uint8_t		verb;
+	uint8_t		sb[16];
+	unsigned int	sb_len;
+	unsigned int	baud;			/* as acknowledged by the server */
+	int			refused;		/* server will not do COM-PORT-OPTION */
+} net_port_t;
+
+/* split "host:port" or "[v6]:port" and connect with a timeout */
+static int net_connect(const char *addr)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256], *port;
+	struct pollfd pfd;
+	socklen_t len;
+	int fd = -1, err = 0, one = 1;
+
+	if (snprintf(host, sizeof(host), "%s", addr) >= (int)sizeof(host))
+		return -1;
+	if ((port = strrchr(host, ':')) == NULL || port[1] == 0)
+		return -1;
+	*port++ = 0;
+	if (host[0] == '[' && port[-2] == ']')
+	{
+		port[-2] = 0;
+		memmove(host, host + 1, strlen(host));
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+	{
+		log_msg(LOG_LVL_WARN, "port", "%s: %s", addr, gai_strerror(err));
+		return -1;
+	}
+
+	for (ai = res; ai; ai = ai->ai_next)
+	{
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+						 ai->ai_protocol)) < 0)
+		{
+			err = errno;
+			continue;
+		}
+		err = 0;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) != 0)
+		{
+			err = errno;
+			if (err == EINPROGRESS)
+			{
+				pfd.fd = fd;
+				pfd.events = POLLOUT;
+				len = sizeof(err);
+				if (poll(&pfd, 1, NET_CONNECT_TIMEOUT) == 1)
+					getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+				else
+					err = ETIMEDOUT;
+			}
+		}
+		if (err == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+
+	if (fd < 0)
+	{
+		log_msg(LOG_LVL_WARN, "port", "%s: %s", addr, strerror(err));
+		return -1;
+	}
+	/* reads and writes block again, read timeouts come from poll() */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+	return fd;
+}
+
+static port_t net_flush_tx(net_port_t *np)
+{
+	unsigned int off = 0;
+	ssize_t r;
+
+	while (off < np->tx_len)
+	{
+		r = send(np->fd, np->tx + off, np->tx_len - off, MSG_NOSIGNAL);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+		{
+			np->tx_len = 0;
+			return PORT_ERR_UNKNOWN;
+		}
+		off += r;
+	}
+	np->tx_len = 0;
+	return PORT_OK;
+}
+
+static port_t net_queue(net_port_t *np, const uint8_t *buf, size_t nbyte)
+{
+	while (nbyte)
+	{
+		size_t n = sizeof(np->tx) - np->tx_len;
+
+		if (n == 0)
+		{
+			if (net_flush_tx(np) != PORT_OK)
+				return PORT_ERR_UNKNOWN;
+			continue;
+		}
+		if (n > nbyte)
+			n = nbyte;
+		memcpy(np->tx + np->tx_len, buf, n);
+		np->tx_len += n;
+		buf += n;
+		nbyte -= n;
+	}
+	return PORT_OK;
+}
+
+/* IAC SB COM-PORT-OPTION cmd value IAC SE, IAC in the value doubled */
+static port_t net_cpo(net_port_t *np, uint8_t cmd, const uint8_t *val, size_t len)
+{
+	uint8_t msg[4 + 2 * 4 + 2];
+	size_t n = 0;
+
+	assert(len <= 4);
+	msg[n++] = TN_IAC;
+	msg[n++] = TN_SB;
+	msg[n++] = TN_COM_PORT;
+	msg[n++] = cmd;
+	while (len--)
+	{
+		if (*val == TN_IAC)
+			msg[n++] = TN_IAC;
+		msg[n++] = *val++;
+	}
+	msg[n++] = TN_IAC;
+	msg[n++] = TN_SE;
+	return net_queue(np, msg, n);
+}
+
+static port_t net_cpo_byte(net_port_t *np, uint8_t cmd, uint8_t val)
+{
+	return net_cpo(np, cmd, &val, 1);
+}
+
+static void net_sb(net_port_t *np)
+{
+	if (np->sb_len < 2 || np->sb[0] != TN_COM_PORT)
+		return;
+	if (np->sb[1] == CPO_SERVER + CPO_SET_BAUDRATE && np->sb_len == 6)
+		np->baud = (uint32_t)np->sb[2] << 24 | np->sb[3] << 16 | np->sb[4] << 8 | np->sb[5];
+	/* line and modem state notifications are not used */
+}
+
+static void net_option(net_port_t *np, uint8_t verb, uint8_t opt)
+{
+	uint8_t msg[3] = { TN_IAC, 0, opt };
+
+	/* the options we want were asked for in net_open(), accept them */
+	if (opt == TN_BINARY || opt == TN_SGA || opt == TN_COM_PORT)
+	{
+		if (opt == TN_COM_PORT && (verb == TN_WONT || verb == TN_DONT))
+			np->refused = 1;
+		return;
+	}
+	if (verb == TN_WILL)
+		msg[1] = TN_DONT;
+	else if (verb == TN_DO)
+		msg[1] = TN_WONT;
+	else
+		return;
+	net_queue(np, msg, sizeof(msg));
+}
+
+/* strip Telnet from rx[from..rx_len) in place */
+static void net_telnet(net_port_t *np, unsigned int from)
+{
+	unsigned int i, out = from;
+	uint8_t c;
+
+	for (i = from; i < np->rx_len; i++)
+	{
+		c = np->rx[i];
+		switch (np->state)
+		{
+			case TN_STATE_DATA:
+				if (c == TN_IAC)
+					np->state = TN_STATE_IAC;
+				else
+					np->rx[out++] = c;
+				break;
+
+			case TN_STATE_IAC:
+				np->state = TN_STATE_DATA;
+				if (c == TN_IAC)
+					np->rx[out++] = c;
+				else if (c >= TN_WILL)
+				{
+					np->verb = c;
+					np->state = TN_STATE_OPT;
+				}
+				else if (c == TN_SB)
+				{
+					np->sb_len = 0;
+					np->state = TN_STATE_SB;
+				}
+				break;
+
+			case TN_STATE_OPT:
+				net_option(np, np->verb, c);
+				np->state = TN_STATE_DATA;
+				break;
+
+			case TN_STATE_SB:
+				if (c == TN_IAC)
+					np->state = TN_STATE_SB_IAC;
+				else if (np->sb_len < sizeof(np->sb))
+					np->sb[np->sb_len++] = c;
+				break;
+
+			case TN_STATE_SB_IAC:
+				if (c == TN_SE)
+				{
+					net_sb(np);
+					np->state = TN_STATE_DATA;
+					break;
+				}
+				if (np->sb_len < sizeof(np->sb))
+					np->sb[np->sb_len++] = c;
+				np->state = TN_STATE_SB;
+				break;
+		}
+	}
+	np->rx_len = out;
+}
+
+/* wait for more data; 0 on timeout, -1 if the connection is gone */
+static int net_fill(net_port_t *np, int timeout_ms)
+{
+	struct pollfd pfd;
+	unsigned int len;
+	ssize_t r;
+
+	if (np->rx_off == np->rx_len)
+		np->rx_off = np->rx_len = 0;
+	if (np->tx_len && net_flush_tx(np) != PORT_OK)
+		return -1;
+
+	pfd.fd = np->fd;
+	pfd.events = POLLIN;
+	do
+		r = poll(&pfd, 1, timeout_ms);
+	while (r < 0 && errno == EINTR);
+	if (r < 0)
+		return -1;
+	if (r == 0)
+		return 0;
+
+	len = np->rx_len;
+	r = recv(np->fd, np->rx + len, sizeof(np->rx) - len, 0);
+	if (r <= 0)
+		return -1;
+	np->rx_len += r;
+	if (np->rfc2217)
+		net_telnet(np, len);
+	return 1;
+}
+
+static port_t net_rfc2217_setup(net_port_t *np, port_opt_t *ops)
+{
+	static const uint8_t hello[] = {
+		TN_IAC, TN_WILL, TN_COM_PORT,
+		TN_IAC, TN_WILL, TN_BINARY, TN_IAC, TN_DO, TN_BINARY,
+		TN_IAC, TN_WILL, TN_SGA, TN_IAC, TN_DO, TN_SGA,
+	};
+	serial_parity_t parity = serial_get_parity(ops->serial_mode);
+	unsigned int want = serial_get_baud_int(ops->baudrate);
+	uint8_t baud[4] = { want >> 24, want >> 16, want >> 8, want };
+	uint64_t deadline;
+	int r;
+
+	if (serial_get_bits(ops->serial_mode) == SERIAL_BITS_INVALID
+	    || parity == SERIAL_PARITY_INVALID
+	    || serial_get_stopbit(ops->serial_mode) == SERIAL_STOPBIT_INVALID)
+		return PORT_ERR_UNKNOWN;
+
+	net_queue(np, hello, sizeof(hello));
+	net_cpo(np, CPO_SET_BAUDRATE, baud, sizeof(baud));
+	net_cpo_byte(np, CPO_SET_DATASIZE,
+				 serial_get_bits_int(serial_get_bits(ops->serial_mode)));
+	net_cpo_byte(np, CPO_SET_PARITY, parity == SERIAL_PARITY_NONE ? CPO_PARITY_NONE
+				 : parity == SERIAL_PARITY_ODD ? CPO_PARITY_ODD : CPO_PARITY_EVEN);
+	net_cpo_byte(np, CPO_SET_STOPSIZE,
+				 serial_get_stopbit_int(serial_get_stopbit(ops->serial_mode)));
+	net_cpo_byte(np, CPO_SET_CONTROL, CPO_CONTROL_NONE);
+	net_cpo_byte(np, CPO_PURGE_DATA, CPO_PURGE_BOTH);
+
+	/* the baud rate answer tells the port is set up; data before it is stale */
+	deadline = stats_now_us() + NET_CONNECT_TIMEOUT * 1000ULL;
+	while (np->baud == 0 && !np->refused)
+	{
+		uint64_t now = stats_now_us();
+
+		if (now >= deadline || (r = net_fill(np, (deadline - now + 999) / 1000)) == 0)
+		{
+			log_msg(LOG_LVL_WARN, "port", "No RFC2217 reply from the server");
+			return PORT_ERR_UNKNOWN;
+		}
+		if (r < 0)
+			return PORT_ERR_UNKNOWN;
+		np->rx_off = np->rx_len = 0;
+	}
+	if (np->refused)
+	{
+		log_msg(LOG_LVL_WARN, "port", "The server does not do RFC2217");
+		return PORT_ERR_UNKNOWN;
+	}
+	if ((np->baud > want ? np->baud - want : want - np->baud) * 100 > want * SERIAL_BAUD_TOLERANCE)
+	{
+		log_msg(LOG_LVL_WARN, "port", "%u baud asked, the server runs at %u", want, np->baud);
+		return PORT_ERR_UNKNOWN;
+	}
+	return PORT_OK;
+}
+
+static port_t net_open(port_interface_t *port, port_opt_t *ops)
+{
+	net_port_t *np;
+	const char *addr;
+	int rfc2217;
+
+	if (strncmp(ops->device, "tcp://", strlen("tcp://")) == 0)
+	{
+		addr = ops->device + strlen("tcp://");
+		rfc2217 = 0;
+	}
+	else if (strncmp(ops->device, "rfc2217://", strlen("rfc2217://")) == 0)
+	{
+		addr = ops->device + strlen("rfc2217://");
+		rfc2217 = 1;
+	}
+	else
+		return PORT_ERR_NODEV;
+
+	np = calloc(1, sizeof(net_port_t));
+	assert(np != NULL);
+	np->rfc2217 = rfc2217;
+	if ((np->fd = net_connect(addr)) < 0)
+	{
+		free(np);
+		return PORT_ERR_UNKNOWN;
+	}
+	if (rfc2217 && net_rfc2217_setup(np, ops) != PORT_OK)
+	{
+		close(np->fd);
+		free(np);
+		return PORT_ERR_UNKNOWN;
+	}
+
+	if (rfc2217)
+		snprintf(np->cfg, sizeof(np->cfg), "%u %s (rfc2217 %s)", np->baud, ops->serial_mode, addr);
+	else
+		snprintf(np->cfg, sizeof(np->cfg), "%s (tcp %s)", ops->serial_mode, addr);
+	port->private = np;
+	return PORT_OK;
+}
+
+static void net_close(port_interface_t *port)
+{
+	net_port_t *np = (net_port_t *)port->private;
+
+	if (np == NULL)
+		return;
+	net_flush_tx(np);
+	close(np->fd);
+	free(np);
+	port->private = NULL;
+}
+
+static port_t net_read(port_interface_t *port, void *buf, size_t nbyte)
+{
+	net_port_t *np = (net_port_t *)port->private;
+	uint8_t *pos = (uint8_t *)buf;
+	size_t n;
+	int r;
+
+	if (np == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	while (nbyte)
+	{
+		if (np->rx_off == np->rx_len)
+		{
+			if ((r = net_fill(np, NET_READ_TIMEOUT)) == 0)
+				return PORT_ERR_TIMEDOUT;
+			if (r < 0)
+				return PORT_ERR_UNKNOWN;
+			continue;
+		}
+		n = np->rx_len - np->rx_off < nbyte ? np->rx_len - np->rx_off : nbyte;
+		memcpy(pos, np->rx + np->rx_off, n);
+		np->rx_off += n;
+		nbyte -= n;
+		pos += n;
+	}
+	return PORT_OK;
+}
+
+static port_t net_write(port_interface_t *port, void *buf, size_t nbyte)
+{
+	net_port_t *np = (net_port_t *)port->private;
+	const uint8_t *pos = (const uint8_t *)buf;
+	const uint8_t *iac;
+
+	if (np == NULL)
+		return PORT_ERR_UNKNOWN;
+	if (!np->rfc2217)
+		return net_queue(np, pos, nbyte);
+
+	/* 0xff in the data is sent twice */
+	while (nbyte && (iac = memchr(pos, TN_IAC, nbyte)) != NULL)
+	{
+		if (net_queue(np, pos, iac - pos + 1) != PORT_OK)
+			return PORT_ERR_UNKNOWN;
+		if (net_queue(np, iac, 1) != PORT_OK)
+			return PORT_ERR_UNKNOWN;
+		nbyte -= iac - pos + 1;
+		pos = iac + 1;
+	}
+	return net_queue(np, pos, nbyte);
+}
+
+/* queued as they are, the segments leave together on the next read */
+static port_t net_writev(port_interface_t *port, const struct iovec *iov, int iovcnt)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if (net_write(port, iov[i].iov_base, iov[i].iov_len) != PORT_OK)
+			return PORT_ERR_UNKNOWN;
+	return PORT_OK;
+}
+
+static port_t net_gpio(port_interface_t *port, serial_gpio_t n, int level)
+{
+	net_port_t *np = (net_port_t *)port->private;
+	uint8_t ctl;
+
+	if (np == NULL || !np->rfc2217)
+		return PORT_ERR_UNKNOWN;
+
+	switch (n)
+	{
+		case GPIO_RTS:
+			ctl = level ? CPO_CONTROL_RTS_ON : CPO_CONTROL_RTS_OFF;
+			break;
+
+		case GPIO_DTR:
+			ctl = level ? CPO_CONTROL_DTR_ON : CPO_CONTROL_DTR_OFF;
+			break;
+
+		case GPIO_BRK:
+			if (level == 0)
+				return PORT_OK;
+			if (net_cpo_byte(np, CPO_SET_CONTROL, CPO_CONTROL_BREAK_ON) != PORT_OK
+			    || net_flush_tx(np) != PORT_OK)
+				return PORT_ERR_UNKNOWN;
+			usleep(NET_BREAK_MS * 1000);
+			ctl = CPO_CONTROL_BREAK_OFF;
+			break;
+
+		default:
+			return PORT_ERR_UNKNOWN;
+	}
+
+	if (net_cpo_byte(np, CPO_SET_CONTROL, ctl) != PORT_OK)
+		return PORT_ERR_UNKNOWN;
+	return net_flush_tx(np);
+}
+
+static const char *net_get_cfg_str(port_interface_t *port)
+{
+	net_port_t *np = (net_port_t *)port->private;
+
+	return np ? np->cfg : "INVALID";
+}
+
+/* raw TCP only, the engine cannot take Telnet nor bytes already buffered */
+static int net_get_fd(port_interface_t *port)
+{
+	net_port_t *np = (net_port_t *)port->private;
+
+	if (np == NULL || np->rfc2217 || np->rx_off != np->rx_len)
+		return -1;
+	net_flush_tx(np);
+	return np->fd;
+}
+
+struct port_interface port_net = {
+	.name	= "TCP/RFC2217",
+	.flags	= PORT_BYTE | PORT_GVR_ETX | PORT_CMD_INIT | PORT_RETRY,
+	.open	= net_open,
+	.close	= net_close,
+	.read	= net_read,
+	.write	= net_write,
+	.writev	= net_writev,
+	.gpio	= net_gpio,
+	.get_cfg_str	= net_get_cfg_str,
+	.get_fd	= net_get_fd,
+};
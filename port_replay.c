@@ -0,0 +1,370 @@
+/******************************************************************************
+ * port record and replay
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#include <assert.h>
+#include "port.h"
+#include "stats.h"
+#include "log.h"
+
+/*
+ * File format, host byte order:
+ *	header: "GSTMREC1", port flags (u32), config string (u32 length + bytes)
+ *	records: op (u8), status (u8), reserved (u16), length (u32),
+ *	         completion time in us since open (u64), then the payload.
+ * Writes carry the bytes written, reads carry the bytes read when the
+ * status is PORT_OK, gpio carries the line level.
+ */
+#define RECORD_MAGIC		"GSTMREC1"
+
+#define RECORD_WRITE		'W'
+#define RECORD_READ			'R'
+#define RECORD_GPIO			'G'
+
+typedef struct record_hdr
+{
+	uint8_t		op;
+	uint8_t		status;
+	uint16_t	gpio;
+	uint32_t	len;
+	uint64_t	t_us;
+} record_hdr_t;
+
+typedef struct record
+{
+	port_interface_t	*inner;
+	FILE				*f;
+	uint64_t			t0;
+} record_t;
+
+static void record_put(record_t *r, uint8_t op, port_t status, uint16_t gpio,
+					   const void *buf, uint32_t len, int with_data)
+{
+	record_hdr_t hdr;
+
+	hdr.op		= op;
+	hdr.status	= status;
+	hdr.gpio	= gpio;
+	hdr.len		= len;
+	hdr.t_us	= stats_now_us() - r->t0;
+	fwrite(&hdr, sizeof(hdr), 1, r->f);
+	if (with_data && len)
+		fwrite(buf, 1, len, r->f);
+}
+
+static port_t record_open(port_interface_t *port, port_opt_t *ops)
+{
+	/* the inner port is already open */
+	return PORT_OK;
+}
+
+static void record_close(port_interface_t *port)
+{
+	record_t *r = (record_t *)port->private;
+
+	port_close(r->inner);
+	fclose(r->f);
+	free(r);
+	port->private = NULL;
+}
+
+static port_t record_read(port_interface_t *port, void *buf, size_t nbyte)
+{
+	record_t *r = (record_t *)port->private;
+	port_t port_err;
+
+	port_err = r->inner->read(r->inner, buf, nbyte);
+	record_put(r, RECORD_READ, port_err, 0, buf, nbyte, port_err == PORT_OK);
+	return port_err;
+}
+
+static port_t record_write(port_interface_t *port, void *buf, size_t nbyte)
+{
+	record_t *r = (record_t *)port->private;
+	port_t port_err;
+
+	port_err = r->inner->write(r->inner, buf, nbyte);
+	record_put(r, RECORD_WRITE, port_err, 0, buf, nbyte, 1);
+	return port_err;
+}
+
+static port_t record_gpio(port_interface_t *port, serial_gpio_t n, int level)
+{
+	record_t *r = (record_t *)port->private;
+	port_t port_err;
+
+	port_err = r->inner->gpio(r->inner, n, level);
+	record_put(r, RECORD_GPIO, port_err, n, NULL, level, 0);
+	return port_err;
+}
+
+static const char *record_get_cfg_str(port_interface_t *port)
+{
+	record_t *r = (record_t *)port->private;
+
+	return r->inner->get_cfg_str(r->inner);
+}
+
+/*
+ * Wrap an open port so that every read, write and gpio call is captured
+ * into filename. port_close() on the returned port closes the inner one.
+ * Returns NULL (and leaves inner untouched) if the file can't be created.
+ */
+port_interface_t *port_record_wrap(port_interface_t *inner, const char *filename)
+{
+	port_interface_t *port;
+	const char *cfg;
+	record_t *r;
+	uint32_t v;
+
+	r = calloc(1, sizeof(record_t));
+	assert(r != NULL);
+	if ((r->f = fopen(filename, "wb")) == NULL)
+	{
+		log_msg(LOG_LVL_ERROR, "record", "Cannot create record file \"%s\"", filename);
+		free(r);
+		return NULL;
+	}
+	r->inner = inner;
+	r->t0 = stats_now_us();
+
+	fwrite(RECORD_MAGIC, 1, 8, r->f);
+	v = inner->flags;
+	fwrite(&v, sizeof(v), 1, r->f);
+	cfg = inner->get_cfg_str(inner);
+	v = strlen(cfg);
+	fwrite(&v, sizeof(v), 1, r->f);
+	fwrite(cfg, 1, v, r->f);
+
+	port = calloc(1, sizeof(port_interface_t));
+	assert(port != NULL);
+	port->name			= "Record";
+	port->flags			= inner->flags;
+	port->open			= record_open;
+	port->close			= record_close;
+	port->read			= record_read;
+	port->write			= record_write;
+	port->gpio			= record_gpio;
+	port->get_cfg_str	= record_get_cfg_str;
+	port->cmd_get_reply	= inner->cmd_get_reply;
+	port->private		= r;
+	return port;
+}
+
+/*
+ * Replay backend: "replay:<file>" serves the recorded responses at the
+ * recorded timing, "replay-fast:<file>" serves them as fast as possible.
+ * The calls made by the protocol layer must match the recording one by
+ * one; any divergence is reported and fails the call.
+ */
+typedef struct replay
+{
+	uint8_t		*data;
+	size_t		size, pos;
+	unsigned	index;			/* record number, for diagnostics */
+	int			realtime;
+	uint64_t	t0;
+	char		cfg[64];
+} replay_t;
+
+/* the header is copied out, records start at any byte of the file */
+static int replay_next(replay_t *rp, uint8_t op, record_hdr_t *hdr, const void **payload)
+{
+	size_t len;
+
+	if (rp->pos + sizeof(record_hdr_t) > rp->size)
+	{
+		log_msg(LOG_LVL_ERROR, "replay", "End of recording at record %u", rp->index);
+		return -1;
+	}
+	memcpy(hdr, rp->data + rp->pos, sizeof(record_hdr_t));
+	if (hdr->op != op)
+	{
+		log_msg(LOG_LVL_ERROR, "replay", "Diverged at record %u (expected '%c', got '%c')",
+				rp->index, hdr->op, op);
+		return -1;
+	}
+
+	len = 0;
+	if (op == RECORD_WRITE || (op == RECORD_READ && hdr->status == PORT_OK))
+		len = hdr->len;
+	if (rp->pos + sizeof(record_hdr_t) + len > rp->size)
+	{
+		log_msg(LOG_LVL_ERROR, "replay", "Truncated record %u", rp->index);
+		return -1;
+	}
+
+	*payload = rp->data + rp->pos + sizeof(record_hdr_t);
+	rp->pos += sizeof(record_hdr_t) + len;
+	rp->index++;
+
+	if (rp->realtime)
+	{
+		uint64_t now = stats_now_us() - rp->t0;
+
+		if (hdr->t_us > now)
+			usleep(hdr->t_us - now);
+	}
+	return 0;
+}
+
+static port_t replay_open(port_interface_t *port, port_opt_t *ops)
+{
+	const char *filename;
+	replay_t *rp;
+	FILE *f;
+	long size;
+	uint32_t v;
+	int realtime;
+
+	if (!strncmp(ops->device, "replay:", strlen("replay:")))
+	{
+		filename = ops->device + strlen("replay:");
+		realtime = 1;
+	}
+	else if (!strncmp(ops->device, "replay-fast:", strlen("replay-fast:")))
+	{
+		filename = ops->device + strlen("replay-fast:");
+		realtime = 0;
+	}
+	else
+		return PORT_ERR_NODEV;
+
+	if ((f = fopen(filename, "rb")) == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	rp = calloc(1, sizeof(replay_t));
+	assert(rp != NULL);
+	fseek(f, 0, SEEK_END);
+	size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	rp->data = malloc(size > 0 ? size : 1);
+	assert(rp->data != NULL);
+	rp->size = fread(rp->data, 1, size, f);
+	fclose(f);
+
+	/* header */
+	if (rp->size < 16 || memcmp(rp->data, RECORD_MAGIC, 8))
+		goto invalid;
+	memcpy(&v, rp->data + 8, 4);
+	port->flags = v;
+	memcpy(&v, rp->data + 12, 4);
+	if (16 + (size_t)v > rp->size)
+		goto invalid;
+	snprintf(rp->cfg, sizeof(rp->cfg), "%.*s (replay)", (int)v, rp->data + 16);
+	rp->pos = 16 + v;
+	rp->realtime = realtime;
+	rp->t0 = stats_now_us();
+
+	port->private = rp;
+	return PORT_OK;
+
+invalid:
+	log_msg(LOG_LVL_ERROR, "replay", "Invalid record file \"%s\"", filename);
+	free(rp->data);
+	free(rp);
+	return PORT_ERR_UNKNOWN;
+}
+
+static void replay_close(port_interface_t *port)
+{
+	replay_t *rp = (replay_t *)port->private;
+
+	assert(rp != NULL);
+	free(rp->data);
+	free(rp);
+	port->private = NULL;
+}
+
+static port_t replay_read(port_interface_t *port, void *buf, size_t nbyte)
+{
+	replay_t *rp = (replay_t *)port->private;
+	record_hdr_t hdr;
+	const void *payload;
+
+	if (replay_next(rp, RECORD_READ, &hdr, &payload) != 0)
+		return PORT_ERR_UNKNOWN;
+	if (hdr.len != nbyte)
+	{
+		log_msg(LOG_LVL_ERROR, "replay", "Read of %u bytes at record %u, recorded %u",
+				(unsigned)nbyte, rp->index - 1, hdr.len);
+		return PORT_ERR_UNKNOWN;
+	}
+	if (hdr.status == PORT_OK)
+		memcpy(buf, payload, nbyte);
+	return hdr.status;
+}
+
+static port_t replay_write(port_interface_t *port, void *buf, size_t nbyte)
+{
+	replay_t *rp = (replay_t *)port->private;
+	record_hdr_t hdr;
+	const void *payload;
+
+	if (replay_next(rp, RECORD_WRITE, &hdr, &payload) != 0)
+		return PORT_ERR_UNKNOWN;
+	if (hdr.len != nbyte || memcmp(payload, buf, nbyte))
+	{
+		log_msg(LOG_LVL_ERROR, "replay", "Written data differs at record %u", rp->index - 1);
+		return PORT_ERR_UNKNOWN;
+	}
+	return hdr.status;
+}
+
+static port_t replay_gpio(port_interface_t *port, serial_gpio_t n, int level)
+{
+	replay_t *rp = (replay_t *)port->private;
+	record_hdr_t hdr;
+	const void *payload;
+
+	if (replay_next(rp, RECORD_GPIO, &hdr, &payload) != 0)
+		return PORT_ERR_UNKNOWN;
+	if (hdr.gpio != n || hdr.len != (uint32_t)level)
+	{
+		log_msg(LOG_LVL_ERROR, "replay", "Gpio call differs at record %u", rp->index - 1);
+		return PORT_ERR_UNKNOWN;
+	}
+	return hdr.status;
+}
+
+static const char *replay_get_cfg_str(port_interface_t *port)
+{
+	replay_t *rp = (replay_t *)port->private;
+
+	return rp ? rp->cfg : "INVALID";
+}
+
+struct port_interface port_replay = {
+	.name	= "Replay",
+	.flags	= 0,	/* taken from the recording */
+	.open	= replay_open,
+	.close	= replay_close,
+	.read	= replay_read,
+	.write	= replay_write,
+	.gpio	= replay_gpio,
+	.get_cfg_str	= replay_get_cfg_str,
+};
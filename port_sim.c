@@ -0,0 +1,204 @@
+/******************************************************************************
+ * simulated bootloader port
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include "port.h"
+#include "stats.h"
+#include "stm32_sim.h"
+
+/*
+ * "sim:<pid>[,option...]" opens an in-process bootloader, e.g.
+ * "sim:0x410,lat=2000,fast". Options are those of sim_parse_options();
+ * the wire speed follows the requested baud rate and serial mode.
+ * By default the replies arrive at their modelled time; with "fast" a
+ * virtual clock is advanced instead, so nothing ever sleeps.
+ */
+#define SIM_READ_TIMEOUT	500000	/* us, same as VTIME = 5 on a tty */
+
+typedef struct sim_port
+{
+	stm32_sim_t	*sim;
+	int			fast;
+	uint64_t	clock;		/* virtual time in fast mode */
+	char		cfg[40];
+} sim_port_t;
+
+static uint64_t sim_port_now(sim_port_t *sp)
+{
+	return sp->fast ? sp->clock : stats_now_us();
+}
+
+static void sim_port_wait(sim_port_t *sp, uint64_t t_us)
+{
+	uint64_t now = sim_port_now(sp);
+
+	if (t_us <= now)
+		return;
+	if (sp->fast)
+		sp->clock = t_us;
+	else
+		usleep(t_us - now);
+}
+
+static port_t sim_port_open(port_interface_t *port, port_opt_t *ops)
+{
+	sim_timing_t timing;
+	sim_port_t *sp;
+	const char *opts;
+	unsigned long pid;
+	char *end;
+	int fast = 0;
+
+	if (strncmp(ops->device, "sim:", strlen("sim:")))
+		return PORT_ERR_NODEV;
+
+	pid = strtoul(ops->device + strlen("sim:"), &end, 16);
+	if (end == ops->device + strlen("sim:") || (*end != 0 && *end != ','))
+		return PORT_ERR_UNKNOWN;
+	opts = *end == ',' ? end + 1 : NULL;
+
+	sim_timing_default(&timing);
+	timing.baud = serial_get_baud_int(ops->baudrate);
+	timing.bits = 1 + serial_get_bits_int(serial_get_bits(ops->serial_mode))
+		+ (serial_get_parity(ops->serial_mode) != SERIAL_PARITY_NONE)
+		+ serial_get_stopbit_int(serial_get_stopbit(ops->serial_mode));
+	if (sim_parse_options(opts, &timing, &fast) != 0)
+	{
+		fprintf(stderr, "Invalid simulator options \"%s\"\n", opts);
+		return PORT_ERR_UNKNOWN;
+	}
+
+	sp = calloc(1, sizeof(sim_port_t));
+	assert(sp != NULL);
+	if ((sp->sim = sim_create(pid, &timing)) == NULL)
+	{
+		fprintf(stderr, "Unknown device 0x%03lx for the simulator\n", pid);
+		free(sp);
+		return PORT_ERR_UNKNOWN;
+	}
+	sp->fast = fast;
+	snprintf(sp->cfg, sizeof(sp->cfg), "%u %s (sim %03lx%s)",
+			 timing.baud, ops->serial_mode, pid, fast ? ", fast" : "");
+
+	port->private = sp;
+	return PORT_OK;
+}
+
+static void sim_port_close(port_interface_t *port)
+{
+	sim_port_t *sp = (sim_port_t *)port->private;
+
+	assert(sp != NULL);
+	sim_destroy(sp->sim);
+	free(sp);
+	port->private = NULL;
+}
+
+static port_t sim_port_read(port_interface_t *port, void *buf, size_t nbyte)
+{
+	sim_port_t *sp = (sim_port_t *)port->private;
+	uint8_t *pos = (uint8_t *)buf;
+	uint64_t t;
+	size_t n;
+
+	if (sp == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	while (nbyte)
+	{
+		n = sim_fetch(sp->sim, pos, nbyte, sim_port_now(sp));
+		nbyte -= n;
+		pos += n;
+		if (nbyte == 0)
+			break;
+
+		if (!sim_next_ready(sp->sim, &t) || t > sim_port_now(sp) + SIM_READ_TIMEOUT)
+		{
+			sim_port_wait(sp, sim_port_now(sp) + SIM_READ_TIMEOUT);
+			return PORT_ERR_TIMEDOUT;
+		}
+		sim_port_wait(sp, t);
+	}
+	return PORT_OK;
+}
+
+static port_t sim_port_write(port_interface_t *port, void *buf, size_t nbyte)
+{
+	sim_port_t *sp = (sim_port_t *)port->private;
+
+	if (sp == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	sim_feed(sp->sim, buf, nbyte, sim_port_now(sp));
+	return PORT_OK;
+}
+
+static port_t sim_port_gpio(port_interface_t *port, serial_gpio_t n, int level)
+{
+	sim_port_t *sp = (sim_port_t *)port->private;
+
+	if (sp == NULL)
+		return PORT_ERR_UNKNOWN;
+
+	/* DTR holds NRST low, see stm32_enter_bootloader() */
+	if (n == GPIO_DTR && level)
+		sim_pin_reset(sp->sim);
+	return PORT_OK;
+}
+
+static const char *sim_port_get_cfg_str(port_interface_t *port)
+{
+	sim_port_t *sp = (sim_port_t *)port->private;
+
+	return sp ? sp->cfg : "INVALID";
+}
+
+/* the model behind a simulated port, NULL for any other port */
+stm32_sim_t *port_sim_model(port_interface_t *port)
+{
+	if (port->read != sim_port_read || port->private == NULL)
+		return NULL;
+	return ((sim_port_t *)port->private)->sim;
+}
+
+/* modelled time of a simulated port, virtual in fast mode */
+uint64_t port_sim_clock(port_interface_t *port)
+{
+	if (port->read != sim_port_read || port->private == NULL)
+		return 0;
+	return sim_port_now((sim_port_t *)port->private);
+}
+
+struct port_interface port_sim = {
+	.name	= "Simulator",
+	.flags	= PORT_BYTE | PORT_GVR_ETX | PORT_CMD_INIT | PORT_RETRY,
+	.open	= sim_port_open,
+	.close	= sim_port_close,
+	.read	= sim_port_read,
+	.write	= sim_port_write,
+	.gpio	= sim_port_gpio,
+	.get_cfg_str	= sim_port_get_cfg_str,
+};
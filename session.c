@@ -0,0 +1,372 @@
+/******************************************************************************
+ * bootloader session
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <pthread.h>
+#include "session.h"
+#include "trace.h"
+#include "log.h"
+
+/*
+ * Capability cache, keyed by port and PID. The entry of the last device
+ * seen on a port is used to attempt a fast INIT+GID reconnect.
+ */
+typedef struct session_cache
+{
+	char			device[256];
+	uint16_t		pid;
+	unsigned int	stamp;
+	stm32_cmd_t		cmd;
+	stm32_struct_t	stm;
+} session_cache_t;
+
+static session_cache_t	cache[SESSION_CACHE_SIZE];
+static unsigned int		cache_stamp;
+static pthread_mutex_t	cache_lock = PTHREAD_MUTEX_INITIALIZER;	/* gang runs connect concurrently */
+
+static session_cache_t *session_cache_find(const char *device)
+{
+	session_cache_t *best = NULL;
+	int i;
+
+	for (i = 0; i < SESSION_CACHE_SIZE; i++)
+	{
+		if (cache[i].stamp == 0 || strcmp(cache[i].device, device))
+			continue;
+		if (best == NULL || cache[i].stamp > best->stamp)
+			best = &cache[i];
+	}
+	return best;
+}
+
+static void session_cache_store(const char *device, const stm32_struct_t *stm)
+{
+	session_cache_t *e = NULL;
+	int i;
+
+	for (i = 0; i < SESSION_CACHE_SIZE; i++)
+		if (cache[i].stamp && cache[i].pid == stm->pid
+		    && !strcmp(cache[i].device, device))
+		{
+			e = &cache[i];
+			break;
+		}
+
+	/* replace the least recently used entry */
+	if (e == NULL)
+	{
+		e = &cache[0];
+		for (i = 1; i < SESSION_CACHE_SIZE; i++)
+			if (cache[i].stamp < e->stamp)
+				e = &cache[i];
+	}
+
+	snprintf(e->device, sizeof(e->device), "%s", device);
+	e->pid		= stm->pid;
+	e->stamp	= ++cache_stamp;
+	e->cmd		= *stm->cmd;
+	e->stm		= *stm;
+	e->stm.cmd	= &e->cmd;
+	e->stm.port	= NULL;
+}
+
+static stm32_t session_do_connect(session_t *s)
+{
+	session_cache_t *e, entry;
+
+	/* after a reset only the full handshake makes sense; copy the entry
+	 * so that the lock is not held during I/O */
+	pthread_mutex_lock(&cache_lock);
+	e = (s->init_flags & STM32_INIT_RESET) ? NULL : session_cache_find(s->device);
+	if (e != NULL)
+	{
+		entry = *e;
+		entry.stm.cmd = &entry.cmd;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	if (e != NULL)
+	{
+		s->stm = stm32_reconnect(s->port, &entry.stm);
+		if (s->stm != NULL)
+		{
+			s->reused = 1;
+			goto store;
+		}
+	}
+
+	/* unknown or different device, do the full handshake */
+	s->stm = stm32_init(s->port, s->init_flags);
+	if (s->stm == NULL)
+		return STM32_ERR_UNKNOWN;
+	s->reused = 0;
+
+store:
+	pthread_mutex_lock(&cache_lock);
+	session_cache_store(s->device, s->stm);
+	pthread_mutex_unlock(&cache_lock);
+	return STM32_OK;
+}
+
+static stm32_t session_connect(session_t *s)
+{
+	stm32_t stm_err;
+
+	trace_phase(trace_chan(s->port), "connect", 1);
+	stm_err = session_do_connect(s);
+	trace_phase(trace_chan(s->port), "connect", 0);
+	return stm_err;
+}
+
+session_t* session_open(port_opt_t *opts, unsigned int init_flags)
+{
+	session_t *s;
+
+	s = calloc(1, sizeof(session_t));
+	assert(s != NULL);
+
+	snprintf(s->device, sizeof(s->device), "%s", opts->device);
+	s->opts = *opts;
+	s->opts.device = s->device;
+	snprintf(s->mode, sizeof(s->mode), "%s", opts->serial_mode);
+	s->opts.serial_mode = s->mode;
+	s->init_flags = init_flags;
+	s->stats = calloc(1, sizeof(stm32_stats_t));
+	assert(s->stats != NULL);
+
+	if (port_open(&s->opts, &s->port) != PORT_OK)
+	{
+		free(s->stats);
+		free(s);
+		return NULL;
+	}
+
+	if (session_connect(s) != STM32_OK)
+	{
+		session_close(s);
+		return NULL;
+	}
+	return s;
+}
+
+/*
+ * Reuse an existing session for a new operation if it targets the same
+ * port with the same settings and the bootloader still answers GID with
+ * the same PID. Otherwise the old session is closed and a new one opened.
+ */
+session_t* session_reuse(session_t *s, port_opt_t *opts, unsigned int init_flags)
+{
+	if (s == NULL)
+		return session_open(opts, init_flags);
+
+	if (strcmp(s->device, opts->device)
+	    || s->opts.baudrate != opts->baudrate
+	    || strcmp(s->opts.serial_mode, opts->serial_mode)
+	    || s->opts.low_latency != opts->low_latency)
+	{
+		session_close(s);
+		return session_open(opts, init_flags);
+	}
+
+	s->init_flags = init_flags;
+	if (s->stm != NULL && stm32_ping(s->stm) == STM32_OK)
+	{
+		s->reused = 1;
+		return s;
+	}
+
+	/* the board was reset or replaced in the meantime */
+	if (session_reconnect(s) == STM32_OK)
+		return s;
+
+	session_close(s);
+	return session_open(opts, init_flags);
+}
+
+/* reconnect after the device has reset, e.g. following an unprotect */
+stm32_t session_reconnect(session_t *s)
+{
+	if (s->stm != NULL)
+	{
+		if (s->stm->stats)
+			stats_merge(s->stats, s->stm->stats);
+		stm32_close(s->stm);
+		s->stm = NULL;
+	}
+	return session_connect(s);
+}
+
+/* counters of the whole session, across reconnects */
+void session_stats(const session_t *s, stm32_stats_t *out)
+{
+	memcpy(out, s->stats, sizeof(stm32_stats_t));
+	if (s->stm && s->stm->stats)
+		stats_merge(out, s->stm->stats);
+}
+
+/* outcome of a failed write, from reading the block back */
+enum
+{
+	BLOCK_WRITTEN,
+	BLOCK_ERASED,
+	BLOCK_PARTIAL,
+	BLOCK_UNKNOWN,
+};
+
+static int session_block_state(session_t *s, const uint8_t *data, uint32_t addr, unsigned int len)
+{
+	uint8_t buf[256];
+	unsigned int i, erased = 1;
+
+	s->readbacks++;
+	if (stm32_read_memory(s->stm, addr, buf, len) != STM32_OK)
+		return BLOCK_UNKNOWN;
+	if (!memcmp(buf, data, len))
+		return BLOCK_WRITTEN;
+	for (i = 0; i < len; i++)
+		if (buf[i] != 0xFF)
+			erased = 0;
+	return erased ? BLOCK_ERASED : BLOCK_PARTIAL;
+}
+
+/*
+ * Programming stopped half way: erase the pages under the block and
+ * write back what the image already had there. Not in the large
+ * sectors of F2/F4, see stm32_paged_size().
+ */
+static stm32_t session_rewrite_pages(session_t *s, const uint8_t *image, uint32_t base,
+									 uint32_t addr, unsigned int len)
+{
+	const stm32_dev_t *dev = s->stm->dev;
+	uint32_t first, last, from, n;
+
+	if (addr + len > dev->fl_start + stm32_paged_size(dev))
+		return STM32_ERR_UNKNOWN;
+	first = (addr - dev->fl_start) / dev->fl_ps;
+	last = (addr + len - 1 - dev->fl_start) / dev->fl_ps;
+	from = dev->fl_start + first * dev->fl_ps;
+	if (from < base || last >= 0xFF)
+		return STM32_ERR_UNKNOWN;
+
+	if (stm32_erase_memory(s->stm, first, last - first + 1) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	for (; from < addr + len; from += n)
+	{
+		n = addr + len - from > 256 ? 256 : addr + len - from;
+		if (stm32_write_memory(s->stm, from, image + (from - base), n) != STM32_OK)
+			return STM32_ERR_UNKNOWN;
+	}
+	return STM32_OK;
+}
+
+/*
+ * Write one block of the image at addr, recovering from line errors:
+ * resync and write again, re-init the bootloader once resyncing does
+ * not help, and read the block back first since a failed write may
+ * still have programmed it. s->stm may change on a re-init. A block
+ * refused before it went out, or a bootloader without the write
+ * command, fails at once: no retry can change that.
+ */
+stm32_t session_write_block(session_t *s, const uint8_t *image, uint32_t base,
+							uint32_t addr, unsigned int len)
+{
+	const uint8_t *data = image + (addr - base);
+	stm32_t stm_err;
+	int tries;
+
+	for (tries = 1; ; tries++)
+	{
+		stm_err = stm32_write_memory(s->stm, addr, data, len);
+		if (stm_err == STM32_OK)
+			return STM32_OK;
+		if (stm_err == STM32_ERR_PARAM || stm_err == STM32_ERR_NO_CMD)
+			return stm_err;
+
+		if (tries == SESSION_BLOCK_TRIES)
+		{
+			log_msg(LOG_LVL_ERROR, "session", "Giving up on block 0x%08x after %d tries", addr, tries);
+			return STM32_ERR_UNKNOWN;
+		}
+		s->block_retries++;
+		log_msg(LOG_LVL_WARN, "session", "Block 0x%08x failed, retrying (%d)", addr, tries);
+
+		/*
+		 * Get the bootloader to listen again. Late replies of the failed
+		 * frame and the extra NACKs of a resync must not be taken for the
+		 * answer to the next command.
+		 */
+		stm32_drain(s->stm);
+		if (tries < SESSION_REINIT_AFTER
+		    && stm32_resync_timeout(s->stm, SESSION_RESYNC_TIMEOUT) == STM32_OK)
+		{
+			s->resyncs++;
+			stm32_drain(s->stm);
+		}
+		else
+		{
+			s->reinits++;
+			if (session_reconnect(s) != STM32_OK)
+			{
+				log_msg(LOG_LVL_ERROR, "session", "Cannot reconnect to the bootloader");
+				return STM32_ERR_UNKNOWN;
+			}
+		}
+
+		switch (session_block_state(s, data, addr, len))
+		{
+			case BLOCK_WRITTEN:
+				return STM32_OK;
+			case BLOCK_PARTIAL:
+				if (session_rewrite_pages(s, image, base, addr, len) == STM32_OK)
+					return STM32_OK;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+void session_close(session_t *s)
+{
+	if (s == NULL)
+		return;
+	if (s->stm)
+	{
+		if (s->stm->stats)
+			stats_merge(s->stats, s->stm->stats);
+		stm32_close(s->stm);
+	}
+	log_msg(LOG_LVL_INFO, "session", "Session %s closed", s->device);
+	if (s->block_retries)
+		log_msg(LOG_LVL_INFO, "session", "  block retries %u (resync %u, re-init %u, read back %u)",
+				s->block_retries, s->resyncs, s->reinits, s->readbacks);
+	if (log_enabled(LOG_LVL_INFO))
+		stats_dump(s->stats, stderr);
+	free(s->stats);
+	if (s->port)
+		port_close(s->port);
+	free(s);
+}
@@ -0,0 +1,65 @@
+/******************************************************************************
+ * bootloader session
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include "port.h"
+#include "stm32.h"
+
+#define SESSION_CACHE_SIZE	16
+#define SESSION_BLOCK_TRIES		5	/* writes of one block before giving up */
+#define SESSION_REINIT_AFTER	2	/* failed writes before a full re-init */
+#define SESSION_RESYNC_TIMEOUT	2	/* seconds, the device may have reset */
+
+/*
+ * A session keeps the port open and the bootloader connected between
+ * operations, so that a second download on the same board does not pay
+ * for the INIT/GVR/GET/GID handshake again.
+ */
+typedef struct session
+{
+	char				device[256];
+	char				mode[8];	/* opts.device and opts.serial_mode point here */
+	port_opt_t			opts;
+	port_interface_t	*port;
+	stm32_struct_t		*stm;
+	unsigned int		init_flags;	/* passed to stm32_init() */
+	stm32_stats_t		*stats;		/* counters of previous connections */
+	int					reused;		/* connected from cache or kept alive */
+
+	/* block write recovery, see session_write_block() */
+	uint32_t			block_retries;
+	uint32_t			resyncs;
+	uint32_t			reinits;
+	uint32_t			readbacks;
+} session_t;
+
+session_t*	session_open(port_opt_t *opts, unsigned int init_flags);
+session_t*	session_reuse(session_t *s, port_opt_t *opts, unsigned int init_flags);
+stm32_t		session_reconnect(session_t *s);
+void		session_stats(const session_t *s, stm32_stats_t *out);
+stm32_t		session_write_block(session_t *s, const uint8_t *image, uint32_t base,
+								uint32_t addr, unsigned int len);
+void		session_close(session_t *s);
+
+#endif
@@ -0,0 +1,181 @@
+/******************************************************************************
+ * protocol statistics
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+
+/* monotonic clock in microseconds */
+uint64_t stats_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int stats_bucket(uint64_t us)
+{
+	unsigned int msb;
+
+	if (us < STATS_SUB_BUCKETS)
+		return us;
+
+	msb = 63 - __builtin_clzll(us);
+	if (msb >= STATS_OCTAVES + STATS_SUB_BITS)
+		return STATS_BUCKETS - 1;
+
+	/* octave, then the next STATS_SUB_BITS bits below the msb */
+	return (msb - STATS_SUB_BITS + 1) * STATS_SUB_BUCKETS
+		+ ((us >> (msb - STATS_SUB_BITS)) & (STATS_SUB_BUCKETS - 1));
+}
+
+/* lowest value that falls into bucket b */
+static uint64_t stats_bucket_floor(unsigned int b)
+{
+	unsigned int octave, sub;
+
+	if (b < STATS_SUB_BUCKETS)
+		return b;
+
+	octave = b / STATS_SUB_BUCKETS + STATS_SUB_BITS - 1;
+	sub = b % STATS_SUB_BUCKETS;
+	return ((uint64_t)1 << octave) | ((uint64_t)sub << (octave - STATS_SUB_BITS));
+}
+
+void stats_hist_add(stats_hist_t *h, uint64_t us)
+{
+	h->count++;
+	h->total_us += us;
+	if (us > h->max_us)
+		h->max_us = us > UINT32_MAX ? UINT32_MAX : us;
+	h->bucket[stats_bucket(us)]++;
+}
+
+uint64_t stats_hist_percentile(const stats_hist_t *h, double p)
+{
+	uint64_t rank, seen = 0;
+	unsigned int b;
+
+	if (h->count == 0)
+		return 0;
+
+	rank = (uint64_t)(p / 100.0 * h->count + 0.5);
+	if (rank == 0)
+		rank = 1;
+	for (b = 0; b < STATS_BUCKETS; b++)
+	{
+		seen += h->bucket[b];
+		if (seen >= rank)
+			return stats_bucket_floor(b);
+	}
+	return h->max_us;
+}
+
+void stats_hist_merge(stats_hist_t *dst, const stats_hist_t *src)
+{
+	unsigned int b;
+
+	dst->count += src->count;
+	dst->total_us += src->total_us;
+	if (src->max_us > dst->max_us)
+		dst->max_us = src->max_us;
+	for (b = 0; b < STATS_BUCKETS; b++)
+		dst->bucket[b] += src->bucket[b];
+}
+
+/*
+ * What was recorded into dst since src was copied from it. max_us
+ * stays that of dst, the maximum of an interval is not kept.
+ */
+void stats_hist_sub(stats_hist_t *dst, const stats_hist_t *src)
+{
+	unsigned int b;
+
+	dst->count -= src->count;
+	dst->total_us -= src->total_us;
+	for (b = 0; b < STATS_BUCKETS; b++)
+		dst->bucket[b] -= src->bucket[b];
+}
+
+void stats_merge(stm32_stats_t *dst, const stm32_stats_t *src)
+{
+	int i;
+
+	for (i = 0; i < 256; i++)
+	{
+		stats_hist_merge(&dst->cmd[i], &src->cmd[i]);
+		stats_hist_merge(&dst->ack[i], &src->ack[i]);
+	}
+	stats_hist_merge(&dst->port_read, &src->port_read);
+	stats_hist_merge(&dst->port_write, &src->port_write);
+
+	dst->bytes_tx	+= src->bytes_tx;
+	dst->bytes_rx	+= src->bytes_rx;
+	dst->reads		+= src->reads;
+	dst->writes		+= src->writes;
+	dst->timeouts	+= src->timeouts;
+	dst->busy		+= src->busy;
+	dst->nack		+= src->nack;
+	dst->retries	+= src->retries;
+}
+
+static void stats_hist_dump(FILE *f, const char *name, int op, const stats_hist_t *h)
+{
+	char label[16];
+
+	if (h->count == 0)
+		return;
+	if (op >= 0)
+		snprintf(label, sizeof(label), "%s 0x%02x", name, op);
+	else
+		snprintf(label, sizeof(label), "%s", name);
+
+	fprintf(f, "  %-12s %8u %10llu %8llu %8llu %8llu %8u\n", label, h->count,
+			(unsigned long long)(h->total_us / h->count),
+			(unsigned long long)stats_hist_percentile(h, 50),
+			(unsigned long long)stats_hist_percentile(h, 90),
+			(unsigned long long)stats_hist_percentile(h, 99),
+			h->max_us);
+}
+
+void stats_dump(const stm32_stats_t *st, FILE *f)
+{
+	int i;
+
+	fprintf(f, "Protocol statistics (latency in us):\n");
+	fprintf(f, "  %-12s %8s %10s %8s %8s %8s %8s\n",
+			"", "count", "mean", "p50", "p90", "p99", "max");
+	for (i = 0; i < 256; i++)
+		stats_hist_dump(f, "cmd", i, &st->cmd[i]);
+	for (i = 0; i < 256; i++)
+		stats_hist_dump(f, "ack", i, &st->ack[i]);
+	stats_hist_dump(f, "port read", -1, &st->port_read);
+	stats_hist_dump(f, "port write", -1, &st->port_write);
+
+	fprintf(f, "  tx %llu bytes in %u writes, rx %llu bytes in %u reads\n",
+			(unsigned long long)st->bytes_tx, st->writes,
+			(unsigned long long)st->bytes_rx, st->reads);
+	fprintf(f, "  busy %u, nack %u, retries %u, timeouts %u\n",
+			st->busy, st->nack, st->retries, st->timeouts);
+}
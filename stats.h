@@ -0,0 +1,75 @@
+/******************************************************************************
+ * protocol statistics
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Log-linear latency buckets in microseconds, HDR histogram style:
+ * every power of two is split into STATS_SUB_BUCKETS linear steps.
+ * Values up to 2^28 us (~4 min) are resolved to 25%, anything above
+ * lands in the last bucket. Recording never allocates.
+ */
+#define STATS_SUB_BITS		2
+#define STATS_SUB_BUCKETS	(1 << STATS_SUB_BITS)
+#define STATS_OCTAVES		26
+#define STATS_BUCKETS		((STATS_OCTAVES + 1) * STATS_SUB_BUCKETS)
+
+typedef struct stats_hist
+{
+	uint32_t	count;
+	uint32_t	max_us;
+	uint64_t	total_us;
+	uint32_t	bucket[STATS_BUCKETS];
+} stats_hist_t;
+
+typedef struct stm32_stats
+{
+	uint8_t			op;				/* opcode the next ACKs belong to */
+
+	stats_hist_t	cmd[256];		/* command byte sent until its ACK */
+	stats_hist_t	ack[256];		/* every ACK wait, by current opcode */
+	stats_hist_t	port_read;		/* time blocked in port->read() */
+	stats_hist_t	port_write;		/* time blocked in port->write() */
+
+	uint64_t		bytes_tx;
+	uint64_t		bytes_rx;
+	uint32_t		reads;
+	uint32_t		writes;
+	uint32_t		timeouts;		/* port reads that timed out */
+	uint32_t		busy;			/* 0x76 bytes while waiting for ACK */
+	uint32_t		nack;
+	uint32_t		retries;		/* resync, resend or read retry */
+} stm32_stats_t;
+
+uint64_t	stats_now_us(void);
+void		stats_hist_add(stats_hist_t *h, uint64_t us);
+uint64_t	stats_hist_percentile(const stats_hist_t *h, double p);
+void		stats_hist_merge(stats_hist_t *dst, const stats_hist_t *src);
+void		stats_hist_sub(stats_hist_t *dst, const stats_hist_t *src);
+void		stats_merge(stm32_stats_t *dst, const stm32_stats_t *src);
+void		stats_dump(const stm32_stats_t *st, FILE *f);
+
+#endif
@@ -27,6 +27,8 @@
 #include <time.h>
 #include "stm32.h"
 #include "parser.h"
+#include "trace.h"
+#include "log.h"
 
 #define STM32_ACK	0x79
 #define STM32_NACK	0x1F
@@ -52,7 +54,6 @@
 #define STM32_CMD_UR	0x92	/* readout unprotect */
 #define STM32_CMD_UR_NS	0x93	/* readout unprotect no-stretch */
 #define STM32_CMD_CRC	0xA1	/* compute CRC */
-#define STM32_CMD_ERR	0xFF	/* not a valid command */
 
 #define STM32_RESYNC_TIMEOUT	35	/* seconds */
 #define STM32_MASSERASE_TIMEOUT	35	/* seconds */
@@ -61,6 +62,10 @@
 #define STM32_WUNPROT_TIMEOUT	1	/* seconds */
 #define STM32_WPROT_TIMEOUT		1	/* seconds */
 #define STM32_RPROT_TIMEOUT		1	/* seconds */
+#define STM32_CRC_TIMEOUT		5	/* seconds */
+
+#define STM32_RESET_US			10000	/* NRST pulse */
+#define STM32_BOOT_US			50000	/* bootloader start-up after reset */
 
 #define STM32_CMD_GET_LENGTH	17	/* bytes in the reply */
 
@@ -82,54 +87,164 @@ static const uint32_t stm_reset_code_length = sizeof(stm_reset_code);
 
 extern const stm32_dev_t devices[];
 
+static port_t stm32_port_read(const stm32_struct_t *stm, void *buf, size_t nbyte)
+{
+	port_interface_t *port = stm->port;
+	stm32_stats_t *st = stm->stats;
+	port_t port_err;
+	uint64_t t0;
+
+	if (st == NULL)
+	{
+		port_err = port->read(port, buf, nbyte);
+		goto trace;
+	}
+
+	t0 = stats_now_us();
+	port_err = port->read(port, buf, nbyte);
+	stats_hist_add(&st->port_read, stats_now_us() - t0);
+	st->reads++;
+	if (port_err == PORT_OK)
+		st->bytes_rx += nbyte;
+	else if (port_err == PORT_ERR_TIMEDOUT)
+		st->timeouts++;
+trace:
+	if (port_err == PORT_OK)
+		trace_bytes(trace_chan(port), TRACE_RX, buf, nbyte);
+	else if (port_err == PORT_ERR_TIMEDOUT)
+		trace_event(trace_chan(port), TRACE_TIMEOUT, nbyte, 0);
+	return port_err;
+}
+
+static port_t stm32_port_write(const stm32_struct_t *stm, void *buf, size_t nbyte)
+{
+	port_interface_t *port = stm->port;
+	stm32_stats_t *st = stm->stats;
+	port_t port_err;
+	uint64_t t0;
+
+	trace_bytes(trace_chan(port), TRACE_TX, buf, nbyte);
+	if (st == NULL)
+		return port->write(port, buf, nbyte);
+
+	t0 = stats_now_us();
+	port_err = port->write(port, buf, nbyte);
+	stats_hist_add(&st->port_write, stats_now_us() - t0);
+	st->writes++;
+	if (port_err == PORT_OK)
+		st->bytes_tx += nbyte;
+	return port_err;
+}
+
+static port_t stm32_port_writev(const stm32_struct_t *stm, const struct iovec *iov, int iovcnt)
+{
+	port_interface_t *port = stm->port;
+	stm32_stats_t *st = stm->stats;
+	uint8_t head[TRACE_DATA_MAX];
+	size_t nbyte = 0, n;
+	port_t port_err;
+	uint64_t t0;
+	int i;
+
+	/* one event for the frame, with the bytes a trace keeps */
+	for (i = 0; i < iovcnt; i++)
+	{
+		n = nbyte < sizeof(head) ? sizeof(head) - nbyte : 0;
+		if (n > iov[i].iov_len)
+			n = iov[i].iov_len;
+		if (n)
+			memcpy(head + nbyte, iov[i].iov_base, n);
+		nbyte += iov[i].iov_len;
+	}
+	trace_bytes(trace_chan(port), TRACE_TX, head, nbyte);
+	if (st == NULL)
+		return port_writev(port, iov, iovcnt);
+
+	t0 = stats_now_us();
+	port_err = port_writev(port, iov, iovcnt);
+	stats_hist_add(&st->port_write, stats_now_us() - t0);
+	st->writes++;
+	if (port_err == PORT_OK)
+		st->bytes_tx += nbyte;
+	return port_err;
+}
+
 void stm32_warn_stretching(const char *f)
 {
-	fprintf(stderr, "Attention !!!\n");
-	fprintf(stderr, "\tThis %s error could be caused by your I2C\n", f);
-	fprintf(stderr, "\tcontroller not accepting \"clock stretching\"\n");
-	fprintf(stderr, "\tas required by bootloader.\n");
-	fprintf(stderr, "\tCheck \"I2C.txt\" in stm32flash source code.\n");
+	log_msg(LOG_LVL_WARN, "stm32", "Attention !!!");
+	log_msg(LOG_LVL_WARN, "stm32", "\tThis %s error could be caused by your I2C", f);
+	log_msg(LOG_LVL_WARN, "stm32", "\tcontroller not accepting \"clock stretching\"");
+	log_msg(LOG_LVL_WARN, "stm32", "\tas required by bootloader.");
+	log_msg(LOG_LVL_WARN, "stm32", "\tCheck \"I2C.txt\" in stm32flash source code.");
 }
 
 stm32_t stm32_get_ack_timeout(const stm32_struct_t *stm, time_t timeout)
 {
 	port_interface_t *port = stm->port;
+	stm32_stats_t *st = stm->stats;
 	uint8_t byte;
 	port_t port_err;
+	stm32_t stm_err;
 	time_t t0, t1;
+	uint64_t start = 0;
 
 	if (!(port->flags & PORT_RETRY))
 		timeout = 0;
 
 	if (timeout)
 		time(&t0);
+	if (st)
+		start = stats_now_us();
 
 	do 
 	{
-		port_err = port->read(port, &byte, 1);
+		port_err = stm32_port_read(stm, &byte, 1);
 		if (port_err == PORT_ERR_TIMEDOUT && timeout) 
 		{
 			time(&t1);
 			if (t1 < t0 + timeout)
+			{
+				if (st)
+					st->retries++;
 				continue;
+			}
 		}
 
 		if (port_err != PORT_OK) 
 		{
-			fprintf(stderr, "Failed to read ACK byte\n");
-			return STM32_ERR_UNKNOWN;
+			log_msg(LOG_LVL_ERROR, "stm32", "Failed to read ACK byte");
+			stm_err = STM32_ERR_UNKNOWN;
+			break;
 		}
 
 		if (byte == STM32_ACK)
-			return STM32_OK;
+		{
+			trace_event(trace_chan(port), TRACE_ACK, 0, 0);
+			stm_err = STM32_OK;
+			break;
+		}
 		if (byte == STM32_NACK)
-			return STM32_ERR_NACK;
+		{
+			trace_event(trace_chan(port), TRACE_NACK, 0, 0);
+			if (st)
+				st->nack++;
+			stm_err = STM32_ERR_NACK;
+			break;
+		}
 		if (byte != STM32_BUSY) 
 		{
-			fprintf(stderr, "Got byte 0x%02x instead of ACK\n", byte);
-			return STM32_ERR_UNKNOWN;
+			log_msg(LOG_LVL_ERROR, "stm32", "Got byte 0x%02x instead of ACK", byte);
+			stm_err = STM32_ERR_UNKNOWN;
+			break;
 		}
+		trace_event(trace_chan(port), TRACE_BUSY, 0, 0);
+		if (st)
+			st->busy++;
 	} while (1);
+
+	if (st)
+		stats_hist_add(&st->ack[st->op], stats_now_us() - start);
+	return stm_err;
 }
 
 stm32_t stm32_get_ack(const stm32_struct_t *stm)
@@ -139,26 +254,37 @@ stm32_t stm32_get_ack(const stm32_struct_t *stm)
 
 stm32_t stm32_send_command_timeout(const stm32_struct_t *stm, const uint8_t cmd, time_t timeout)
 {
-	port_interface_t *port = stm->port;
+	stm32_stats_t *st = stm->stats;
 	stm32_t stm_err;
 	port_t port_err;
 	uint8_t buf[2];
+	uint64_t start;
+
+	start = stats_now_us();
+	if (st)
+		st->op = cmd;
 
 	buf[0] = cmd;
 	buf[1] = cmd ^ 0xFF;
-	port_err = port->write(port, buf, 2);
+	port_err = stm32_port_write(stm, buf, 2);
 	if (port_err != PORT_OK) 
 	{
-		fprintf(stderr, "Failed to send command\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Failed to send command");
 		return STM32_ERR_UNKNOWN;
 	}
 	stm_err = stm32_get_ack_timeout(stm, timeout);
+	trace_event(trace_chan(stm->port), TRACE_CMD, cmd, start);
+	if (st)
+		stats_hist_add(&st->cmd[cmd], stats_now_us() - start);
+	log_msg(LOG_LVL_DEBUG, "stm32", "cmd 0x%02x: %s after %u us", cmd,
+			stm_err == STM32_OK ? "ACK" : stm_err == STM32_ERR_NACK ? "NACK" : "no reply",
+			(unsigned int)(stats_now_us() - start));
 	if (stm_err == STM32_OK)
 		return STM32_OK;
 	if (stm_err == STM32_ERR_NACK)
-		fprintf(stderr, "Got NACK from device on command 0x%02x\n", cmd);
+		log_msg(LOG_LVL_ERROR, "stm32", "Got NACK from device on command 0x%02x", cmd);
 	else
-		fprintf(stderr, "Unexpected reply from device on command 0x%02x\n", cmd);
+		log_msg(LOG_LVL_ERROR, "stm32", "Unexpected reply from device on command 0x%02x", cmd);
 	return STM32_ERR_UNKNOWN;
 }
 
@@ -170,13 +296,13 @@ stm32_t stm32_send_command(const stm32_struct_t *stm, const uint8_t cmd)
 void stm32_close (stm32_struct_t *stm)
 {
 	assert (stm != NULL);
+	free (stm -> stats);
 	free (stm -> cmd);
 	free (stm);
 }
 
-stm32_t stm32_resync(const stm32_struct_t *stm)
+stm32_t stm32_resync_timeout(const stm32_struct_t *stm, time_t timeout)
 {
-	port_interface_t *port = stm->port;
 	port_t port_err;
 	uint8_t buf[2], ack;
 	time_t t0, t1;
@@ -186,16 +312,18 @@ stm32_t stm32_resync(const stm32_struct_t *stm)
 
 	buf[0] = STM32_CMD_ERR;
 	buf[1] = STM32_CMD_ERR ^ 0xFF;
-	while (t1 < t0 + STM32_RESYNC_TIMEOUT) 
+	while (t1 < t0 + timeout) 
 	{
-		if ((port_err = port->write(port, buf, 2)) != PORT_OK)
+		if (stm->stats)
+			stm->stats->retries++;
+		if ((port_err = stm32_port_write(stm, buf, 2)) != PORT_OK)
 		{
 			usleep(500000);
 			time(&t1);
 			continue;
 		}
 		
-		if ((port_err = port->read(port, &ack, 1)) != PORT_OK)
+		if ((port_err = stm32_port_read(stm, &ack, 1)) != PORT_OK)
 		{
 			time(&t1);
 			continue;
@@ -207,6 +335,11 @@ stm32_t stm32_resync(const stm32_struct_t *stm)
 	return STM32_ERR_UNKNOWN;
 }
 
+stm32_t stm32_resync(const stm32_struct_t *stm)
+{
+	return stm32_resync_timeout(stm, STM32_RESYNC_TIMEOUT);
+}
+
 stm32_t stm32_guess_len_cmd(const stm32_struct_t *stm, uint8_t cmd, uint8_t *data, unsigned int len)
 {
 	port_interface_t *port = stm->port;
@@ -217,16 +350,16 @@ stm32_t stm32_guess_len_cmd(const stm32_struct_t *stm, uint8_t cmd, uint8_t *dat
 	if (port->flags & PORT_BYTE) 
 	{
 		/* interface is UART-like */
-		if ((port_err = port->read(port, data, 1)) != PORT_OK)
+		if ((port_err = stm32_port_read(stm, data, 1)) != PORT_OK)
 			return STM32_ERR_UNKNOWN;
 
 		len = data[0];
-		if ((port_err = port->read(port, data + 1, len + 1)) != PORT_OK)
+		if ((port_err = stm32_port_read(stm, data + 1, len + 1)) != PORT_OK)
 			return STM32_ERR_UNKNOWN;
 		return STM32_OK;
 	}
 
-	port_err = port->read(port, data, len + 2);
+	port_err = stm32_port_read(stm, data, len + 2);
 	if (port_err == PORT_OK && len == data[0])
 		return STM32_OK;
 	if (port_err != PORT_OK) 
@@ -236,12 +369,14 @@ stm32_t stm32_guess_len_cmd(const stm32_struct_t *stm, uint8_t cmd, uint8_t *dat
 			return STM32_ERR_UNKNOWN;
 		if (stm32_send_command(stm, cmd) != STM32_OK)
 			return STM32_ERR_UNKNOWN;
-		port_err = port->read(port, data, 1);
+		port_err = stm32_port_read(stm, data, 1);
 		if (port_err != PORT_OK)
 			return STM32_ERR_UNKNOWN;
 	}
 
-	fprintf(stderr, "Re sync (len = %d)\n", data[0]);
+	log_msg(LOG_LVL_WARN, "stm32", "Re sync (len = %d)", data[0]);
+	if (stm->stats)
+		stm->stats->retries++;
 	if (stm32_resync(stm) != STM32_OK)
 		return STM32_ERR_UNKNOWN;
 
@@ -249,7 +384,7 @@ stm32_t stm32_guess_len_cmd(const stm32_struct_t *stm, uint8_t cmd, uint8_t *dat
 	if (stm32_send_command(stm, cmd) != STM32_OK)
 		return STM32_ERR_UNKNOWN;
 	
-	port_err = port->read(port, data, len + 2);
+	port_err = stm32_port_read(stm, data, len + 2);
 	if (port_err != PORT_OK)
 		return STM32_ERR_UNKNOWN;
 	return STM32_OK;
@@ -257,28 +392,27 @@ stm32_t stm32_guess_len_cmd(const stm32_struct_t *stm, uint8_t cmd, uint8_t *dat
 
 stm32_t stm32_send_init_seq(const stm32_struct_t *stm)
 {
-	port_interface_t *port = stm->port;
 	port_t port_err;
 	uint8_t byte, cmd = STM32_CMD_INIT;
 
-	if ((port_err = port->write(port, &cmd, 1)) != PORT_OK)
+	if ((port_err = stm32_port_write(stm, &cmd, 1)) != PORT_OK)
 	{
-		fprintf(stderr, "Failed to send init to device\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Failed to send init to device");
 		return STM32_ERR_UNKNOWN;
 	}
 
-	port_err = port->read(port, &byte, 1);
+	port_err = stm32_port_read(stm, &byte, 1);
 	if (port_err == PORT_OK && byte == STM32_ACK)
 		return STM32_OK;
 	if (port_err == PORT_OK && byte == STM32_NACK) 
 	{
 		/* We could get error later, but let's continue, for now. */
-		fprintf(stderr,	"Warning: the interface was not closed properly.\n");
+		log_msg(LOG_LVL_WARN, "stm32", "Warning: the interface was not closed properly.");
 		return STM32_OK;
 	}
 	if (port_err != PORT_ERR_TIMEDOUT) 
 	{
-		fprintf(stderr, "Failed to init device.\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Failed to init device.");
 		return STM32_ERR_UNKNOWN;
 	}
 
@@ -286,17 +420,17 @@ stm32_t stm32_send_init_seq(const stm32_struct_t *stm)
 	 * Check if previous STM32_CMD_INIT was taken as first byte
 	 * of a command. Send a new byte, we should get back a NACK.
 	 */
-	if ((port_err = port->write(port, &cmd, 1)) != PORT_OK)
+	if ((port_err = stm32_port_write(stm, &cmd, 1)) != PORT_OK)
 	{
-		fprintf(stderr, "Failed to send init to device\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Failed to send init to device");
 		return STM32_ERR_UNKNOWN;
 	}
 
-	port_err = port->read(port, &byte, 1);
+	port_err = stm32_port_read(stm, &byte, 1);
 	if (port_err == PORT_OK && byte == STM32_NACK)
 		return STM32_OK;
 	
-	fprintf(stderr, "Failed to init device.\n");
+	log_msg(LOG_LVL_ERROR, "stm32", "Failed to init device.");
 	return STM32_ERR_UNKNOWN;
 }
 
@@ -305,55 +439,48 @@ stm32_t stm32_send_init_seq(const stm32_struct_t *stm)
 			? (a) \
 			: (((prev) > (a)) ? (prev) : (a)))
 
-stm32_struct_t* stm32_init (port_interface_t *port)
+/* decode the reply of GID, buf[0] is the number of bytes - 1 */
+stm32_t stm32_parse_pid(stm32_struct_t *stm, const uint8_t *buf)
 {
-	uint8_t len, val, buf[256];
-	stm32_struct_t *stm;
-	int i, new_cmds;
-
-	stm = (stm32_struct_t*)calloc (1, sizeof (stm32_struct_t));
-	assert (stm != NULL);
+	char extra[3 * 256 + 1];
+	uint8_t len;
+	int i, n;
 
-	stm -> cmd = (stm32_cmd_t*) malloc (sizeof (stm32_cmd_t));
-	assert (stm -> cmd != NULL);
-	memset (stm -> cmd, STM32_CMD_ERR, sizeof (stm32_cmd_t));
-	stm -> port = port;
-
-	if(port -> flags & PORT_CMD_INIT)
-		if ( stm32_send_init_seq (stm) != STM32_OK)
-			return NULL;
-
-	if (stm32_send_command (stm, STM32_CMD_GVR) != STM32_OK)
+	len = buf[0] + 1;
+	if (len < 2)
 	{
-		stm32_close (stm);
-		return NULL;
+		log_msg(LOG_LVL_ERROR, "stm32", "Only %d bytes sent in the PID, unknown/unsupported device", len);
+		return STM32_ERR_UNKNOWN;
 	}
-
-	/* From AN, only UART bootloader returns 3 bytes */
-	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
-	if (port->read(port, buf, len) != PORT_OK)
-		return NULL;
-	stm->version = buf[0];
-	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
-	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
-	if (stm32_get_ack(stm) != STM32_OK) 
+	stm->pid = (buf[1] << 8) | buf[2];
+	if (len > 2) 
 	{
-		stm32_close(stm);
-		return NULL;
+		for (i = 2, n = 0; i <= len ; i++)
+			n += snprintf(extra + n, sizeof(extra) - n, " %02x", buf[i]);
+		log_msg(LOG_LVL_INFO, "stm32", "This bootloader returns %d extra bytes in PID:%s", len, extra);
 	}
+	return STM32_OK;
+}
 
-	/* get the bootloader information */
-	len = STM32_CMD_GET_LENGTH;
-	if (port->cmd_get_reply)
-		for (i = 0; port->cmd_get_reply[i].length; i++)
-			if (stm->version == port->cmd_get_reply[i].version) 
-			{
-				len = port->cmd_get_reply[i].length;
-				break;
-			}
+static stm32_t stm32_read_pid(stm32_struct_t *stm, uint8_t cmd)
+{
+	uint8_t buf[256];
+
+	if (stm32_guess_len_cmd(stm, cmd, buf, 1) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_parse_pid(stm, buf) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	return stm32_get_ack(stm);
+}
+
+/* decode the reply of GET, buf[0] is the number of bytes - 1 */
+stm32_t stm32_parse_get(stm32_struct_t *stm, const uint8_t *buf)
+{
+	uint8_t len, val;
+	char unknown[128];
+	size_t unknown_len = 0;
+	int i, new_cmds;
 
-	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_OK)
-		return NULL;
 	len = buf[0] + 1;
 	stm->bl_version = buf[1];
 	new_cmds = 0;
@@ -407,75 +534,389 @@ stm32_struct_t* stm32_init (port_interface_t *port)
 				(stm -> cmd) -> crc = newer(stm->cmd->crc, val);
 				break;
 			default:
-				if (new_cmds++ == 0)
-					fprintf(stderr,	"GET returns unknown commands (0x%2x", val);
-				else
-					fprintf(stderr, ", 0x%2x", val);
+				if (unknown_len < sizeof(unknown) - 8)
+					unknown_len += snprintf(unknown + unknown_len, sizeof(unknown) - unknown_len,
+											"%s0x%2x", new_cmds++ ? ", " : "", val);
 		}
 	}
-	if (new_cmds)	fprintf(stderr, ")\n");
+	if (new_cmds)
+		log_msg(LOG_LVL_INFO, "stm32", "GET returns unknown commands (%s)", unknown);
+
+	if (stm->cmd->get == STM32_CMD_ERR
+	    || stm->cmd->gvr == STM32_CMD_ERR
+	    || stm->cmd->gid == STM32_CMD_ERR)
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: bootloader did not returned correct information from GET command");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_OK;
+}
+
+/* read the self-describing reply of GET/GID: one length byte, then len + 1 bytes */
+static stm32_t stm32_read_varlen(const stm32_struct_t *stm, uint8_t *buf)
+{
+
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_port_read(stm, buf, 1) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_port_read(stm, buf + 1, buf[0] + 1) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	return stm32_get_ack(stm);
+}
+
+/*
+ * Queue GVR, GET and GID back-to-back and parse the combined reply stream.
+ * Only for byte-oriented ports, where every reply length is known or
+ * self-describing. GID is always 0x02 in AN3155, so it can be sent before
+ * the GET reply confirms it.
+ */
+static stm32_t stm32_pipelined_handshake(stm32_struct_t *stm)
+{
+	port_interface_t *port = stm->port;
+	uint8_t len, buf[257];
+	uint8_t cmds[] = {
+		STM32_CMD_GVR, STM32_CMD_GVR ^ 0xFF,
+		STM32_CMD_GET, STM32_CMD_GET ^ 0xFF,
+		STM32_CMD_GID, STM32_CMD_GID ^ 0xFF,
+	};
+
+	if (stm32_port_write(stm, cmds, sizeof(cmds)) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+
+	/* GVR */
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
+	if (stm32_port_read(stm, buf, len) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	stm->version = buf[0];
+	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
+	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
 
+	/* GET */
+	if (stm32_read_varlen(stm, buf) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_parse_get(stm, buf) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm->cmd->gid != STM32_CMD_GID)
+		return STM32_ERR_UNKNOWN;
+
+	/* GID */
+	if (stm32_read_varlen(stm, buf) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	return stm32_parse_pid(stm, buf);
+}
+
+/* discard whatever is left of a broken reply stream */
+void stm32_drain(const stm32_struct_t *stm)
+{
+	uint8_t byte;
+
+	while (stm32_port_read(stm, &byte, 1) == PORT_OK)
+		;
+}
+
+stm32_t stm32_find_dev(stm32_struct_t *stm)
+{
+	stm->dev = devices;
+	while (stm->dev->id != 0x00 && stm->dev->id != stm->pid)
+		++stm->dev;
+
+	if (!stm->dev->id) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Unknown/unsupported device (Device ID: 0x%03x)", stm->pid);
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_OK;
+}
+
+/*
+ * Reset the target into the bootloader through the modem lines, as most
+ * flashing adapters are wired: RTS drives BOOT0 high and DTR holds NRST
+ * low while asserted. This is the only way to make the bootloader
+ * detect a new baud rate.
+ */
+static stm32_t stm32_enter_bootloader(port_interface_t *port)
+{
+	if (port->gpio(port, GPIO_RTS, 1) != PORT_OK
+	    || port->gpio(port, GPIO_DTR, 1) != PORT_OK)
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Failed to reset the device");
+		return STM32_ERR_UNKNOWN;
+	}
+	usleep(STM32_RESET_US);
+	port->gpio(port, GPIO_DTR, 0);
+	usleep(STM32_BOOT_US);
+	return STM32_OK;
+}
+
+/* a descriptor with no command known yet, release it with stm32_close() */
+stm32_struct_t* stm32_alloc (port_interface_t *port)
+{
+	stm32_struct_t *stm;
+
+	stm = (stm32_struct_t*)calloc (1, sizeof (stm32_struct_t));
+	assert (stm != NULL);
+
+	stm -> cmd = (stm32_cmd_t*) malloc (sizeof (stm32_cmd_t));
+	assert (stm -> cmd != NULL);
+	memset (stm -> cmd, STM32_CMD_ERR, sizeof (stm32_cmd_t));
+	stm -> stats = (stm32_stats_t*) calloc (1, sizeof (stm32_stats_t));
+	stm -> port = port;
+	return stm;
+}
+
+stm32_struct_t* stm32_init (port_interface_t *port, unsigned int flags)
+{
+	uint8_t len, buf[256];
+	stm32_struct_t *stm;
+	int i;
+
+	stm = stm32_alloc (port);
+
+	if ((flags & STM32_INIT_RESET) && stm32_enter_bootloader (port) != STM32_OK)
+	{
+		stm32_close (stm);
+		return NULL;
+	}
+
+	if(port -> flags & PORT_CMD_INIT)
+		if ( stm32_send_init_seq (stm) != STM32_OK)
+		{
+			stm32_close (stm);
+			return NULL;
+		}
+
+	if ((flags & STM32_INIT_PIPELINE) && (port -> flags & PORT_BYTE))
+	{
+		if (stm32_pipelined_handshake (stm) == STM32_OK)
+			goto found;
+
+		/* fall back to the one-by-one sequence */
+		log_msg(LOG_LVL_WARN, "stm32", "Pipelined handshake failed, retrying step by step");
+		stm32_drain (stm);
+		if (stm32_resync (stm) != STM32_OK)
+		{
+			stm32_close (stm);
+			return NULL;
+		}
+		memset (stm -> cmd, STM32_CMD_ERR, sizeof (stm32_cmd_t));
+	}
+
+	if (stm32_send_command (stm, STM32_CMD_GVR) != STM32_OK)
+	{
+		stm32_close (stm);
+		return NULL;
+	}
+
+	/* From AN, only UART bootloader returns 3 bytes */
+	len = (port->flags & PORT_GVR_ETX) ? 3 : 1;
+	if (stm32_port_read(stm, buf, len) != PORT_OK)
+	{
+		stm32_close(stm);
+		return NULL;
+	}
+	stm->version = buf[0];
+	stm->option1 = (port->flags & PORT_GVR_ETX) ? buf[1] : 0;
+	stm->option2 = (port->flags & PORT_GVR_ETX) ? buf[2] : 0;
 	if (stm32_get_ack(stm) != STM32_OK) 
 	{
 		stm32_close(stm);
 		return NULL;
 	}
 
-	if (stm->cmd->get == STM32_CMD_ERR
-	    || stm->cmd->gvr == STM32_CMD_ERR
-	    || stm->cmd->gid == STM32_CMD_ERR)
+	/* get the bootloader information */
+	len = STM32_CMD_GET_LENGTH;
+	if (port->cmd_get_reply)
+		for (i = 0; port->cmd_get_reply[i].length; i++)
+			if (stm->version == port->cmd_get_reply[i].version) 
+			{
+				len = port->cmd_get_reply[i].length;
+				break;
+			}
+
+	if (stm32_guess_len_cmd(stm, STM32_CMD_GET, buf, len) != STM32_OK
+	    || stm32_parse_get(stm, buf) != STM32_OK)
 	{
-		fprintf(stderr, "Error: bootloader did not returned correct information from GET command\n");
+		stm32_close(stm);
 		return NULL;
 	}
 
-	/* get the device ID */
-	if (stm32_guess_len_cmd(stm, stm->cmd->gid, buf, 1) != STM32_OK)
+	if (stm32_get_ack(stm) != STM32_OK) 
 	{
 		stm32_close(stm);
 		return NULL;
 	}
 
-	len = buf[0] + 1;
-	if (len < 2)
+	/* get the device ID */
+	if (stm32_read_pid(stm, stm->cmd->gid) != STM32_OK)
 	{
 		stm32_close(stm);
-		fprintf(stderr, "Only %d bytes sent in the PID, unknown/unsupported device\n", len);
 		return NULL;
 	}
-	stm->pid = (buf[1] << 8) | buf[2];
-	if (len > 2) 
+
+found:
+	if (stm32_find_dev(stm) != STM32_OK)
 	{
-		fprintf(stderr, "This bootloader returns %d extra bytes in PID:", len);
-		for (i = 2; i <= len ; i++)
-			fprintf(stderr, " %02x", buf[i]);
-		fprintf(stderr, "\n");
+		stm32_close(stm);
+		return NULL;
 	}
-	if (stm32_get_ack(stm) != STM32_OK) 
+
+	return stm;
+}
+
+/*
+ * Reconnect to a bootloader whose capabilities are already known, e.g.
+ * after the device reset itself at the end of a write/readout unprotect,
+ * or when the same board is reused by a later operation.
+ * Only INIT and GID are exchanged; GVR/GET results are copied from the
+ * cached descriptor. Returns NULL if the device does not answer or if it
+ * reports a different PID, in which case a full stm32_init() is needed.
+ */
+stm32_struct_t* stm32_reconnect (port_interface_t *port, const stm32_struct_t *cached)
+{
+	stm32_struct_t *stm;
+
+	stm = stm32_alloc (port);
+	memcpy (stm -> cmd, cached -> cmd, sizeof (stm32_cmd_t));
+
+	if(port -> flags & PORT_CMD_INIT)
+		if ( stm32_send_init_seq (stm) != STM32_OK)
+		{
+			stm32_close (stm);
+			return NULL;
+		}
+
+	if (stm32_read_pid(stm, stm->cmd->gid) != STM32_OK)
 	{
 		stm32_close(stm);
 		return NULL;
 	}
 
-	stm->dev = devices;
-	while (stm->dev->id != 0x00 && stm->dev->id != stm->pid)
-		++stm->dev;
-
-	if (!stm->dev->id) 
+	if (stm->pid != cached->pid)
 	{
-		fprintf(stderr, "Unknown/unsupported device (Device ID: 0x%03x)\n", stm->pid);
+		log_msg(LOG_LVL_WARN, "stm32", "Device changed (Device ID: 0x%03x, expected 0x%03x)", stm->pid, cached->pid);
 		stm32_close(stm);
 		return NULL;
 	}
 
+	stm->bl_version	= cached->bl_version;
+	stm->version	= cached->version;
+	stm->option1	= cached->option1;
+	stm->option2	= cached->option2;
+	stm->dev		= cached->dev;
 	return stm;
 }
 
+/* check that the bootloader is still listening and is the same device */
+stm32_t stm32_ping(const stm32_struct_t *stm)
+{
+	stm32_struct_t probe = *stm;
+
+	if (stm32_read_pid(&probe, stm->cmd->gid) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+	if (probe.pid != stm->pid)
+		return STM32_ERR_UNKNOWN;
+	return STM32_OK;
+}
+
+/* copy the counters of a live session, e.g. for a progress display */
+void stm32_stats_snapshot(const stm32_struct_t *stm, stm32_stats_t *out)
+{
+	if (stm->stats)
+		memcpy(out, stm->stats, sizeof(stm32_stats_t));
+	else
+		memset(out, 0, sizeof(stm32_stats_t));
+}
+
+/* 32 bit value MSB first and its XOR checksum, as addresses are sent */
+void stm32_frame_u32(uint32_t value, uint8_t *buf)
+{
+	buf[0] = value >> 24;
+	buf[1] = (value >> 16) & 0xFF;
+	buf[2] = (value >> 8) & 0xFF;
+	buf[3] = value & 0xFF;
+	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
+}
+
+/*
+ * Data frame of the write memory command: length - 1, the data padded
+ * with 0xFF to a whole word, and the checksum. Returns the frame length.
+ */
+unsigned int stm32_frame_data(const uint8_t *data, unsigned int len, uint8_t *buf)
+{
+	unsigned int i, aligned_len;
+	uint8_t cs;
+
+	aligned_len = (len + 3) & ~3;
+	cs = aligned_len - 1;
+	buf[0] = aligned_len - 1;
+	for (i = 0; i < len; i++) 
+	{
+		cs ^= data[i];
+		buf[i + 1] = data[i];
+	}
+	/* padding data */
+	for (i = len; i < aligned_len; i++)
+	{
+		cs ^= 0xFF;
+		buf[i + 1] = 0xFF;
+	}
+	buf[aligned_len + 1] = cs;
+	return aligned_len + 2;
+}
+
+stm32_t stm32_read_memory(const stm32_struct_t *stm, uint32_t address, uint8_t data[], unsigned int len)
+{
+	uint8_t buf[5];
+
+	if (!len)
+		return STM32_OK;
+
+	if (len > 256) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: READ length limit at 256 bytes");
+		return STM32_ERR_UNKNOWN;
+	}
+
+	if (stm->cmd->rm == STM32_CMD_ERR) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: READ command not implemented in bootloader.");
+		return STM32_ERR_NO_CMD;
+	}
+
+	log_msg(LOG_LVL_DEBUG, "stm32", "read 0x%08x, %u bytes", address, len);
+	if (stm32_send_command(stm, stm->cmd->rm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	stm32_frame_u32(address, buf);
+	if (stm32_port_write(stm, buf, 5) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	/* length - 1 and its complement */
+	buf[0] = len - 1;
+	buf[1] = buf[0] ^ 0xFF;
+	if (stm32_port_write(stm, buf, 2) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	if (stm32_port_read(stm, data, len) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	return STM32_OK;
+}
+
 stm32_t stm32_write_memory(const stm32_struct_t *stm, uint32_t address, const uint8_t data[], unsigned int len)
 {
 	port_interface_t *port = stm->port;
-	uint8_t cs, buf[256 + 2];
+	uint8_t buf[5], tail[4], cs;
 	unsigned int i, aligned_len;
+	struct iovec iov[3];
 	stm32_t stm_err;
 
 	if (!len)
@@ -483,53 +924,55 @@ stm32_t stm32_write_memory(const stm32_struct_t *stm, uint32_t address, const ui
 
 	if (len > 256) 
 	{
-		fprintf(stderr, "Error: READ length limit at 256 bytes\n");
-		return STM32_ERR_UNKNOWN;
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: WRITE length limit at 256 bytes");
+		return STM32_ERR_PARAM;
 	}
 
-	/* must be 32bit aligned */
-	if (address & 0x3 || len & 0x3) 
+	/* must be 32bit aligned, a short last word is padded below */
+	if (address & 0x3) 
 	{
-		fprintf(stderr, "Error: WRITE address and length must be 4 byte aligned\n");
-		return STM32_ERR_UNKNOWN;
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: WRITE address must be 4 byte aligned");
+		return STM32_ERR_PARAM;
 	}
 
 	if (stm->cmd->wm == STM32_CMD_ERR)
 	{
-		fprintf(stderr, "Error: WRITE command not implemented in bootloader.\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: WRITE command not implemented in bootloader.");
 		return STM32_ERR_NO_CMD;
 	}
 
+	log_msg(LOG_LVL_DEBUG, "stm32", "write 0x%08x, %u bytes", address, len);
 	/* send the address and checksum */
 	if (stm32_send_command(stm, stm->cmd->wm) != STM32_OK)
 		return STM32_ERR_UNKNOWN;
 
-	buf[0] = address >> 24;
-	buf[1] = (address >> 16) & 0xFF;
-	buf[2] = (address >> 8) & 0xFF;
-	buf[3] = address & 0xFF;
-	buf[4] = buf[0] ^ buf[1] ^ buf[2] ^ buf[3];
-	if (port->write(port, buf, 5) != PORT_OK)
+	stm32_frame_u32(address, buf);
+	if (stm32_port_write(stm, buf, 5) != PORT_OK)
 		return STM32_ERR_UNKNOWN;
 	if (stm32_get_ack(stm) != STM32_OK)
 		return STM32_ERR_UNKNOWN;
 
+	/*
+	 * length - 1, the data straight from the caller, then 0xFF up to a
+	 * whole word and the checksum, as stm32_frame_data() builds it
+	 */
 	aligned_len = (len + 3) & ~3;
-	cs = aligned_len - 1;
 	buf[0] = aligned_len - 1;
-	for (i = 0; i < len; i++) 
-	{
+	for (i = 0, cs = buf[0]; i < len; i++)
 		cs ^= data[i];
-		buf[i + 1] = data[i];
-	}
-	/* padding data */
-	for (i = len; i < aligned_len; i++)
+	for (i = 0; i < aligned_len - len; i++)
 	{
+		tail[i] = 0xFF;
 		cs ^= 0xFF;
-		buf[i + 1] = 0xFF;
 	}
-	buf[aligned_len + 1] = cs;
-	if (port->write(port, buf, aligned_len + 2) != PORT_OK)
+	tail[i++] = cs;
+	iov[0].iov_base = &buf[0];
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	iov[2].iov_base = tail;
+	iov[2].iov_len = i;
+	if (stm32_port_writev(stm, iov, 3) != PORT_OK)
 		return STM32_ERR_UNKNOWN;
 
 	stm_err = stm32_get_ack_timeout(stm, STM32_BLKWRITE_TIMEOUT);
@@ -543,160 +986,366 @@ stm32_t stm32_write_memory(const stm32_struct_t *stm, uint32_t address, const ui
 	return STM32_OK;
 }
 
+/*
+ * Parameter frame of the erase command reported by the bootloader, for
+ * pages from spage on, 0xFF pages for a mass erase. The erase command is
+ * either 0x43, or 0x44 (Extended Erase, two bytes per page number); 0x45
+ * is the clock no-stretching version of Extended Erase for I2C ports.
+ * Returns the frame length and how long the erase may take.
+ */
+unsigned int stm32_frame_erase(const stm32_struct_t *stm, uint8_t spage, uint8_t pages,
+							   uint8_t *buf, time_t *timeout)
+{
+	uint16_t pg_num;
+	uint8_t cs = 0;
+	int i = 0;
+
+	if (stm->cmd->er == STM32_CMD_ER)
+	{
+		*timeout = STM32_MASSERASE_TIMEOUT;
+		if (pages == 0xFF)
+		{
+			buf[0] = 0xFF;
+			buf[1] = 0x00;
+			return 2;
+		}
+
+		buf[i++] = pages - 1;
+		cs ^= (pages-1);
+		for (pg_num = spage; pg_num < (pages + spage); pg_num++)
+		{
+			buf[i++] = pg_num;
+			cs ^= pg_num;
+		}
+		buf[i++] = cs;
+		return i;
+	}
+
+	/* Not all chips using Extended Erase support mass erase */
+	/* Currently known as not supporting mass erase is the Ultra Low Power STM32L15xx range */
+	/* So if someone has not overridden the default, but uses one of these chips, take it out of */
+	/* mass erase mode, so it will be done page by page. This maximum might not be correct either! */
+	if (stm->pid == 0x416 && pages == 0xFF)
+		pages = 0xF8; /* works for the STM32L152RB with 128Kb flash */
+
+	if (pages == 0xFF) 
+	{
+		/* 0xFFFF the magic number for mass erase */
+		*timeout = STM32_MASSERASE_TIMEOUT;
+		buf[0] = 0xFF;
+		buf[1] = 0xFF;
+		buf[2] = 0x00;	/* checksum */
+		return 3;
+	}
+
+	/* Number of pages to be erased - 1, two bytes, MSB first */
+	*timeout = STM32_SECTERASE_TIMEOUT;
+	buf[i++] = (pages - 1) >> 8;
+	buf[i++] = (pages - 1) & 0xFF;
+	cs = buf[0] ^ buf[1];
+	for (pg_num = spage; pg_num < spage + pages; pg_num++)
+	{
+		buf[i] = pg_num >> 8;
+		cs ^= buf[i++];
+		buf[i] = pg_num & 0xFF;
+		cs ^= buf[i++];
+	}
+	buf[i++] = cs;
+	return i;
+}
+
 stm32_t stm32_erase_memory(const stm32_struct_t *stm, uint8_t spage, uint8_t pages)
 {
 	port_interface_t *port = stm->port;
+	uint8_t buf[STM32_MAX_ERASE_FRAME];
+	unsigned int len;
+	time_t timeout;
 	stm32_t stm_err;
-	port_t port_err;
 
 	if (!pages)
 		return STM32_OK;
 
 	if (stm->cmd->er == STM32_CMD_ERR) 
 	{
-		fprintf(stderr, "Error: ERASE command not implemented in bootloader.\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: ERASE command not implemented in bootloader.");
 		return STM32_ERR_NO_CMD;
 	}
 
 	if (stm32_send_command(stm, stm->cmd->er) != STM32_OK) 
 	{
-		fprintf(stderr, "Can't initiate chip erase!\n");
+		log_msg(LOG_LVL_ERROR, "stm32", "Can't initiate chip erase!");
 		return STM32_ERR_UNKNOWN;
 	}
 
-	/* The erase command reported by the bootloader is either 0x43, 0x44 or 0x45 */
-	/* 0x44 is Extended Erase, a 2 byte based protocol and needs to be handled differently. */
-	/* 0x45 is clock no-stretching version of Extended Erase for I2C port. */
-	if (stm->cmd->er != STM32_CMD_ER) 
+	len = stm32_frame_erase(stm, spage, pages, buf, &timeout);
+	if (stm32_port_write(stm, buf, len) != PORT_OK)
 	{
-		/* Not all chips using Extended Erase support mass erase */
-		/* Currently known as not supporting mass erase is the Ultra Low Power STM32L15xx range */
-		/* So if someone has not overridden the default, but uses one of these chips, take it out of */
-		/* mass erase mode, so it will be done page by page. This maximum might not be correct either! */
-		if (stm->pid == 0x416 && pages == 0xFF)
-			pages = 0xF8; /* works for the STM32L152RB with 128Kb flash */
+		log_msg(LOG_LVL_ERROR, "stm32", "Erase failed.");
+		return STM32_ERR_UNKNOWN;
+	}
 
-		if (pages == 0xFF) 
-		{
-			uint8_t buf[3];
+	stm_err = stm32_get_ack_timeout(stm, timeout);
+	if (stm_err != STM32_OK) 
+	{
+		if (stm->cmd->er != STM32_CMD_ER && len == 3)
+			log_msg(LOG_LVL_ERROR, "stm32", "Mass erase failed. Try specifying the number of pages to be erased.");
+		else if (stm->cmd->er != STM32_CMD_ER)
+			log_msg(LOG_LVL_ERROR, "stm32", "Page-by-page erase failed. Check the maximum pages your device supports.");
+		if (port->flags & PORT_STRETCH_W
+		    && stm->cmd->er != STM32_CMD_EE_NS)
+			stm32_warn_stretching("erase");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_OK;
+}
 
-			/* 0xFFFF the magic number for mass erase */
-			buf[0] = 0xFF;
-			buf[1] = 0xFF;
-			buf[2] = 0x00;	/* checksum */
-			if (port->write(port, buf, 3) != PORT_OK) 
-			{
-				fprintf(stderr, "Mass erase error.\n");
-				return STM32_ERR_UNKNOWN;
-			}
-			stm_err = stm32_get_ack_timeout(stm, STM32_MASSERASE_TIMEOUT);
-			if (stm_err != STM32_OK) 
-			{
-				fprintf(stderr, "Mass erase failed. Try specifying the number of pages to be erased.\n");
-				if (port->flags & PORT_STRETCH_W
-				    && stm->cmd->er != STM32_CMD_EE_NS)
-					stm32_warn_stretching("erase");
-				return STM32_ERR_UNKNOWN;
-			}
-			return STM32_OK;
-		}
+/*
+ * Both unprotect commands end with a system reset of the device, so the
+ * caller has to reconnect (see session_reconnect()) before the next command.
+ */
+stm32_t stm32_wunprot_memory(const stm32_struct_t *stm)
+{
+	stm32_t stm_err;
 
-		uint16_t pg_num;
-		uint8_t pg_byte;
-		uint8_t cs = 0;
-		uint8_t *buf;
-		int i = 0;
+	if (stm->cmd->uw == STM32_CMD_ERR) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: WRITE UNPROTECT command not implemented in bootloader.");
+		return STM32_ERR_NO_CMD;
+	}
 
-		buf = malloc(2 + 2 * pages + 1);
-		if (!buf)
-			return STM32_ERR_UNKNOWN;
+	if (stm32_send_command(stm, stm->cmd->uw) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
 
-		/* Number of pages to be erased - 1, two bytes, MSB first */
-		pg_byte = (pages - 1) >> 8;
-		buf[i++] = pg_byte;
-		cs ^= pg_byte;
-		pg_byte = (pages - 1) & 0xFF;
-		buf[i++] = pg_byte;
-		cs ^= pg_byte;
+	stm_err = stm32_get_ack_timeout(stm, STM32_WUNPROT_TIMEOUT);
+	if (stm_err == STM32_ERR_NACK) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: Failed to WRITE UNPROTECT");
+		return STM32_ERR_UNKNOWN;
+	}
+	if (stm_err != STM32_OK) 
+	{
+		if (stm->port->flags & PORT_STRETCH_W
+		    && stm->cmd->uw != STM32_CMD_UW_NS)
+			stm32_warn_stretching("WRITE UNPROTECT");
+		return STM32_ERR_UNKNOWN;
+	}
+	return STM32_OK;
+}
 
-		for (pg_num = spage; pg_num < spage + pages; pg_num++)
-		{
-			pg_byte = pg_num >> 8;
-			cs ^= pg_byte;
-			buf[i++] = pg_byte;
-			pg_byte = pg_num & 0xFF;
-			cs ^= pg_byte;
-			buf[i++] = pg_byte;
-		}
-		buf[i++] = cs;
-		port_err = port->write(port, buf, i);
-		free(buf);
-		if (port_err != PORT_OK)
-		{
-			fprintf(stderr, "Page-by-page erase error.\n");
-			return STM32_ERR_UNKNOWN;
-		}
+stm32_t stm32_runprot_memory(const stm32_struct_t *stm)
+{
+	stm32_t stm_err;
 
-		stm_err = stm32_get_ack_timeout(stm, STM32_SECTERASE_TIMEOUT);
-		if (stm_err != STM32_OK) 
-		{
-			fprintf(stderr, "Page-by-page erase failed. Check the maximum pages your device supports.\n");
-			if (port->flags & PORT_STRETCH_W
-			    && stm->cmd->er != STM32_CMD_EE_NS)
-				stm32_warn_stretching("erase");
-			return STM32_ERR_UNKNOWN;
-		}
+	if (stm->cmd->ur == STM32_CMD_ERR) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: READOUT UNPROTECT command not implemented in bootloader.");
+		return STM32_ERR_NO_CMD;
+	}
 
-		return STM32_OK;
+	if (stm32_send_command(stm, stm->cmd->ur) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	/* the device mass erases the flash before the second ACK */
+	stm_err = stm32_get_ack_timeout(stm, STM32_MASSERASE_TIMEOUT);
+	if (stm_err == STM32_ERR_NACK) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Error: Failed to READOUT UNPROTECT");
+		return STM32_ERR_UNKNOWN;
+	}
+	if (stm_err != STM32_OK) 
+	{
+		if (stm->port->flags & PORT_STRETCH_W
+		    && stm->cmd->ur != STM32_CMD_UR_NS)
+			stm32_warn_stretching("READOUT UNPROTECT");
+		return STM32_ERR_UNKNOWN;
 	}
+	return STM32_OK;
+}
 
-	/* And now the regular erase (0x43) for all other chips */
-	if (pages == 0xFF) 
+#define CRCPOLY_BE		0x04c11db7
+#define CRC_MSBMASK		0x80000000
+
+stm32_t stm32_crc_memory(const stm32_struct_t *stm, uint32_t address, uint32_t length, uint32_t *crc)
+{
+	uint8_t buf[5];
+
+	if (address & 0x3 || length & 0x3) 
 	{
-		stm_err = stm32_send_command_timeout(stm, 0xFF, STM32_MASSERASE_TIMEOUT);
-		if (stm_err != STM32_OK)
-		{
-			if (port->flags & PORT_STRETCH_W)
-				stm32_warn_stretching("erase");
-			return STM32_ERR_UNKNOWN;
-		}
-		return STM32_OK;
-	} 
-	else 
+		log_msg(LOG_LVL_ERROR, "stm32", "Start and end addresses must be 4 byte aligned");
+		return STM32_ERR_UNKNOWN;
+	}
+
+	if (stm->cmd->crc == STM32_CMD_ERR) 
+		return STM32_ERR_NO_CMD;
+
+	if (stm32_send_command(stm, stm->cmd->crc) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	stm32_frame_u32(address, buf);
+	if (stm32_port_write(stm, buf, 5) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	stm32_frame_u32(length, buf);
+	if (stm32_port_write(stm, buf, 5) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	if (stm32_get_ack(stm) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	/* second ACK once the device has computed the CRC */
+	if (stm32_get_ack_timeout(stm, STM32_CRC_TIMEOUT) != STM32_OK)
+		return STM32_ERR_UNKNOWN;
+
+	if (stm32_port_read(stm, buf, 5) != PORT_OK)
+		return STM32_ERR_UNKNOWN;
+	if (buf[4] != (buf[0] ^ buf[1] ^ buf[2] ^ buf[3]))
 	{
-		uint8_t cs = 0;
-		uint8_t pg_num;
-		uint8_t *buf;
-		int i = 0;
+		log_msg(LOG_LVL_ERROR, "stm32", "CRC checksum mismatch");
+		return STM32_ERR_UNKNOWN;
+	}
 
-		buf = malloc(1 + pages + 1);
-		if (!buf)
-			return STM32_ERR_UNKNOWN;
+	*crc = (buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+	return STM32_OK;
+}
 
-		buf[i++] = pages - 1;
-		cs ^= (pages-1);
-		for (pg_num = spage; pg_num < (pages + spage); pg_num++)
-		{
-			buf[i++] = pg_num;
-			cs ^= pg_num;
-		}
-		buf[i++] = cs;
-		port_err = port->write(port, buf, i);
-		free(buf);
-		if (port_err != PORT_OK) 
-		{
-			fprintf(stderr, "Erase failed.\n");
+/*
+ * Compare len bytes of flash at address with data using the CRC
+ * command; STM32_ERR_NO_CMD if the bootloader does not have it.
+ */
+stm32_t stm32_verify_crc(const stm32_struct_t *stm, uint32_t address, const uint8_t *data, unsigned int len)
+{
+	uint32_t aligned = len & ~3, crc, dev_crc;
+	uint8_t tail[4];
+	stm32_t stm_err;
+
+	if (stm->cmd->crc == STM32_CMD_ERR) 
+		return STM32_ERR_NO_CMD;
+
+	crc = stm32_sw_crc(0xFFFFFFFF, (uint8_t *)data, aligned);
+	if (len & 3)
+	{
+		/* stm32_write_memory() and the engine pad the last word with 0xFF */
+		memset(tail, 0xFF, sizeof(tail));
+		memcpy(tail, data + aligned, len & 3);
+		crc = stm32_sw_crc(crc, tail, sizeof(tail));
+		aligned += 4;
+	}
+	if ((stm_err = stm32_crc_memory(stm, address, aligned, &dev_crc)) != STM32_OK)
+		return stm_err;
+	return dev_crc == crc ? STM32_OK : STM32_ERR_UNKNOWN;
+}
+
+/* compare len bytes at address with data by reading them back */
+stm32_t stm32_verify_read(const stm32_struct_t *stm, uint32_t address, const uint8_t *data, unsigned int len)
+{
+	uint8_t buf[256];
+	unsigned int n;
+
+	for (; len; len -= n, address += n, data += n)
+	{
+		n = len > sizeof(buf) ? sizeof(buf) : len;
+		if (stm32_read_memory(stm, address, buf, n) != STM32_OK)
 			return STM32_ERR_UNKNOWN;
-		}
-		stm_err = stm32_get_ack_timeout(stm, STM32_MASSERASE_TIMEOUT);
-		if (stm_err != STM32_OK)
-		{
-			if (port->flags & PORT_STRETCH_W)
-				stm32_warn_stretching("erase");
+		if (memcmp(buf, data, n))
 			return STM32_ERR_UNKNOWN;
-		}
-		return STM32_OK;
 	}
+	return STM32_OK;
+}
+
+/*
+ * Bytes from the start of the flash made of fl_ps pages. F2, F4 and F7
+ * have four such sectors, then sectors of 64 KiB and more, where page
+ * numbers and page starts worked out from fl_ps are wrong.
+ */
+uint32_t stm32_paged_size(const stm32_dev_t *dev)
+{
+	switch (dev->id)
+	{
+		case 0x411: case 0x413: case 0x419: case 0x421: case 0x423:
+		case 0x431: case 0x433: case 0x434: case 0x441: case 0x458:
+		case 0x463:
+		case 0x449: case 0x451: case 0x452:
+			return 4 * dev->fl_ps;
+		default:
+			return dev->fl_end - dev->fl_start;
+	}
+}
+
+/*
+ * Address of the 96 bit unique device ID, 0 if unknown. On L0/L1 the
+ * three words are not contiguous; the 12 bytes read from the base
+ * address are still unique to the part.
+ */
+uint32_t stm32_uid_address(uint16_t pid)
+{
+	switch (pid)
+	{
+		case 0x410: case 0x412: case 0x414: case 0x418:
+		case 0x420: case 0x428: case 0x430:
+			return 0x1FFFF7E8;		/* F1 */
+		case 0x440: case 0x442: case 0x444: case 0x445: case 0x448:
+		case 0x422: case 0x432: case 0x438: case 0x439: case 0x446:
+			return 0x1FFFF7AC;		/* F0, F3 */
+		case 0x411: case 0x413: case 0x419: case 0x421: case 0x423:
+		case 0x431: case 0x433: case 0x434: case 0x441: case 0x458:
+		case 0x463:
+			return 0x1FFF7A10;		/* F2, F4 */
+		case 0x449: case 0x451: case 0x452:
+			return 0x1FF0F420;		/* F7 */
+		case 0x417: case 0x425: case 0x447: case 0x457:
+		case 0x416: case 0x429:
+			return 0x1FF80050;		/* L0, L1 cat.1/2 */
+		case 0x427: case 0x436: case 0x437:
+			return 0x1FF800D0;		/* L1 cat.3 and up */
+		case 0x415: case 0x435: case 0x461: case 0x462: case 0x470:
+		case 0x460: case 0x466: case 0x468: case 0x469:
+			return 0x1FFF7590;		/* L4, G0, G4 */
+		case 0x450:
+			return 0x1FF1E800;		/* H7 */
+		default:
+			return 0;
+	}
+}
+
+stm32_t stm32_read_uid(const stm32_struct_t *stm, uint8_t *uid)
+{
+	uint32_t address = stm32_uid_address(stm->pid);
+
+	if (address == 0)
+		return STM32_ERR_NO_CMD;
+	return stm32_read_memory(stm, address, uid, STM32_UID_LEN);
+}
+
+/* software version of the STM32 CRC unit, over little endian words */
+uint32_t stm32_sw_crc(uint32_t crc, uint8_t *buf, unsigned int len)
+{
+	int i;
+	uint32_t data;
+
+	if (len & 0x3) 
+	{
+		log_msg(LOG_LVL_ERROR, "stm32", "Buffer length must be multiple of 4 bytes");
+		return 0;
+	}
+
+	while (len) 
+	{
+		data = *buf++;
+		data |= *buf++ << 8;
+		data |= *buf++ << 16;
+		data |= *buf++ << 24;
+		len -= 4;
+
+		crc ^= data;
+
+		for (i = 0; i < 32; i++)
+			if (crc & CRC_MSBMASK)
+				crc = (crc << 1) ^ CRCPOLY_BE;
+			else
+				crc = (crc << 1);
+	}
+	return crc;
 }
 
 const stm32_dev_t devices[] = {
@@ -24,16 +24,25 @@
 #define _STM32_H
 
 #include <stdint.h>
+#include <time.h>
 #include "port.h"
+#include "stats.h"
 
 #define STM32_MAX_RX_FRAME	256				/* cmd read memory */
 #define STM32_MAX_TX_FRAME	(1 + 256 + 1)	/* cmd write memory */
+#define STM32_UID_LEN		12				/* unique device ID */
+#define STM32_MAX_ERASE_FRAME	(2 + 2 * 256 + 1)	/* extended erase page list */
+
+/* flags for stm32_init() */
+#define STM32_INIT_PIPELINE	(1 << 0)	/* queue GVR, GET and GID back-to-back */
+#define STM32_INIT_RESET	(1 << 1)	/* reset into the bootloader first */
 
 typedef enum {
 	STM32_OK = 0,
 	STM32_ERR_UNKNOWN,	/* Generic error */
 	STM32_ERR_NACK,
 	STM32_ERR_NO_CMD,	/* Command not available in bootloader */
+	STM32_ERR_PARAM,	/* Rejected before anything was sent */
 } stm32_t;
 
 typedef struct stm32_struct		stm32_struct_t;
@@ -50,6 +59,7 @@ struct stm32_struct
 	uint16_t				pid;
 	stm32_cmd_t				*cmd;
 	const stm32_dev_t		*dev;
+	stm32_stats_t			*stats;		/* NULL disables the instrumentation */
 };
 
 struct stm32_dev 
@@ -80,8 +90,25 @@ struct stm32_cmd
 	uint8_t	crc;
 };
 
-stm32_struct_t	*stm32_init(struct port_interface *);
+#define STM32_CMD_ERR	0xFF	/* not a valid command, or one the bootloader lacks */
+
+stm32_struct_t	*stm32_alloc(struct port_interface *);
+stm32_struct_t	*stm32_init(struct port_interface *, unsigned int);
+stm32_struct_t	*stm32_reconnect(struct port_interface *, const stm32_struct_t *);
 void			stm32_close(stm32_struct_t*);
+stm32_t			stm32_ping(const stm32_struct_t *);
+stm32_t			stm32_resync(const stm32_struct_t *);
+stm32_t			stm32_resync_timeout(const stm32_struct_t *, time_t);
+void			stm32_drain(const stm32_struct_t *);
+void			stm32_stats_snapshot(const stm32_struct_t *, stm32_stats_t *);
+
+/* reply parsing and frame building, for protocol drivers outside this file */
+stm32_t			stm32_parse_get(stm32_struct_t *, const uint8_t *);
+stm32_t			stm32_parse_pid(stm32_struct_t *, const uint8_t *);
+stm32_t			stm32_find_dev(stm32_struct_t *);
+void			stm32_frame_u32(uint32_t, uint8_t *);
+unsigned int	stm32_frame_data(const uint8_t *, unsigned int, uint8_t *);
+unsigned int	stm32_frame_erase(const stm32_struct_t *, uint8_t, uint8_t, uint8_t *, time_t *);
 
 stm32_t stm32_read_memory(const stm32_struct_t *, uint32_t, uint8_t *, unsigned int);
 stm32_t stm32_write_memory(const stm32_struct_t *, uint32_t, const uint8_t *, unsigned int);
@@ -94,6 +121,11 @@ stm32_t stm32_readprot_memory(const stm32_struct_t *);
 stm32_t stm32_runprot_memory(const stm32_struct_t *);
 stm32_t stm32_crc_memory(const stm32_struct_t *, uint32_t, uint32_t, uint32_t *);
 stm32_t stm32_crc_wrapper(const stm32_struct_t *, uint32_t, uint32_t, uint32_t *);
+stm32_t stm32_verify_crc(const stm32_struct_t *, uint32_t, const uint8_t *, unsigned int);
+stm32_t stm32_verify_read(const stm32_struct_t *, uint32_t, const uint8_t *, unsigned int);
 uint32_t stm32_sw_crc(uint32_t, uint8_t *, unsigned int);
+uint32_t stm32_uid_address(uint16_t);
+uint32_t stm32_paged_size(const stm32_dev_t *);
+stm32_t stm32_read_uid(const stm32_struct_t *, uint8_t *);
 
 #endif
@@ -0,0 +1,633 @@
+/******************************************************************************
+ * STM32 UART bootloader simulator
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "stm32_sim.h"
+
+/*
+ * In-process model of the AN3155 UART bootloader: INIT, GET, GVR, GID,
+ * read/write memory, erase/extended erase, GO, write/readout unprotect
+ * and CRC against an emulated flash array. The device profile comes from
+ * devices[]. The reply bytes are time stamped by a simple timing model:
+ * wire time per character, adapter latency each way, and page erase and
+ * word program times, so that a host can wait for them in real time or
+ * on a virtual clock.
+ */
+
+#define SIM_ACK		0x79
+#define SIM_NACK	0x1F
+
+#define SIM_RAM_BASE	0x20000000
+#define SIM_GARBLE_EVERY	16		/* above max_baud, one reply byte in 16 */
+
+enum
+{
+	S_INIT,			/* waiting for 0x7F */
+	S_CMD,			/* command byte and complement */
+	S_ADDR,			/* address and checksum */
+	S_RM_LEN,		/* read memory: length and complement */
+	S_WM_LEN,		/* write memory: length byte */
+	S_WM_DATA,		/* write memory: data and checksum */
+	S_ER,			/* erase: count byte */
+	S_ER_PAGES,		/* erase: page list and checksum */
+	S_EE,			/* extended erase: 16 bit count */
+	S_EE_PAGES,		/* extended erase: page list and checksum */
+	S_CRC_LEN,		/* crc: length and checksum */
+};
+
+extern const stm32_dev_t devices[];
+
+/* F1 parts only know the original erase command */
+static int sim_has_extended_erase(uint16_t pid)
+{
+	switch (pid)
+	{
+		case 0x410: case 0x412: case 0x414: case 0x418:
+		case 0x420: case 0x428: case 0x430: case 0x641:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+void sim_timing_default(sim_timing_t *timing)
+{
+	timing->baud			= 115200;
+	timing->bits			= 11;
+	timing->latency_us		= 1000;
+	timing->page_erase_us	= 20000;
+	timing->mass_erase_us	= 40000;
+	timing->word_prog_us	= 60;
+	timing->max_baud		= 0;
+}
+
+/* "lat=1000,erase=20000,mass=40000,prog=60,bits=11,maxbaud=460800,fast" */
+int sim_parse_options(const char *opts, sim_timing_t *timing, int *fast)
+{
+	const char *p = opts;
+	char *end;
+	unsigned long v;
+
+	while (p && *p)
+	{
+		if (*p == ',')
+		{
+			p++;
+			continue;
+		}
+		if (!strncmp(p, "fast", 4) && (p[4] == ',' || p[4] == 0))
+		{
+			if (fast)
+				*fast = 1;
+			p += 4;
+			continue;
+		}
+
+		end = strchr(p, '=');
+		if (end == NULL)
+			return -1;
+		v = strtoul(end + 1, NULL, 0);
+
+		if (!strncmp(p, "lat=", 4))
+			timing->latency_us = v;
+		else if (!strncmp(p, "erase=", 6))
+			timing->page_erase_us = v;
+		else if (!strncmp(p, "mass=", 5))
+			timing->mass_erase_us = v;
+		else if (!strncmp(p, "prog=", 5))
+			timing->word_prog_us = v;
+		else if (!strncmp(p, "bits=", 5))
+			timing->bits = v;
+		else if (!strncmp(p, "baud=", 5))
+			timing->baud = v;
+		else if (!strncmp(p, "maxbaud=", 8))
+			timing->max_baud = v;
+		else
+			return -1;
+
+		p = strchr(end, ',');
+	}
+	return 0;
+}
+
+stm32_sim_t* sim_create(uint16_t pid, const sim_timing_t *timing)
+{
+	const stm32_dev_t *dev;
+	stm32_sim_t *sim;
+
+	for (dev = devices; dev->id && dev->id != pid; dev++)
+		;
+	if (!dev->id)
+		return NULL;
+
+	sim = calloc(1, sizeof(stm32_sim_t));
+	assert(sim != NULL);
+	sim->dev = dev;
+	sim->timing = *timing;
+	sim->extended_erase = sim_has_extended_erase(pid);
+
+	sim->flash_size = dev->fl_end - dev->fl_start;
+	sim->flash = malloc(sim->flash_size);
+	assert(sim->flash != NULL);
+	memset(sim->flash, 0xFF, sim->flash_size);
+
+	sim->ram_size = dev->ram_end > SIM_RAM_BASE ? dev->ram_end - SIM_RAM_BASE : 0x1000;
+	sim->ram = calloc(1, sim->ram_size);
+	assert(sim->ram != NULL);
+
+	/* a fixed unique ID, so that a journal survives reopening the port */
+	snprintf((char *)sim->uid, sizeof(sim->uid), "SIM%03x", pid);
+
+	sim->state = S_INIT;
+	sim->need = 1;
+	return sim;
+}
+
+void sim_destroy(stm32_sim_t *sim)
+{
+	free(sim->flash);
+	free(sim->ram);
+	free(sim);
+}
+
+/* wire time of one character */
+static uint64_t sim_char_us(const stm32_sim_t *sim)
+{
+	if (sim->timing.baud == 0)
+		return 0;
+	return ((uint64_t)sim->timing.bits * 1000000 + sim->timing.baud - 1) / sim->timing.baud;
+}
+
+/* queue reply bytes; the device starts sending after busy_us */
+static void sim_reply(stm32_sim_t *sim, const uint8_t *buf, unsigned int n, uint64_t busy_us)
+{
+	uint64_t t;
+	unsigned int i;
+
+	t = sim->t_in > sim->t_dev ? sim->t_in : sim->t_dev;
+	t += busy_us;
+	for (i = 0; i < n; i++)
+	{
+		sim_byte_t *b = &sim->out[sim->out_tail % SIM_OUT_MAX];
+
+		t += sim_char_us(sim);
+		b->byte = buf[i];
+		/* a link driven too fast loses every few characters */
+		if (sim->timing.max_baud && sim->timing.baud > sim->timing.max_baud
+		    && sim->out_tail % SIM_GARBLE_EVERY == 0)
+			b->byte ^= 0x10;
+		b->t_us = t + sim->timing.latency_us;
+		sim->out_tail++;
+		if (sim->out_tail - sim->out_head > SIM_OUT_MAX)
+			sim->out_head++;	/* host does not read, drop the oldest */
+	}
+	sim->t_dev = t;
+}
+
+static void sim_ack(stm32_sim_t *sim, uint64_t busy_us)
+{
+	uint8_t b = SIM_ACK;
+
+	sim_reply(sim, &b, 1, busy_us);
+}
+
+static void sim_nack(stm32_sim_t *sim)
+{
+	uint8_t b = SIM_NACK;
+
+	sim->nacks++;
+	sim_reply(sim, &b, 1, 0);
+}
+
+static void sim_expect(stm32_sim_t *sim, int state, unsigned int need)
+{
+	sim->state = state;
+	sim->have = 0;
+	sim->need = need;
+}
+
+static void sim_reset(stm32_sim_t *sim)
+{
+	sim->resets++;
+	sim_expect(sim, S_INIT, 1);
+}
+
+/* NRST asserted: drop the pending replies and wait for autobaud again */
+void sim_pin_reset(stm32_sim_t *sim)
+{
+	sim->out_head = sim->out_tail;
+	sim_reset(sim);
+}
+
+static uint8_t sim_xor(const uint8_t *buf, unsigned int n)
+{
+	uint8_t x = 0;
+
+	while (n--)
+		x ^= *buf++;
+	return x;
+}
+
+/* map a target address range, NULL if it is not backed by memory */
+static uint8_t *sim_map(stm32_sim_t *sim, uint32_t addr, uint32_t len, int *is_flash)
+{
+	const stm32_dev_t *dev = sim->dev;
+
+	if (addr >= dev->fl_start && addr + len <= dev->fl_end)
+	{
+		*is_flash = 1;
+		return sim->flash + (addr - dev->fl_start);
+	}
+	if (addr >= SIM_RAM_BASE && addr + len <= SIM_RAM_BASE + sim->ram_size)
+	{
+		*is_flash = 0;
+		return sim->ram + (addr - SIM_RAM_BASE);
+	}
+	return NULL;
+}
+
+/* the unique ID is read only */
+static const uint8_t *sim_uid(const stm32_sim_t *sim, uint32_t addr, uint32_t len)
+{
+	uint32_t base = stm32_uid_address(sim->dev->id);
+
+	if (base && addr >= base && addr + len <= base + STM32_UID_LEN)
+		return sim->uid + (addr - base);
+	return NULL;
+}
+
+static int sim_readable(const stm32_sim_t *sim, uint32_t addr, uint32_t len)
+{
+	const stm32_dev_t *dev = sim->dev;
+
+	/* system memory and option bytes read back as erased */
+	if (addr >= dev->mem_start && addr + len <= dev->mem_end + 1)
+		return 1;
+	if (addr >= dev->opt_start && addr + len <= dev->opt_end + 1)
+		return 1;
+	return 0;
+}
+
+static void sim_erase_pages(stm32_sim_t *sim, const uint8_t *list, unsigned int n, int wide)
+{
+	unsigned int i, page, pages;
+	uint32_t ps = sim->dev->fl_ps;
+
+	pages = sim->flash_size / ps;
+	for (i = 0; i < n; i++)
+	{
+		page = wide ? (list[2 * i] << 8) | list[2 * i + 1] : list[i];
+		if (page < pages)
+			memset(sim->flash + page * ps, 0xFF, ps);
+	}
+	sim_ack(sim, (uint64_t)n * sim->timing.page_erase_us);
+}
+
+static void sim_mass_erase(stm32_sim_t *sim)
+{
+	memset(sim->flash, 0xFF, sim->flash_size);
+	sim_ack(sim, sim->timing.mass_erase_us);
+}
+
+static void sim_command(stm32_sim_t *sim)
+{
+	uint8_t buf[20];
+	unsigned int n = 0;
+
+	if ((sim->in[0] ^ sim->in[1]) != 0xFF)
+	{
+		sim_nack(sim);
+		sim_expect(sim, S_CMD, 2);
+		return;
+	}
+
+	sim->cmd = sim->in[0];
+	switch (sim->cmd)
+	{
+		case 0x00:	/* GET */
+			buf[n++] = SIM_ACK;
+			buf[n++] = 0;	/* patched below */
+			buf[n++] = sim->extended_erase ? 0x31 : 0x22;
+			buf[n++] = 0x00;
+			buf[n++] = 0x01;
+			buf[n++] = 0x02;
+			buf[n++] = 0x11;
+			buf[n++] = 0x21;
+			buf[n++] = 0x31;
+			buf[n++] = sim->extended_erase ? 0x44 : 0x43;
+			buf[n++] = 0x73;
+			buf[n++] = 0x92;
+			buf[n++] = 0xA1;
+			buf[1] = n - 3;
+			buf[n++] = SIM_ACK;
+			sim_reply(sim, buf, n, 0);
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case 0x01:	/* GVR */
+			buf[n++] = SIM_ACK;
+			buf[n++] = sim->extended_erase ? 0x31 : 0x22;
+			buf[n++] = 0x00;
+			buf[n++] = 0x00;
+			buf[n++] = SIM_ACK;
+			sim_reply(sim, buf, n, 0);
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case 0x02:	/* GID */
+			buf[n++] = SIM_ACK;
+			buf[n++] = 0x01;
+			buf[n++] = sim->dev->id >> 8;
+			buf[n++] = sim->dev->id & 0xFF;
+			buf[n++] = SIM_ACK;
+			sim_reply(sim, buf, n, 0);
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case 0x11:	/* read memory */
+		case 0x21:	/* go */
+		case 0x31:	/* write memory */
+		case 0xA1:	/* crc */
+			sim_ack(sim, 0);
+			sim_expect(sim, S_ADDR, 5);
+			return;
+
+		case 0x43:
+			if (sim->extended_erase)
+				break;
+			sim_ack(sim, 0);
+			sim_expect(sim, S_ER, 1);
+			return;
+
+		case 0x44:
+			if (!sim->extended_erase)
+				break;
+			sim_ack(sim, 0);
+			sim_expect(sim, S_EE, 2);
+			return;
+
+		case 0x73:	/* write unprotect, then system reset */
+			sim_ack(sim, 0);
+			sim_ack(sim, sim->timing.page_erase_us);
+			sim_reset(sim);
+			return;
+
+		case 0x92:	/* readout unprotect: mass erase, then system reset */
+			sim_ack(sim, 0);
+			memset(sim->flash, 0xFF, sim->flash_size);
+			sim_ack(sim, sim->timing.mass_erase_us);
+			sim_reset(sim);
+			return;
+	}
+
+	sim_nack(sim);
+	sim_expect(sim, S_CMD, 2);
+}
+
+static void sim_step(stm32_sim_t *sim)
+{
+	uint8_t *mem, buf[8];
+	uint32_t len, crc;
+	unsigned int n;
+	int is_flash;
+
+	switch (sim->state)
+	{
+		case S_INIT:
+			if (sim->in[0] == 0x7F)
+			{
+				sim_ack(sim, 0);
+				sim_expect(sim, S_CMD, 2);
+			}
+			else
+				sim_expect(sim, S_INIT, 1);
+			return;
+
+		case S_CMD:
+			sim_command(sim);
+			return;
+
+		case S_ADDR:
+			if (sim_xor(sim->in, 4) != sim->in[4])
+				break;
+			sim->addr = (sim->in[0] << 24) | (sim->in[1] << 16) | (sim->in[2] << 8) | sim->in[3];
+			if (sim->cmd == 0x21)
+			{
+				/* jump to the code; with BOOT0 high a reset ends up here again */
+				sim_ack(sim, 0);
+				sim_reset(sim);
+				return;
+			}
+			if (sim->cmd == 0xA1)
+			{
+				sim_ack(sim, 0);
+				sim_expect(sim, S_CRC_LEN, 5);
+				return;
+			}
+			if (sim_map(sim, sim->addr, 1, &is_flash) == NULL
+			    && !(sim->cmd == 0x11 && (sim_readable(sim, sim->addr, 1)
+										 || sim_uid(sim, sim->addr, 1))))
+				break;
+			sim_ack(sim, 0);
+			sim_expect(sim, sim->cmd == 0x11 ? S_RM_LEN : S_WM_LEN, sim->cmd == 0x11 ? 2 : 1);
+			return;
+
+		case S_RM_LEN:
+			if ((sim->in[0] ^ sim->in[1]) != 0xFF)
+				break;
+			len = sim->in[0] + 1;
+			mem = sim_map(sim, sim->addr, len, &is_flash);
+			if (mem == NULL && !sim_readable(sim, sim->addr, len)
+			    && sim_uid(sim, sim->addr, len) == NULL)
+				break;
+			sim_ack(sim, 0);
+			if (mem)
+				sim_reply(sim, mem, len, 0);
+			else if (sim_uid(sim, sim->addr, len))
+				sim_reply(sim, sim_uid(sim, sim->addr, len), len, 0);
+			else
+			{
+				uint8_t ff[256];
+
+				memset(ff, 0xFF, len);
+				sim_reply(sim, ff, len, 0);
+			}
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case S_WM_LEN:
+			sim->count = sim->in[0] + 1;
+			sim_expect(sim, S_WM_DATA, sim->count + 1);
+			return;
+
+		case S_WM_DATA:
+			len = sim->count;
+			if ((sim_xor(sim->in, len) ^ (len - 1)) != sim->in[len])
+				break;
+			mem = sim_map(sim, sim->addr, len, &is_flash);
+			if (mem == NULL)
+				break;
+			if (is_flash)
+			{
+				for (n = 0; n < len; n++)
+					mem[n] &= sim->in[n];
+				sim_ack(sim, (uint64_t)(len / 4) * sim->timing.word_prog_us);
+			}
+			else
+			{
+				memcpy(mem, sim->in, len);
+				sim_ack(sim, 0);
+			}
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case S_ER:
+			if (sim->in[0] == 0xFF)
+			{
+				sim->count = 0;
+				sim_expect(sim, S_ER_PAGES, 1);
+			}
+			else
+			{
+				sim->count = sim->in[0] + 1;
+				sim_expect(sim, S_ER_PAGES, sim->count + 1);
+			}
+			return;
+
+		case S_ER_PAGES:
+			n = sim->count;
+			if (n == 0)
+			{
+				/* 0xFF 0x00: global erase */
+				if (sim->in[0] != 0x00)
+					break;
+				sim_mass_erase(sim);
+			}
+			else
+			{
+				if ((sim_xor(sim->in, n) ^ (n - 1)) != sim->in[n])
+					break;
+				sim_erase_pages(sim, sim->in, n, 0);
+			}
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case S_EE:
+			sim->count = (sim->in[0] << 8) | sim->in[1];
+			if (sim->count >= 0xFFFD)
+				sim_expect(sim, S_EE_PAGES, 1);		/* mass or bank erase */
+			else if (2 * (sim->count + 1) + 1 <= sizeof(sim->in))
+				sim_expect(sim, S_EE_PAGES, 2 * (sim->count + 1) + 1);
+			else
+				break;
+			return;
+
+		case S_EE_PAGES:
+			n = sim->count;
+			if (n >= 0xFFFD)
+			{
+				if (sim->in[0] != (((n >> 8) ^ n) & 0xFF))
+					break;
+				sim_mass_erase(sim);
+			}
+			else
+			{
+				if ((sim_xor(sim->in, 2 * (n + 1)) ^ (n >> 8) ^ (n & 0xFF)) != sim->in[2 * (n + 1)])
+					break;
+				sim_erase_pages(sim, sim->in, n + 1, 1);
+			}
+			sim_expect(sim, S_CMD, 2);
+			return;
+
+		case S_CRC_LEN:
+			if (sim_xor(sim->in, 4) != sim->in[4])
+				break;
+			len = (sim->in[0] << 24) | (sim->in[1] << 16) | (sim->in[2] << 8) | sim->in[3];
+			mem = sim_map(sim, sim->addr, len, &is_flash);
+			if (mem == NULL || len & 3)
+				break;
+			crc = stm32_sw_crc(0xFFFFFFFF, mem, len);
+			buf[0] = SIM_ACK;
+			buf[1] = SIM_ACK;
+			buf[2] = crc >> 24;
+			buf[3] = crc >> 16;
+			buf[4] = crc >> 8;
+			buf[5] = crc;
+			buf[6] = buf[2] ^ buf[3] ^ buf[4] ^ buf[5];
+			sim_reply(sim, buf, 7, 0);
+			sim_expect(sim, S_CMD, 2);
+			return;
+	}
+
+	/* bad checksum or address */
+	sim_nack(sim);
+	sim_expect(sim, S_CMD, 2);
+}
+
+/* bytes written by the host at now_us */
+void sim_feed(stm32_sim_t *sim, const uint8_t *buf, size_t nbyte, uint64_t now_us)
+{
+	uint64_t t;
+
+	t = now_us + sim->timing.latency_us;
+	if (sim->t_in > t)
+		t = sim->t_in;
+
+	while (nbyte--)
+	{
+		t += sim_char_us(sim);
+		sim->t_in = t;
+
+		sim->in[sim->have++] = *buf++;
+		if (sim->have == sim->need)
+			sim_step(sim);
+	}
+}
+
+/* reply bytes that have reached the host by now_us */
+size_t sim_fetch(stm32_sim_t *sim, uint8_t *buf, size_t nbyte, uint64_t now_us)
+{
+	size_t n = 0;
+
+	while (n < nbyte && sim->out_head != sim->out_tail)
+	{
+		const sim_byte_t *b = &sim->out[sim->out_head % SIM_OUT_MAX];
+
+		if (b->t_us > now_us)
+			break;
+		buf[n++] = b->byte;
+		sim->out_head++;
+	}
+	return n;
+}
+
+/* time at which the next reply byte reaches the host, 0 if none pending */
+int sim_next_ready(const stm32_sim_t *sim, uint64_t *t_us)
+{
+	if (sim->out_head == sim->out_tail)
+		return 0;
+	*t_us = sim->out[sim->out_head % SIM_OUT_MAX].t_us;
+	return 1;
+}
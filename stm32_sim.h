@@ -0,0 +1,95 @@
+/******************************************************************************
+ * STM32 UART bootloader simulator
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _STM32_SIM_H
+#define _STM32_SIM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "stm32.h"
+
+#define SIM_OUT_MAX		1024	/* reply bytes in flight */
+
+/* timing model, all times in microseconds */
+typedef struct sim_timing
+{
+	unsigned int	baud;			/* 0: no wire time */
+	unsigned int	bits;			/* bits per character, 11 for 8E1 */
+	unsigned int	latency_us;		/* adapter latency, each direction */
+	unsigned int	page_erase_us;
+	unsigned int	mass_erase_us;
+	unsigned int	word_prog_us;	/* per 32-bit word */
+	unsigned int	max_baud;		/* replies get garbled above, 0: none */
+} sim_timing_t;
+
+typedef struct sim_byte
+{
+	uint8_t		byte;
+	uint64_t	t_us;			/* when it reaches the host */
+} sim_byte_t;
+
+typedef struct stm32_sim
+{
+	const stm32_dev_t	*dev;
+	sim_timing_t		timing;
+	int					extended_erase;
+
+	uint8_t				*flash;
+	uint32_t			flash_size;
+	uint8_t				*ram;
+	uint32_t			ram_size;
+	uint8_t				uid[STM32_UID_LEN];
+
+	/* protocol state machine */
+	int					state;
+	uint8_t				cmd;
+	uint8_t				in[520];
+	unsigned int		have, need;
+	uint32_t			addr;
+	uint32_t			count;		/* length or page count of the command */
+
+	/* time bookkeeping for the model */
+	uint64_t			t_in;		/* last input byte received by the device */
+	uint64_t			t_dev;		/* device busy until */
+
+	sim_byte_t			out[SIM_OUT_MAX];
+	unsigned int		out_head, out_tail;
+
+	/* counters */
+	uint32_t			resets;
+	uint32_t			nacks;
+} stm32_sim_t;
+
+stm32_sim_t*	sim_create(uint16_t pid, const sim_timing_t *timing);
+void			sim_destroy(stm32_sim_t *sim);
+void			sim_timing_default(sim_timing_t *timing);
+int				sim_parse_options(const char *opts, sim_timing_t *timing, int *fast);
+void			sim_pin_reset(stm32_sim_t *sim);
+void			sim_feed(stm32_sim_t *sim, const uint8_t *buf, size_t nbyte, uint64_t now_us);
+size_t			sim_fetch(stm32_sim_t *sim, uint8_t *buf, size_t nbyte, uint64_t now_us);
+int				sim_next_ready(const stm32_sim_t *sim, uint64_t *t_us);
+
+/* port_sim.c */
+stm32_sim_t*	port_sim_model(port_interface_t *port);
+uint64_t		port_sim_clock(port_interface_t *port);
+
+#endif
@@ -0,0 +1,195 @@
+/******************************************************************************
+ * protocol trace
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "trace.h"
+#include "stats.h"
+
+/*
+ * The ring is always on: a writer only claims a slot with one atomic
+ * add and fills it, there is no lock and no allocation. Old events are
+ * overwritten. A slot carries its sequence number so that the exporter
+ * can skip slots that were being rewritten while it copied them.
+ */
+static trace_event_t	ring[TRACE_RING_SIZE];
+static uint64_t			ring_head;
+
+static trace_event_t *trace_claim(uint64_t *seq)
+{
+	trace_event_t *ev;
+
+	*seq = __atomic_fetch_add(&ring_head, 1, __ATOMIC_RELAXED) + 1;
+	ev = &ring[*seq & (TRACE_RING_SIZE - 1)];
+	__atomic_store_n(&ev->seq, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	return ev;
+}
+
+static void trace_commit(trace_event_t *ev, uint64_t seq)
+{
+	__atomic_store_n(&ev->seq, seq, __ATOMIC_RELEASE);
+}
+
+void trace_bytes(uint32_t chan, trace_type_t type, const void *buf, uint32_t nbyte)
+{
+	trace_event_t *ev;
+	uint64_t seq;
+
+	ev = trace_claim(&seq);
+	ev->ts_us	= stats_now_us();
+	ev->dur_us	= 0;
+	ev->chan	= chan;
+	ev->arg		= nbyte;
+	ev->type	= type;
+	ev->len		= nbyte < TRACE_DATA_MAX ? nbyte : TRACE_DATA_MAX;
+	ev->name	= NULL;
+	if (buf)
+		memcpy(ev->data, buf, ev->len);
+	else
+		ev->len = 0;
+	trace_commit(ev, seq);
+}
+
+/* start_us != 0 makes it a duration event ending now */
+void trace_event(uint32_t chan, trace_type_t type, uint32_t arg, uint64_t start_us)
+{
+	trace_event_t *ev;
+	uint64_t seq, now;
+
+	now = stats_now_us();
+	ev = trace_claim(&seq);
+	ev->ts_us	= start_us ? start_us : now;
+	ev->dur_us	= start_us ? now - start_us : 0;
+	ev->chan	= chan;
+	ev->arg		= arg;
+	ev->type	= type;
+	ev->len		= 0;
+	ev->name	= NULL;
+	trace_commit(ev, seq);
+}
+
+void trace_phase(uint32_t chan, const char *name, int begin)
+{
+	trace_event_t *ev;
+	uint64_t seq;
+
+	ev = trace_claim(&seq);
+	ev->ts_us	= stats_now_us();
+	ev->dur_us	= 0;
+	ev->chan	= chan;
+	ev->arg		= 0;
+	ev->type	= begin ? TRACE_PHASE_BEGIN : TRACE_PHASE_END;
+	ev->len		= 0;
+	ev->name	= name;
+	trace_commit(ev, seq);
+}
+
+static const char *trace_type_name(uint16_t type)
+{
+	switch (type)
+	{
+		case TRACE_TX:		return "tx";
+		case TRACE_RX:		return "rx";
+		case TRACE_TIMEOUT:	return "timeout";
+		case TRACE_CMD:		return "cmd";
+		case TRACE_ACK:		return "ack";
+		case TRACE_NACK:	return "nack";
+		case TRACE_BUSY:	return "busy";
+		default:			return "?";
+	}
+}
+
+static void trace_export_event(FILE *f, const trace_event_t *ev, int first)
+{
+	unsigned int i;
+
+	fprintf(f, "%s\n{\"pid\":1,\"tid\":%u,\"ts\":%llu,", first ? "" : ",",
+			ev->chan, (unsigned long long)ev->ts_us);
+
+	switch (ev->type)
+	{
+		case TRACE_PHASE_BEGIN:
+		case TRACE_PHASE_END:
+			fprintf(f, "\"ph\":\"%s\",\"name\":\"%s\"}",
+					ev->type == TRACE_PHASE_BEGIN ? "B" : "E",
+					ev->name ? ev->name : "phase");
+			return;
+
+		case TRACE_CMD:
+			fprintf(f, "\"ph\":\"X\",\"dur\":%u,\"name\":\"cmd 0x%02x\"}",
+					ev->dur_us, ev->arg & 0xFF);
+			return;
+
+		case TRACE_TX:
+		case TRACE_RX:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\","
+					"\"args\":{\"len\":%u,\"data\":\"",
+					trace_type_name(ev->type), ev->arg);
+			for (i = 0; i < ev->len; i++)
+				fprintf(f, "%02x", ev->data[i]);
+			fprintf(f, "%s\"}}", ev->arg > ev->len ? "..." : "");
+			return;
+
+		default:
+			fprintf(f, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\"}",
+					trace_type_name(ev->type));
+			return;
+	}
+}
+
+/* write the ring as Chrome trace / Perfetto JSON, oldest event first */
+void trace_export_chrome(FILE *f)
+{
+	trace_event_t ev;
+	uint64_t head, seq, first;
+	int n = 0;
+
+	head = __atomic_load_n(&ring_head, __ATOMIC_ACQUIRE);
+	first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE + 1 : 1;
+
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (seq = first; seq <= head; seq++)
+	{
+		const trace_event_t *slot = &ring[seq & (TRACE_RING_SIZE - 1)];
+
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+		memcpy(&ev, slot, sizeof(ev));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;	/* overwritten while copying */
+
+		trace_export_event(f, &ev, n++ == 0);
+	}
+	fprintf(f, "\n]}\n");
+}
+
+int trace_save(const char *filename)
+{
+	FILE *f;
+
+	if ((f = fopen(filename, "w")) == NULL)
+		return -1;
+	trace_export_chrome(f);
+	return fclose(f);
+}
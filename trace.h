@@ -0,0 +1,67 @@
+/******************************************************************************
+ * protocol trace
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_RING_SIZE		16384	/* events, power of two */
+#define TRACE_DATA_MAX		8		/* payload bytes kept per event */
+
+typedef enum
+{
+	TRACE_TX = 1,		/* bytes written to the port */
+	TRACE_RX,			/* bytes read from the port */
+	TRACE_TIMEOUT,		/* read timed out */
+	TRACE_CMD,			/* command opcode until its ACK, has a duration */
+	TRACE_ACK,
+	TRACE_NACK,
+	TRACE_BUSY,
+	TRACE_PHASE_BEGIN,	/* e.g. "connect", "erase", "write" */
+	TRACE_PHASE_END,
+} trace_type_t;
+
+typedef struct trace_event
+{
+	uint64_t	seq;		/* 0 while the slot is being written */
+	uint64_t	ts_us;
+	uint32_t	dur_us;
+	uint32_t	chan;		/* one timeline per port */
+	uint32_t	arg;		/* byte count or opcode */
+	uint16_t	type;
+	uint8_t		len;		/* valid bytes in data[] */
+	const char	*name;		/* phase name, static storage only */
+	uint8_t		data[TRACE_DATA_MAX];
+} trace_event_t;
+
+void	trace_bytes(uint32_t chan, trace_type_t type, const void *buf, uint32_t nbyte);
+void	trace_event(uint32_t chan, trace_type_t type, uint32_t arg, uint64_t start_us);
+void	trace_phase(uint32_t chan, const char *name, int begin);
+void	trace_export_chrome(FILE *f);
+int		trace_save(const char *filename);
+
+/* timeline id of a port, stable for as long as the port is open */
+#define trace_chan(p)	((uint32_t)(((uintptr_t)(p)) >> 4))
+
+#endif
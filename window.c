@@ -21,37 +21,32 @@
  */
 #include <gtk/gtk.h>
 #include <vte/vte.h>
-#include <sys/stat.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <pthread.h>
 #include "window.h"
 #include "parser.h"
 #include "port.h"
 #include "stm32.h"
+#include "flash.h"
+#include "trace.h"
+#include "hotplug.h"
+#include "event.h"
+#include "log.h"
+#include "worker.h"
 
 /* global variable */
 window_t *data;
 
-char *devices_list[DEVICES] = {
-	"/dev/ttyUSB0",
-	"/dev/ttyUSB1",
-	"/dev/ttyUSB2",
-	"/dev/ttyUSB3",
-	"/dev/ttyS0",
-	"/dev/ttyS1",
-	"/dev/ttyS2",
-	"/dev/ttyS3"
-//	"/dev/tts/0",
-//	"/dev/tts/1",
-//	"/dev/tts/2",
-//	"/dev/tts/3",
-//	"/dev/usb/tts/0",
-//	"/dev/usb/tts/1",
-//	"/dev/usb/tts/2",
-//	"/dev/usb/tts/3"
-};
+/* serial ports, kept up to date from hotplug events */
+static hotplug_t		*hotplug;
+static hotplug_port_t	ports[HOTPLUG_PORTS_MAX];
+static int				nports;
+static hotplug_slot_t	slots[DEVICES];
+static int				bound = -1;					/* bound slots, -1 without a slots file */
+static char				row_device[DEVICES][64];	/* port of each gang row, "" if none */
+static int				row_busy[DEVICES];			/* a job runs on the row */
+static guint			refresh_source;
 
 char *baud_rate_list[BAUDRATE] = {
 	"1200",
@@ -72,7 +67,21 @@ char *baud_rate_list[BAUDRATE] = {
 	"921600",
 	"1000000",
 	"1500000",
-	"2000000"
+	"2000000",
+	"3000000",
+	"4000000"
+};
+
+extern parser_ops_t PARSER_HEX;
+struct port_options port_opts = {
+	.device				= NULL,
+	.baudrate			= SERIAL_BAUD_576000,
+	.serial_mode		= "8e1",
+	.bus_addr			= 0,
+	.rx_frame_max		= STM32_MAX_RX_FRAME,
+	.tx_frame_max		= STM32_MAX_TX_FRAME,
+	.record				= NULL,
+	.fault				= NULL,
 };
 
 int main(int argc, char **argv)
@@ -82,20 +91,36 @@ int main(int argc, char **argv)
 	gtk_init(&argc, &argv);
 	data = calloc (1, sizeof(window_t));
 
+	/* capture the port traffic for replay, see port_replay.c */
+	port_opts.record = getenv ("GSTM32FLASH_RECORD");
+	/* exercise the recovery paths, see port_fault.c */
+	port_opts.fault = getenv ("GSTM32FLASH_FAULT");
+
+	/* the lines of the workers go to the terminal, see ui_drain() */
+	log_capture (1);
+	if (getenv (LOG_FILE_ENV))
+		log_mirror (getenv (LOG_FILE_ENV));
+	g_timeout_add_seconds (1, ui_log_tick, NULL);
+
 	window = create_window(data);
 	
 	g_signal_connect (window, "destroy", G_CALLBACK (gtk_main_quit), NULL);
 
+	/* follow the adapters coming and going */
+	if ((hotplug = hotplug_open ()) != NULL)
+		g_io_add_watch (g_io_channel_unix_new (hotplug_fd (hotplug)), G_IO_IN, hotplug_event, NULL);
+
 	gtk_widget_show_all(window);
 	gtk_main();
 
+	ui_stop ();
+	hotplug_close (hotplug);
 	free (data);
 	return 0;
 }
 
 GtkWidget* create_window(window_t* data)
 {
-	struct stat my_stat;
 	GtkWidget *window;
 	GtkWidget *box;
 	GtkWidget *menubar;
@@ -103,6 +128,7 @@ GtkWidget* create_window(window_t* data)
 	GtkWidget *setup_label, *setup_box, *setup_port, *port, *setup_rate, *rate, *radio;
 	GtkWidget *setup_file, *file_box, *file_label, *file_text, *file_button;
 	GtkWidget *program_label, *program_box, *progress_label, *progress_bar, *button;
+	GtkWidget *gang_label, *gang_grid, *gang_port, *gang_bar, *gang_button;
 	GdkRGBA rgba, foreground;
 	GtkAccelGroup *accel_group = NULL;
 	GSList *group = NULL;
@@ -162,20 +188,15 @@ GtkWidget* create_window(window_t* data)
 	port = gtk_combo_box_text_new ();
 	gtk_box_pack_start (GTK_BOX(setup_box), port, FALSE, TRUE, 0);
 	gtk_widget_set_size_request (port, -1, -1);
-
-	for ( int i = 0; i < DEVICES; i++) {
-//		if (stat (devices_list[i], &my_stat) == 0)
-			gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT(port), devices_list[i]);
-	}
-//	gtk_combo_box_set_active (GTK_COMBO_BOX(port), 0);
-	data->port = port;
+	data->port = port;		/* filled by ports_refresh() */
 
 	setup_rate = gtk_label_new ("Baud Rate");
 	gtk_box_pack_start (GTK_BOX(setup_box), setup_rate, FALSE, TRUE, 0);
 	gtk_widget_set_size_request (setup_rate, 80, -1);
 	gtk_misc_set_alignment (GTK_MISC(setup_rate), 0.8, 0.5);
 
-	rate = gtk_combo_box_text_new ();
+	/* any other rate can be typed in, see serial_get_baud() */
+	rate = gtk_combo_box_text_new_with_entry ();
 	gtk_box_pack_start (GTK_BOX(setup_box), rate, FALSE, TRUE, 0);
 	gtk_widget_set_size_request (rate, -1, -1);
 	
@@ -237,6 +258,34 @@ GtkWidget* create_window(window_t* data)
 	button = gtk_button_new_with_mnemonic ("Download");
 	gtk_box_pack_start (GTK_BOX(program_box), button, FALSE, FALSE, 0);
 	gtk_widget_set_size_request (button, 90, 30);
+	data->download = button;
+
+	/* gang programming: one progress bar per port, or per fixture slot */
+	gang_label = gtk_label_new ("Gang :");
+	gtk_box_pack_start (GTK_BOX(box), gang_label, FALSE, FALSE, 0);
+	gtk_widget_set_size_request (gang_label, 100, 30);
+	gtk_misc_set_alignment (GTK_MISC(gang_label), 0.01, 0.5);
+
+	gang_grid = gtk_grid_new ();
+	gtk_box_pack_start (GTK_BOX(box), gang_grid, FALSE, FALSE, 0);
+	for (int i = 0; i < DEVICES; i++)
+	{
+		gang_port = gtk_label_new ("");
+		gtk_widget_set_size_request (gang_port, 100, -1);
+		gtk_grid_attach (GTK_GRID(gang_grid), gang_port, 0, i, 1, 1);
+		data->gang_port[i] = gang_port;
+
+		gang_bar = gtk_progress_bar_new ();
+		gtk_widget_set_size_request (gang_bar, 390, -1);
+		gtk_progress_bar_set_show_text (GTK_PROGRESS_BAR(gang_bar), TRUE);
+		gtk_progress_bar_set_text (GTK_PROGRESS_BAR(gang_bar), "idle");
+		gtk_grid_attach (GTK_GRID(gang_grid), gang_bar, 1, i, 1, 1);
+		data->gang_bar[i] = gang_bar;
+	}
+	gang_button = gtk_button_new_with_mnemonic ("Download _All");
+	gtk_grid_attach (GTK_GRID(gang_grid), gang_button, 2, 0, 1, 1);
+	gtk_widget_set_size_request (gang_button, 90, 30);
+	data->gang_button = gang_button;
 
 	gtk_container_add (GTK_CONTAINER(window), box);
 
@@ -246,21 +295,43 @@ GtkWidget* create_window(window_t* data)
 	g_signal_connect (button, "clicked",
 					  G_CALLBACK (button_download_clicked),
 					  NULL);
+	g_signal_connect (gang_button, "clicked",
+					  G_CALLBACK (button_gang_clicked),
+					  NULL);
 	g_signal_connect (port, "changed",
 					  G_CALLBACK (port_changed_activate),
 					  NULL);
+	ports_refresh ();
 	return window;
 }
 
+/* what is known about the port picked, in the terminal */
 void port_changed_activate (GtkComboBox *combobox, gpointer user_data)
 {
-	struct stat my_stat;
+	char buf[300];
 	gchar *text;
-	text = gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (combobox));
-	if (stat (text, &my_stat) == 0)
-		printf("test\n");
+	int i, n, slot;
+
+	if ((text = gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (combobox))) == NULL)
+		return;
+	for (i = 0; i < nports; i++)
+		if (strcmp (ports[i].device, text) == 0)
+			break;
+	if (i == nports)
+		n = snprintf (buf, sizeof(buf), "%s: gone", text);
 	else
-		printf("faliure\n");
+	{
+		n = snprintf (buf, sizeof(buf), "%s: %s", text, ports[i].driver[0] ? ports[i].driver : "no driver");
+		if (ports[i].usb_path[0])
+			n += snprintf (buf + n, sizeof(buf) - n, ", USB %04x:%04x at %s", ports[i].vid, ports[i].pid, ports[i].usb_path);
+		if (ports[i].serial[0])
+			n += snprintf (buf + n, sizeof(buf) - n, ", serial %s", ports[i].serial);
+		if (bound > 0 && (slot = hotplug_slot_of (slots, DEVICES, &ports[i])) >= 0)
+			n += snprintf (buf + n, sizeof(buf) - n, ", slot %d", slot);
+	}
+	g_free (text);
+	strncat (buf, "\n\r", sizeof(buf) - strlen (buf) - 1);
+	vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen (buf));
 }
 
 GtkWidget* create_menu_bar(GtkWidget *window, GtkWidget *box, GtkAccelGroup *accel_group)
@@ -269,7 +340,12 @@ GtkWidget* create_menu_bar(GtkWidget *window, GtkWidget *box, GtkAccelGroup *acc
 	GtkWidget *file, *edit, *help;
 	GtkWidget *file_menu, *edit_menu, *help_menu;
 	GtkWidget *item_quit;
+	GtkWidget *item_trace;		/* the item of file menushell: save protocol trace */
 	GtkWidget *item_prefer;		/* the item of edit menushell: perferences */
+	GtkWidget *item_pipeline;	/* the item of edit menushell: pipelined handshake */
+	GtkWidget *item_latency;	/* the item of edit menushell: low latency USB adapters */
+	GtkWidget *item_autoflash;	/* the item of edit menushell: flash bound slots on plug */
+	GtkWidget *item_verbose;	/* the item of edit menushell: debug lines of the protocol */
 	GtkWidget *about;
 
 	menubar = gtk_menu_bar_new ();
@@ -291,6 +367,9 @@ GtkWidget* create_menu_bar(GtkWidget *window, GtkWidget *box, GtkAccelGroup *acc
 	gtk_menu_shell_append (GTK_MENU_SHELL (menubar), help);
 
 	/* Create file menu item*/
+	item_trace = gtk_menu_item_new_with_label ("Save Protocol Trace...");
+	gtk_menu_shell_append (GTK_MENU_SHELL (file_menu), item_trace);
+
 	item_quit = gtk_menu_item_new_with_label ("Quit");
 	gtk_widget_add_accelerator (item_quit, "activate", accel_group,
 			GDK_KEY_q, GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
@@ -302,6 +381,21 @@ GtkWidget* create_menu_bar(GtkWidget *window, GtkWidget *box, GtkAccelGroup *acc
 			GDK_KEY_s, GDK_SHIFT_MASK | GDK_CONTROL_MASK, GTK_ACCEL_VISIBLE);
 	gtk_menu_shell_append (GTK_MENU_SHELL (edit_menu), item_prefer);
 
+	item_pipeline = gtk_check_menu_item_new_with_label ("Pipelined handshake");
+	gtk_menu_shell_append (GTK_MENU_SHELL (edit_menu), item_pipeline);
+	data->pipeline = item_pipeline;
+
+	item_latency = gtk_check_menu_item_new_with_label ("Low latency adapter");
+	gtk_menu_shell_append (GTK_MENU_SHELL (edit_menu), item_latency);
+	data->latency = item_latency;
+
+	item_verbose = gtk_check_menu_item_new_with_label ("Verbose protocol log");
+	gtk_menu_shell_append (GTK_MENU_SHELL (edit_menu), item_verbose);
+
+	item_autoflash = gtk_check_menu_item_new_with_label ("Flash slots on plug");
+	gtk_menu_shell_append (GTK_MENU_SHELL (edit_menu), item_autoflash);
+	data->autoflash = item_autoflash;
+
 	/* Create help menu item */
 	about = gtk_menu_item_new_with_label ("About");
 	gtk_menu_shell_append (GTK_MENU_SHELL (help_menu), about);
@@ -313,8 +407,14 @@ GtkWidget* create_menu_bar(GtkWidget *window, GtkWidget *box, GtkAccelGroup *acc
 	g_signal_connect(item_quit, "activate",
 			 G_CALLBACK (menu_quit_activate), NULL);
 
+	g_signal_connect(item_trace, "activate",
+			 G_CALLBACK (menu_save_trace_activate), NULL);
+
 	g_signal_connect (item_prefer, "activate",
 			G_CALLBACK (menu_preferences_activate), NULL);
+
+	g_signal_connect (item_verbose, "toggled",
+			G_CALLBACK (menu_verbose_toggled), NULL);
 	return menubar;
 }
 
@@ -336,10 +436,44 @@ void menu_quit_activate (GtkMenuItem *menuitem, gpointer user_data)
 	gtk_widget_destroy (dialog);
 }
 
+void menu_save_trace_activate (GtkMenuItem *menuitem, gpointer user_data)
+{
+	GtkWidget *dialog;
+	char buf[300];
+
+	dialog = gtk_file_chooser_dialog_new ("Save Protocol Trace",
+										  GTK_WINDOW(data->window),
+										  GTK_FILE_CHOOSER_ACTION_SAVE,
+										  "_Cancle", GTK_RESPONSE_CANCEL,
+										  "_Save", GTK_RESPONSE_ACCEPT,
+										  NULL);
+	gtk_file_chooser_set_current_name (GTK_FILE_CHOOSER (dialog), "trace.json");
+	gtk_file_chooser_set_do_overwrite_confirmation (GTK_FILE_CHOOSER (dialog), TRUE);
+
+	if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT) 
+	{
+		gchar *filename;
+
+		filename = gtk_file_chooser_get_filename (GTK_FILE_CHOOSER (dialog));
+		if (trace_save (filename) == 0)
+			snprintf (buf, sizeof(buf), "Trace saved to %s\n\r", filename);
+		else
+			snprintf (buf, sizeof(buf), "Failed to save trace to %s\n\r", filename);
+		vte_terminal_feed (VTE_TERMINAL(data->vte), buf, strlen (buf));
+		g_free (filename);
+	}
+	gtk_widget_destroy (dialog);
+}
+
 void menu_about_activate (GtkMenuItem *menuitem, gpointer user_data)
 {
 }
 
+void menu_verbose_toggled (GtkCheckMenuItem *menuitem, gpointer user_data)
+{
+	log_set_level (gtk_check_menu_item_get_active (menuitem) ? LOG_LVL_DEBUG : LOG_LVL_INFO);
+}
+
 void menu_preferences_activate (GtkMenuItem *menuitem, gpointer user_data)
 {
 	char buf[100];
@@ -392,171 +526,475 @@ void button_select_file_clicked (GtkButton *button, gpointer user_data)
 	gtk_widget_destroy (dialog);
 }
 
-void button_download_clicked (GtkButton *button, gpointer user_data)
+/*
+ * The workers never touch GTK. Their lines go to the log ring (log.c),
+ * their progress to an event ring of their own; both are drained by
+ * ui_drain() in the main loop at most UI_REFRESH_HZ times a second, the
+ * lines of a tick in one terminal feed. A worker never waits for a
+ * redraw, and a fast link does not mean more redraws.
+ */
+#define SINGLE	DEVICES		/* the ring of the single port download */
+
+static event_ring_t	rings[DEVICES + 1];
+static int			single_busy;
+static guint		drain_source;
+static int			ui_quit;		/* the main loop is gone, nobody drains */
+
+static void ui_post (int ring, event_type_t type, double fraction, const char *text)
+{
+	event_t ev;
+
+	ev.type = type;
+	ev.fraction = fraction;
+	snprintf (ev.text, sizeof(ev.text), "%s", text);
+	if (__atomic_load_n (&ui_quit, __ATOMIC_ACQUIRE))
+		return;
+	if (type != EVENT_DONE)
+		event_put (&rings[ring], &ev);		/* a lost progress is outdated anyway */
+	else
+		while (event_put (&rings[ring], &ev) != 0)
+			g_usleep (1000);	/* the job is over, the wait costs nothing */
+}
+
+static void ui_bar (int ring, double fraction, const char *text)
 {
-	pthread_t	wr;
-	int err;
-//	void *tret;
+	GtkWidget *bar = ring == SINGLE ? data -> progressbar : data -> gang_bar[ring];
 
-	if((err = pthread_create (&wr, NULL, write_flash, NULL)) != 0)
-		printf("Can't create thread wr.\n");
-//	if((err = pthread_join (wr, &tret)) != 0)
-//		printf("Can't join with thread wr.\n");
-//	printf("Thread wr exit code %ld.\n", (long)tret);
+	gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (bar), fraction);
+	gtk_progress_bar_set_text (GTK_PROGRESS_BAR (bar), text);
 }
 
-extern parser_ops_t PARSER_HEX;
-struct port_options port_opts = {
-	.device				= NULL,
-	.baudrate			= SERIAL_BAUD_576000,
-	.serial_mode		= "8e1",
-	.bus_addr			= 0,
-	.rx_frame_max		= STM32_MAX_RX_FRAME,
-	.tx_frame_max		= STM32_MAX_TX_FRAME,
-};
+/* "write 45%  11.2 KiB/s, 3 s left" */
+static void ui_progress_text (flash_job_t *job, flash_phase_t phase, double fraction,
+							  char *buf, size_t size)
+{
+	char rate[48];
+	int n;
+
+	n = snprintf (buf, size, "%s %d%%", flash_phase_name (phase), (int)(fraction * 100));
+	flash_rate_str (job, rate, sizeof(rate));
+	if (rate[0] && n > 0 && (size_t)n < size)
+		snprintf (buf + n, size - n, "  %s", rate);
+}
 
-void* write_flash (void *user_data)
+/* after the main loop: stop the downloads between two frames and wait for them */
+void ui_stop (void)
 {
-	const char			*filename;
-	char				buf[1000];
-	parser_t			parser_err;
-	stm32_t				stm_err;
+	__atomic_store_n (&ui_quit, 1, __ATOMIC_RELEASE);
+	worker_shutdown ();
+}
 
-	port_interface_t	*port		= NULL;
-	parser_ops_t		*parser		= NULL;	
-	stm32_struct_t		*stm		= NULL;
-	void				*storage	= NULL;
+/* the download buttons cancel while their jobs run */
+static void ui_buttons (void)
+{
+	static int shown = -1;
+	int i, gang_busy = 0;
+
+	for (i = 0; i < DEVICES; i++)
+		gang_busy |= row_busy[i];
+	if (shown == (single_busy | gang_busy << 1))
+		return;
+	shown = single_busy | gang_busy << 1;
+	gtk_button_set_label (GTK_BUTTON (data -> download), single_busy ? "Cancel" : "Download");
+	gtk_button_set_label (GTK_BUTTON (data -> gang_button), gang_busy ? "Cancel _All" : "Download _All");
+}
 
-	vte_terminal_reset (VTE_TERMINAL (data -> vte), TRUE, TRUE);
-	gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (data -> progressbar), 0);
-	if (gtk_entry_get_text_length (GTK_ENTRY (data -> filename)) != 0)
-	{
-		filename = gtk_entry_get_text (GTK_ENTRY (data -> filename));
+static gboolean ui_drain (gpointer user_data)
+{
+	static char lines[16384];
+	event_t ev, last;
+	size_t len;
+	int i, progress, busy = 0;
 
-		parser = &PARSER_HEX;
-		if((storage = parser -> init ()) == NULL)
-		{
-			sprintf (buf, "Failed to initialize parser %s.\n\r", parser -> name);
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-			goto close;
-		}
-		if((parser_err = parser -> open (storage, filename)) != PARSER_OK)
-		{
-			sprintf (buf, "Failed to open the file: %s.\n\r", g_path_get_basename (filename));
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-			goto close;
-		}
+	while ((len = log_drain (lines, sizeof(lines), "\n\r")) != 0)
+		vte_terminal_feed (VTE_TERMINAL (data -> vte), lines, len);
 
-		sprintf (buf, "Using Parser : %s\n\r", parser -> name);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		
-		port_opts.device = gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (data -> port));
-		if ( port_open (&port_opts, &port) != PORT_OK)
+	for (i = 0; i <= DEVICES; i++)
+	{
+		/* only the last progress of the tick is drawn */
+		progress = 0;
+		while (event_get (&rings[i], &ev))
 		{
-			sprintf (buf, "Failed to open the port: %s\n\r", port_opts.device);
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-			goto close;
+			if (ev.type == EVENT_PROGRESS)
+			{
+				last = ev;
+				progress = 1;
+				continue;
+			}
+			if (ev.text[0])
+				ui_bar (i, ev.fraction, ev.text);
+			progress = 0;
+			if (i == SINGLE)
+				single_busy = 0;
+			else
+				row_busy[i] = 0;
 		}
-		sprintf (buf, "Interface %s: %s\n\r", port -> name, port ->get_cfg_str (port));
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
+		if (progress)
+			ui_bar (i, last.fraction, last.text);
+		busy |= i == SINGLE ? single_busy : row_busy[i];
+	}
+	ui_buttons ();
+	if (busy || log_pending ())
+		return TRUE;
+	drain_source = 0;
+	return FALSE;
+}
+
+/* after a job started, in the main loop */
+static void ui_start (void)
+{
+	ui_buttons ();
+	if (drain_source == 0)
+		drain_source = g_timeout_add (1000 / UI_REFRESH_HZ, ui_drain, NULL);
+}
 
-		if ((stm = stm32_init (port)) == NULL)
+/* lines logged outside of a job, e.g. closing a session on unplug */
+gboolean ui_log_tick (gpointer user_data)
+{
+	if (log_pending ())
+		ui_start ();
+	return TRUE;
+}
+
+/*
+ * Downloads run on the worker of their port (worker.c): one thread per
+ * port, a job waits there while another one has the port, and the
+ * session stays open from one job to the next whichever button started
+ * it. A ring has one job at a time, row_busy and single_busy say which;
+ * ring_device is the port its job runs on, for cancelling it.
+ */
+typedef struct gang_request
+{
+	gchar			*filename;
+	flash_image_t	image;						/* parsed once for all the rows */
+	int				refs;						/* the jobs and the caller */
+	unsigned int	init_flags;
+	int				low_latency;
+	int				autotune;
+	serial_baud_t	baudrate;
+	int				row;						/* one row or SINGLE, -1 for all rows */
+	char			device[DEVICES + 1][64];	/* row_device, then the single port */
+} gang_request_t;
+
+typedef struct ui_job
+{
+	worker_job_t	work;
+	gang_request_t	*req;
+	int				row;						/* a gang row or SINGLE */
+} ui_job_t;
+
+static char ring_device[DEVICES + 1][64];
+
+static void gang_log (flash_job_t *job, const char *msg)
+{
+	log_msg (LOG_LVL_INFO, job -> device, "%s", msg);
+}
+
+/* the single download has the terminal to itself */
+static void write_flash_log (flash_job_t *job, const char *msg)
+{
+	log_msg (LOG_LVL_INFO, NULL, "%s", msg);
+}
+
+static void gang_progress (flash_job_t *job, flash_phase_t phase, double fraction)
+{
+	char buf[EVENT_TEXT_MAX];
+
+	ui_progress_text (job, phase, fraction, buf, sizeof(buf));
+	ui_post ((int)(intptr_t)job -> user, EVENT_PROGRESS, fraction, buf);
+}
+
+/* the job of a ring is over: summary line, final state of the bar */
+static void gang_done (int row, const flash_job_t *job)
+{
+	char buf[300];
+
+	flash_report_line (job, buf, sizeof(buf));
+	log_msg (LOG_LVL_INFO, NULL, "%s", buf);
+	if (job -> phase == FLASH_DONE)
+		ui_post (row, EVENT_DONE, 1, "done");
+	else
+	{
+		snprintf (buf, sizeof(buf), "%s in %s", job -> cancelled ? "cancelled" : "failed",
+				  flash_phase_name (job -> failed_in));
+		ui_post (row, EVENT_DONE, 0, buf);
+	}
+}
+
+static void gang_request_put (gang_request_t *req)
+{
+	if (__atomic_sub_fetch (&req -> refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	flash_image_free (&req -> image);
+	g_free (req -> filename);
+	free (req);
+}
+
+/* the settings of the window and the image for a job on row, -1 for all rows */
+static gang_request_t* gang_request_new (int row)
+{
+	gang_request_t *req;
+
+	gchar *port;
+
+	if (gtk_entry_get_text_length (GTK_ENTRY (data -> filename)) == 0)
+		return NULL;
+	if ((port = gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (data -> port))) == NULL
+	    && row == SINGLE)
+		return NULL;
+
+	req = calloc (1, sizeof(gang_request_t));
+	req -> filename = g_strdup (gtk_entry_get_text (GTK_ENTRY (data -> filename)));
+	req -> refs = 1;
+	req -> init_flags = gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (data -> pipeline))
+						? STM32_INIT_PIPELINE : 0;
+	req -> low_latency = gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (data -> latency));
+	req -> autotune = !gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (data -> radio));
+	req -> baudrate = serial_get_baud (atoi (gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (data -> baudrate))));
+	req -> row = row;
+	memcpy (req -> device, row_device, sizeof(row_device));
+	if (port)
+		snprintf (req -> device[SINGLE], sizeof(req -> device[SINGLE]), "%s", port);
+	g_free (port);
+
+	if (flash_image_load (&PARSER_HEX, req -> filename, &req -> image) != PARSER_OK)
+	{
+		log_msg (LOG_LVL_ERROR, NULL, "Failed to open the file: %s.", req -> filename);
+		ui_start ();
+		gang_request_put (req);
+		return NULL;
+	}
+	log_msg (LOG_LVL_INFO, NULL, "Using Parser : %s", PARSER_HEX.name);
+	return req;
+}
+
+static void gang_job_init (flash_job_t *job, gang_request_t *req, int row)
+{
+	flash_job_init (job, &port_opts, req -> device[row], &req -> image);
+	job -> init_flags = req -> init_flags;
+	job -> opts.low_latency = req -> low_latency;
+	/* High-speed: the fastest rate this adapter handles reliably */
+	job -> autotune = req -> autotune;
+	if (!req -> autotune)
+		/* Low-speed: the rate picked by hand */
+		job -> opts.baudrate = req -> baudrate;
+	job -> verify = row != SINGLE;
+	job -> log = gang_log;
+	job -> progress = gang_progress;
+	job -> user = (void *)(intptr_t)row;
+}
+
+/* on the worker thread, the job is over or was cancelled before it ran */
+static void ui_job_done (worker_job_t *work)
+{
+	ui_job_t *job = (ui_job_t *)work -> user;
+
+	gang_done (job -> row, &work -> flash);
+	gang_request_put (job -> req);
+	free (job);
+}
+
+/* queue the download of row on the worker of its port */
+static int ui_submit (gang_request_t *req, int row, void (*run) (worker_job_t *))
+{
+	ui_job_t *job;
+
+	if ((job = calloc (1, sizeof(ui_job_t))) == NULL)
+		return -1;
+	gang_job_init (&job -> work.flash, req, row);
+	if (row == SINGLE)
+		job -> work.flash.log = write_flash_log;
+	job -> work.run = run;
+	job -> work.done = ui_job_done;
+	job -> work.user = job;
+	job -> req = req;
+	job -> row = row;
+	__atomic_add_fetch (&req -> refs, 1, __ATOMIC_ACQ_REL);
+	if (worker_submit (&job -> work) != 0)
+	{
+		gang_request_put (req);
+		free (job);
+		return -1;
+	}
+	snprintf (ring_device[row], sizeof(ring_device[row]), "%s", req -> device[row]);
+	return 0;
+}
+
+/* one row, -1 for every row with a port and no job */
+static void gang_start (int row, void (*run) (worker_job_t *))
+{
+	gang_request_t *req;
+
+	if ((req = gang_request_new (row)) == NULL)
+		return;
+	for (int i = 0; i < DEVICES; i++)
+	{
+		if ((row >= 0 && i != row) || row_busy[i])
+			continue;
+		if (req -> device[i][0] == 0)
 		{
-			sprintf (buf, "Failed to initialize stm32 device.\n\r");
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-			goto close;
+			ui_bar (i, 0, "no device");
+			continue;
 		}
+		if (ui_submit (req, i, run) == 0)
+			row_busy[i] = 1;
+		else
+			ui_bar (i, 0, "can't start");
+	}
+	gang_request_put (req);
+	ui_start ();
+}
 
-		sprintf (buf, "Version		: 0x%02x\n\r", stm->bl_version);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		if (port -> flags & PORT_GVR_ETX)
+/* with a job running on any row, the button cancels them */
+void button_gang_clicked (GtkButton *button, gpointer user_data)
+{
+	int i, busy = 0;
+
+	for (i = 0; i < DEVICES; i++)
+		if (row_busy[i])
 		{
-			sprintf (buf, "Option 1	: 0x%02x\n\r", stm->option1);
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-			sprintf (buf, "Option 2	: 0x%02x\n\r", stm->option2);
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
+			worker_cancel (ring_device[i]);
+			busy = 1;
 		}
-		sprintf (buf, "Device ID	: 0x%04x (%s)\n\r", stm->pid, stm->dev->name);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		sprintf (buf, "- RAM		: %dKiB (%db reserved by bootloader)\n\r", (stm->dev->ram_end - 0x20000000) / 1024, stm->dev->ram_start - 0x20000000);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		sprintf (buf, "- Flash		: %dKiB (sector size: %dx%d)\n\r", (stm->dev->fl_end - stm->dev->fl_start) / 1024, stm->dev->fl_pps, stm->dev->fl_ps);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		sprintf (buf, "- Option RAM	: %db\n\r", stm->dev->opt_end - stm->dev->opt_start + 1);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		sprintf (buf, "- System RAM	: %dKiB\n\r", (stm->dev->mem_end - stm->dev->mem_start) / 1024);
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
+	if (!busy)
+		gang_start (-1, NULL);
+}
 
-		uint8_t data_buf[10000];
-		uint32_t addr, start, end;
-		uint32_t first_page, num_page;
+/* a retry while waiting for the bootloader: its failure is not news */
+static void auto_log (flash_job_t *job, const char *msg)
+{
+	if (job -> phase != FLASH_CONNECT)
+		gang_log (job, msg);
+}
 
-		start = stm->dev->fl_start;
-		end = stm->dev->fl_end;
-		first_page = 0;
-		num_page = 0xff;	/* mass erase */
+/*
+ * Flash on plug: the adapter of a slot appeared. The board behind may
+ * be powered a moment later, so the connection is retried until the
+ * bootloader answers, the adapter is gone again or the job cancelled.
+ */
+static void auto_flash (worker_job_t *work)
+{
+	flash_job_t *job = &work -> flash;
+	int row = ((ui_job_t *)work -> user) -> row, tries;
 
-		sprintf (buf, "Write data to flash memory.\n\r");
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		
-		off_t	offset = 0;
-		unsigned int size, len;
-		unsigned int max_wlen, max_rlen;
+	for (tries = 1; ; tries++)
+	{
+		flash_run (job);
+		if (job -> phase == FLASH_DONE || job -> failed_in != FLASH_CONNECT || job -> cancelled
+		    || tries == AUTOFLASH_TRIES || access (job -> device, F_OK) != 0)
+			break;
+		ui_post (row, EVENT_PROGRESS, 0, "waiting for the bootloader");
+		g_usleep (AUTOFLASH_WAIT_MS * 1000);
+		job -> log = auto_log;
+	}
+}
 
-		max_wlen = port_opts.tx_frame_max - 2;	/* skip len and crc */
-		max_wlen &= ~3;		/* 32 bit aligned*/
+/*
+ * Assign the ports found to the gang rows: by the slots file when there
+ * is one, else in order. Called at start and after /dev changed.
+ */
+void ports_refresh (void)
+{
+	char old[DEVICES][64], text[128];
+	gchar *active;
+	int i, row, next = 0;
+
+	memcpy (old, row_device, sizeof(old));
+	memset (row_device, 0, sizeof(row_device));
+	nports = hotplug_scan (ports, HOTPLUG_PORTS_MAX);
+	bound = hotplug_slots_load (slots, DEVICES);
+	for (i = 0; i < nports; i++)
+	{
+		if (bound > 0)
+			row = hotplug_slot_of (slots, DEVICES, &ports[i]);
+		else
+			row = next < DEVICES ? next++ : -1;
+		if (row >= 0 && row_device[row][0] == 0)
+			snprintf (row_device[row], sizeof(row_device[row]), "%s", ports[i].device);
+	}
 
-		max_rlen = port_opts.rx_frame_max;
-		max_rlen = max_rlen < max_wlen ? max_rlen : max_wlen;
+	for (row = 0; row < DEVICES; row++)
+	{
+		if (bound > 0)
+			snprintf (text, sizeof(text), "%d %s", row, row_device[row][0] ? row_device[row] + 5 : "-");
+		else
+			snprintf (text, sizeof(text), "%s", row_device[row]);
+		gtk_label_set_text (GTK_LABEL (data -> gang_port[row]), text);
+		if (strcmp (old[row], row_device[row]) == 0 || row_busy[row])
+			continue;
+
+		/* another adapter, or none: the session was on the old one */
+		if (old[row][0])
+			worker_forget (old[row]);
+		gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (data -> gang_bar[row]), 0);
+		gtk_progress_bar_set_text (GTK_PROGRESS_BAR (data -> gang_bar[row]),
+								   row_device[row][0] ? "idle" : "no device");
+		if (row_device[row][0] && bound > 0
+		    && gtk_check_menu_item_get_active (GTK_CHECK_MENU_ITEM (data -> autoflash)))
+			gang_start (row, auto_flash);
+	}
 
-		size = parser -> size (storage);
+	/* the port list, keeping the port picked */
+	active = gtk_combo_box_text_get_active_text (GTK_COMBO_BOX_TEXT (data -> port));
+	g_signal_handlers_block_by_func (data -> port, port_changed_activate, NULL);
+	gtk_combo_box_text_remove_all (GTK_COMBO_BOX_TEXT (data -> port));
+	for (i = 0; i < nports; i++)
+	{
+		gtk_combo_box_text_append_text (GTK_COMBO_BOX_TEXT (data -> port), ports[i].device);
+		if (active && strcmp (active, ports[i].device) == 0)
+			gtk_combo_box_set_active (GTK_COMBO_BOX (data -> port), i);
+	}
+	g_signal_handlers_unblock_by_func (data -> port, port_changed_activate, NULL);
+	g_free (active);
+}
 
-		sprintf (buf, "Erasing flash memory.\n\r");
-		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		if ((stm_err = stm32_erase_memory (stm, first_page, num_page)) != STM32_OK)
-		{
-			sprintf (buf, "Faild to erase flash memory.\n\r");
-			vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-		}
-		
-		addr = start;
-		while (addr < end && offset < size)
-		{
-			uint32_t left = end - addr;
-			len = max_wlen > left ? left : max_wlen;
-			len = len > size - offset ? size - offset : len;
+static gboolean ports_refresh_timeout (gpointer user_data)
+{
+	refresh_source = 0;
+	ports_refresh ();
+	return FALSE;
+}
 
-			if (parser -> read (storage, data_buf, &len) != PARSER_OK)
-				goto close;
-			if (len == 0)
-			{
-				sprintf (buf, "Failed to read %s file.\n\r", parser -> name);
-				vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-				goto close;
-			}
+/* /dev changed: rescan once udev is done with the burst of events */
+gboolean hotplug_event (GIOChannel *source, GIOCondition condition, gpointer user_data)
+{
+	if (hotplug_changed (hotplug) && refresh_source == 0)
+		refresh_source = g_timeout_add (HOTPLUG_SETTLE_MS, ports_refresh_timeout, NULL);
+	return TRUE;
+}
 
-			if ((stm_err = stm32_write_memory (stm, addr, data_buf, len)) != STM32_OK)
-			{
-				sprintf (buf, "Failed to write flash memory at address 0x%08x.\n\r", addr);
-				vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
-				goto close;
-			}
+/* with the single download running, the button cancels it */
+void button_download_clicked (GtkButton *button, gpointer user_data)
+{
+	gang_request_t *req;
+	char buf[100];
 
-			addr += len;
-			offset += len;
-			gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (data -> progressbar), (1.0 / size) * offset);
-		}
-		sprintf (buf, "Done!\n\r");
+	if (single_busy)
+	{
+		worker_cancel (ring_device[SINGLE]);
+		return;
+	}
+	vte_terminal_reset (VTE_TERMINAL (data -> vte), TRUE, TRUE);
+	gtk_progress_bar_set_fraction (GTK_PROGRESS_BAR (data -> progressbar), 0);
+	gtk_progress_bar_set_text (GTK_PROGRESS_BAR (data -> progressbar), "");
+	if (gtk_entry_get_text_length (GTK_ENTRY (data -> filename)) == 0
+	    || gtk_combo_box_get_active (GTK_COMBO_BOX (data -> port)) < 0)
+	{
+		sprintf (buf, "Failed to choose file or port.\n\r");
 		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
+		return;
 	}
-	else
+	if ((req = gang_request_new (SINGLE)) == NULL)
+		return;
+	if (!req -> autotune && req -> baudrate == SERIAL_BAUD_INVALID)
 	{
-		sprintf (buf, "Failed to choose file.\n\r");
+		sprintf (buf, "Baud rate not supported.\n\r");
 		vte_terminal_feed (VTE_TERMINAL (data -> vte), buf, strlen(buf));
+		gang_request_put (req);
+		return;
 	}
-close:
-	if(storage)			parser -> close (storage);
-	if(stm)				stm32_close (stm);
-	if(port)			port -> close (port);
-	pthread_exit ((void*)0);
+	if (ui_submit (req, SINGLE, NULL) == 0)
+		single_busy = 1;
+	gang_request_put (req);
+	ui_start ();
 }
@@ -22,8 +22,13 @@
 #ifndef _MAIN_H
 #define _MAIN_H
 
-#define DEVICES 8
-#define BAUDRATE 19
+#define DEVICES 8				/* gang rows, one per fixture slot */
+#define BAUDRATE 21
+
+#define UI_REFRESH_HZ		30		/* most redraws a second from the worker events */
+#define HOTPLUG_SETTLE_MS	300		/* rescan the ports this long after /dev changed */
+#define AUTOFLASH_TRIES		40		/* connection attempts after an adapter appeared */
+#define AUTOFLASH_WAIT_MS	250
 
 typedef struct termios termios_info_t;
 
@@ -42,6 +47,13 @@ typedef struct
 	GtkWidget *radio;
 	GtkWidget *filename;
 	GtkWidget *progressbar;
+	GtkWidget *download;		//the single download button, cancels while running
+	GtkWidget *pipeline;		//menu item: pipelined bootloader handshake
+	GtkWidget *latency;			//menu item: low latency profile of USB adapters
+	GtkWidget *autoflash;		//menu item: flash the bound slots on plug
+	GtkWidget *gang_port[DEVICES];	//gang programming: port of each row
+	GtkWidget *gang_bar[DEVICES];	//gang programming: progress of each port
+	GtkWidget *gang_button;		//flashes all rows, cancels while any runs
 
 }window_t;
 
@@ -52,10 +64,15 @@ GtkWidget* create_menu_bar(GtkWidget*, GtkWidget*, GtkAccelGroup*);
 /* signal callback function */
 void menu_quit_activate (GtkMenuItem*, gpointer);
 void menu_about_activate (GtkMenuItem*, gpointer);
+void menu_save_trace_activate (GtkMenuItem*, gpointer);
 void menu_preferences_activate (GtkMenuItem*, gpointer);
+void menu_verbose_toggled (GtkCheckMenuItem*, gpointer);
 void button_select_file_clicked (GtkButton*, gpointer);
 void button_download_clicked (GtkButton*, gpointer);
+void button_gang_clicked (GtkButton*, gpointer);
 void port_changed_activate (GtkComboBox*, gpointer);
-
-void* write_flash (void* user_data);
+gboolean hotplug_event (GIOChannel*, GIOCondition, gpointer);
+void ports_refresh (void);
+gboolean ui_log_tick (gpointer);
+void ui_stop (void);
 #endif
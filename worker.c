@@ -0,0 +1,235 @@
+/******************************************************************************
+ * one worker thread per port, running queued flash jobs
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "worker.h"
+#include "session.h"
+#include "log.h"
+
+typedef struct worker
+{
+	char				device[256];
+	pthread_t			thread;
+	pthread_cond_t		cond;
+	worker_job_t		*head, *tail;
+	worker_job_t		*current;
+	session_t			*session;	/* the worker's while current is set */
+	int					quit;
+} worker_t;
+
+/* protects the workers and their queues */
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static worker_t workers[WORKER_MAX];
+static int nworkers;
+
+static void* worker_main(void *arg)
+{
+	worker_t *w = (worker_t *)arg;
+	worker_job_t *job;
+
+	pthread_mutex_lock(&worker_lock);
+	while (1)
+	{
+		while (w->head == NULL && !w->quit)
+			pthread_cond_wait(&w->cond, &worker_lock);
+		if ((job = w->head) == NULL)
+			break;
+		if ((w->head = job->next) == NULL)
+			w->tail = NULL;
+		w->current = job;
+		pthread_mutex_unlock(&worker_lock);
+
+		/* the session stays open from one job to the next */
+		job->flash.session = w->session;
+		if (job->run)
+			job->run(job);
+		else
+			flash_run(&job->flash);
+		w->session = job->flash.session;
+		job->flash.session = NULL;
+
+		pthread_mutex_lock(&worker_lock);
+		w->current = NULL;
+		pthread_mutex_unlock(&worker_lock);
+		if (job->done)
+			job->done(job);
+		pthread_mutex_lock(&worker_lock);
+	}
+	pthread_mutex_unlock(&worker_lock);
+	return NULL;
+}
+
+static int worker_idle(const worker_t *w)
+{
+	return w->head == NULL && w->current == NULL;
+}
+
+/* the worker of device, started or rebound if need be; called with worker_lock held */
+static worker_t* worker_get(const char *device)
+{
+	worker_t *w;
+	int i;
+
+	for (i = 0; i < nworkers; i++)
+		if (strcmp(workers[i].device, device) == 0)
+			return &workers[i];
+
+	if (nworkers < WORKER_MAX)
+	{
+		w = &workers[nworkers];
+		memset(w, 0, sizeof(worker_t));
+		snprintf(w->device, sizeof(w->device), "%s", device);
+		pthread_cond_init(&w->cond, NULL);
+		if (pthread_create(&w->thread, NULL, worker_main, w) != 0)
+		{
+			log_msg(LOG_LVL_ERROR, "worker", "Can't start the worker of %s", device);
+			pthread_cond_destroy(&w->cond);
+			return NULL;
+		}
+		nworkers++;
+		return w;
+	}
+
+	/* all taken: the thread of a port nothing runs on moves over */
+	for (i = 0; i < nworkers; i++)
+		if (worker_idle(&workers[i]))
+		{
+			w = &workers[i];
+			session_close(w->session);
+			w->session = NULL;
+			snprintf(w->device, sizeof(w->device), "%s", device);
+			return w;
+		}
+	log_msg(LOG_LVL_ERROR, "worker", "More than %d ports busy", WORKER_MAX);
+	return NULL;
+}
+
+/* queue job behind the others of its port, -1 if it can't run */
+int worker_submit(worker_job_t *job)
+{
+	worker_t *w;
+
+	pthread_mutex_lock(&worker_lock);
+	if ((w = worker_get(job->flash.device)) == NULL || w->quit)
+	{
+		pthread_mutex_unlock(&worker_lock);
+		return -1;
+	}
+	job->next = NULL;
+	if (w->tail)
+		w->tail->next = job;
+	else
+		w->head = job;
+	w->tail = job;
+	pthread_cond_signal(&w->cond);
+	pthread_mutex_unlock(&worker_lock);
+	return 0;
+}
+
+/* called with worker_lock held */
+static int worker_cancel_jobs(worker_t *w)
+{
+	worker_job_t *job;
+	int n = 0;
+
+	if (w->current)
+	{
+		flash_cancel(&w->current->flash);
+		n++;
+	}
+	/* queued jobs still pass through the worker, to be done at once */
+	for (job = w->head; job; job = job->next, n++)
+		flash_cancel(&job->flash);
+	return n;
+}
+
+/* cancel all jobs of device, NULL for every port; returns how many */
+int worker_cancel(const char *device)
+{
+	int i, n = 0;
+
+	pthread_mutex_lock(&worker_lock);
+	for (i = 0; i < nworkers; i++)
+		if (device == NULL || strcmp(workers[i].device, device) == 0)
+			n += worker_cancel_jobs(&workers[i]);
+	pthread_mutex_unlock(&worker_lock);
+	return n;
+}
+
+/* jobs queued or running on device */
+int worker_pending(const char *device)
+{
+	worker_job_t *job;
+	int i, n = 0;
+
+	pthread_mutex_lock(&worker_lock);
+	for (i = 0; i < nworkers; i++)
+		if (strcmp(workers[i].device, device) == 0)
+		{
+			n = workers[i].current != NULL;
+			for (job = workers[i].head; job; job = job->next)
+				n++;
+		}
+	pthread_mutex_unlock(&worker_lock);
+	return n;
+}
+
+/* the adapter of device is gone: drop its session unless a job has it */
+void worker_forget(const char *device)
+{
+	int i;
+
+	pthread_mutex_lock(&worker_lock);
+	for (i = 0; i < nworkers; i++)
+		if (strcmp(workers[i].device, device) == 0 && worker_idle(&workers[i]))
+		{
+			session_close(workers[i].session);
+			workers[i].session = NULL;
+		}
+	pthread_mutex_unlock(&worker_lock);
+}
+
+/* cancel everything, wait for the workers and close their sessions */
+void worker_shutdown(void)
+{
+	int i;
+
+	pthread_mutex_lock(&worker_lock);
+	for (i = 0; i < nworkers; i++)
+	{
+		worker_cancel_jobs(&workers[i]);
+		workers[i].quit = 1;
+		pthread_cond_signal(&workers[i].cond);
+	}
+	pthread_mutex_unlock(&worker_lock);
+
+	for (i = 0; i < nworkers; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+		pthread_cond_destroy(&workers[i].cond);
+		session_close(workers[i].session);
+	}
+	nworkers = 0;
+}
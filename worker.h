@@ -0,0 +1,53 @@
+/******************************************************************************
+ * one worker thread per port, running queued flash jobs
+ * ****************************************************************************
+ * Copyright (C) 2016
+ * Written by Kart (kartdream@163.com)
+ * 
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ * ****************************************************************************
+ */
+
+#ifndef _WORKER_H
+#define _WORKER_H
+
+#include "flash.h"
+
+#define WORKER_MAX		16		/* ports with a worker, idle ones are rebound */
+
+typedef struct worker_job worker_job_t;
+
+/*
+ * A download queued on the worker of flash.device. The worker lends
+ * it the session of the port for the run and takes it back after.
+ * done is called on the worker thread once the job is over, even when
+ * it was cancelled before it started; the job is the caller's again.
+ */
+struct worker_job
+{
+	flash_job_t			flash;
+	void				(*run)(worker_job_t *job);	/* NULL: flash_run() once */
+	void				(*done)(worker_job_t *job);
+	void				*user;
+	worker_job_t		*next;
+};
+
+int		worker_submit(worker_job_t *job);
+int		worker_cancel(const char *device);
+int		worker_pending(const char *device);
+void	worker_forget(const char *device);
+void	worker_shutdown(void);
+
+#endif